@@ -0,0 +1,103 @@
+""" Benchmark replies with many answers.
+
+Runs rbldnsd with a zone made of many ip4set datasets which all list
+the same address, each with its own A and TXT value (every fourth one
+repeating an earlier value, to exercise duplicate checking), and
+measures how many queries per second it answers for that address.
+
+usage: bench_answers.py [-n ndatasets] [-q nqueries] [rbldnsd-binary...]
+
+Does not need the python3-dns library.
+"""
+import getopt
+import os
+import random
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+PORT = 5301
+ZONE = 'bench.example.com'
+
+def query_packet(name, qtype):
+    """ Build a query for name with EDNS0 payload size of 4096
+    """
+    qid = random.randint(0, 65535)
+    pkt = struct.pack('>HHHHHH', qid, 0, 1, 0, 0, 1)
+    for label in name.split('.'):
+        pkt += struct.pack('B', len(label)) + label.encode('ascii')
+    pkt += struct.pack('>BHH', 0, qtype, 1)
+    pkt += struct.pack('>BHHIH', 0, 41, 4096, 0, 0)
+    return pkt
+
+def write_zones(tmpdir, ndatasets):
+    files = []
+    for i in range(ndatasets):
+        v = i - i % 4 if i % 4 == 3 else i
+        name = os.path.join(tmpdir, 'ds%d' % i)
+        with open(name, 'w') as f:
+            f.write('$TTL %d\n' % (3600 - i))
+            f.write(':127.0.%d.%d:ds %d\n' % (v // 250, v % 250 + 2, v))
+            f.write('127.0.0.2\n')
+        files.append(name)
+    return files
+
+def bench(binary, files, nqueries):
+    cmd = [binary, '-n', '-b', '127.0.0.1/%d' % PORT]
+    if os.getuid() == 0:
+        cmd += ['-u', 'nobody']
+    cmd += ['%s:ip4set:%s' % (ZONE, f) for f in files]
+    daemon = subprocess.Popen(cmd, stdout=subprocess.DEVNULL)
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.settimeout(0.2)
+    pkt = query_packet('2.0.0.127.' + ZONE, 255)	# ANY
+    try:
+        for retry in range(50):
+            if daemon.poll() is not None:
+                raise RuntimeError("%s exited with code %d"
+                                   % (binary, daemon.returncode))
+            sock.sendto(pkt, ('127.0.0.1', PORT))
+            try:
+                reply = sock.recv(65535)
+                break
+            except socket.timeout:
+                pass
+        else:
+            raise RuntimeError("%s is not responding" % binary)
+        nanswers = struct.unpack('>H', reply[6:8])[0]
+        sock.settimeout(2)
+        start = time.time()
+        for i in range(nqueries):
+            sock.sendto(pkt, ('127.0.0.1', PORT))
+            sock.recv(65535)
+        elapsed = time.time() - start
+    finally:
+        daemon.terminate()
+        daemon.wait()
+    return nanswers, nqueries / elapsed
+
+def main():
+    ndatasets, nqueries = 64, 20000
+    opts, binaries = getopt.getopt(sys.argv[1:], 'n:q:')
+    for opt, val in opts:
+        if opt == '-n':
+            ndatasets = int(val)
+        elif opt == '-q':
+            nqueries = int(val)
+    tmpdir = tempfile.mkdtemp()
+    try:
+        os.chmod(tmpdir, 0o755)
+        files = write_zones(tmpdir, ndatasets)
+        for binary in binaries or ['./rbldnsd']:
+            nanswers, qps = bench(binary, files, nqueries)
+            print("%s: %d datasets, %d answers, %.0f queries/sec"
+                  % (binary, ndatasets, nanswers, qps))
+    finally:
+        shutil.rmtree(tmpdir)
+
+if __name__ == '__main__':
+    main()
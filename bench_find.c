@@ -0,0 +1,243 @@
+/* not a test: compare lookups in a sorted array of ip4tset entries by
+ * binary search with lookups in its Eytzinger layout and, on x86 CPUs
+ * with SSE2 or AVX2, in its 16-ary search tree, and check all of them
+ * give the same answers.
+ * Usage: bench_find [nentries...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#if !defined(NO_SIMD) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+# include <immintrin.h>
+# define STREE
+#endif
+
+typedef unsigned ip4addr_t;
+
+#define NQUERIES 10000000	/* lookups per run, half of them found */
+
+/* the same as in rbldnsd.h and rbldnsd_util.c */
+#define EYTZ_LINE 64
+#define eytz_prefetch(e,k) \
+   __builtin_prefetch((e) + (k) * (EYTZ_LINE / sizeof(*(e))))
+#define eytz_lb(k) ((k) >> __builtin_ffs(~(int)(k)))
+
+static unsigned eytz_first(unsigned n) {
+  unsigned k = n ? 1 : 0;
+  while(k && 2 * k <= n)
+    k <<= 1;
+  return k;
+}
+
+static unsigned eytz_next(unsigned k, unsigned n) {
+  if (2 * k + 1 <= n) {
+    for(k = 2 * k + 1; 2 * k <= n; k <<= 1)
+      ;
+    return k;
+  }
+  while(k & 1)
+    k >>= 1;
+  return k >> 1;
+}
+
+/* the same as in rbldnsd_ip4tset.c */
+static int
+ds_ip4tset_find(const ip4addr_t *e, int b, ip4addr_t q) {
+  int a = 0, m;
+  --b;
+  while(a <= b) {
+    if (e[(m = (a + b) >> 1)] == q) return 1;
+    else if (e[m] < q) a = m + 1;
+    else b = m - 1;
+  }
+  return 0;
+}
+
+static int
+ds_ip4tset_eyfind(const ip4addr_t *e, unsigned n, ip4addr_t q) {
+  unsigned k = 1;
+  while(k <= n) {
+    eytz_prefetch(e, k);
+    k = 2 * k + (e[k] < q);
+  }
+  k = eytz_lb(k);
+  return k && e[k] == q;
+}
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+#ifdef STREE
+
+#define STBIAS 0x80000000u
+
+static void
+ds_ip4tset_stbuild(ip4addr_t *t, unsigned nb, unsigned k,
+                   const ip4addr_t *e, unsigned n, unsigned *i) {
+  unsigned j;
+  if (k >= nb)
+    return;
+  for(j = 0; j < 16; ++j) {
+    ds_ip4tset_stbuild(t, nb, k * 17 + j + 1, e, n, i);
+    t[k * 16 + j] = (*i < n ? e[(*i)++] : e[n - 1]) ^ STBIAS;
+  }
+  ds_ip4tset_stbuild(t, nb, k * 17 + 17, e, n, i);
+}
+
+static int __attribute__((target("sse2")))
+ds_ip4tset_stfind_sse2(const ip4addr_t *t, unsigned nb, ip4addr_t q) {
+  unsigned k = 0, i, f;
+  __m128i x, a, b;
+  const __m128i *p;
+  q ^= STBIAS;
+  f = q ^ 1;
+  x = _mm_set1_epi32((int)q);
+  while(k < nb) {
+    p = (const __m128i *)(t + k * 16);
+    a = _mm_packs_epi32(_mm_cmpgt_epi32(x, p[0]), _mm_cmpgt_epi32(x, p[1]));
+    b = _mm_packs_epi32(_mm_cmpgt_epi32(x, p[2]), _mm_cmpgt_epi32(x, p[3]));
+    i = __builtin_ctz(~(unsigned)_mm_movemask_epi8(_mm_packs_epi16(a, b)));
+    f = i < 16 ? t[k * 16 + i] : f;
+    k = k * 17 + i + 1;
+  }
+  return f == q;
+}
+
+static int __attribute__((target("avx2,popcnt")))
+ds_ip4tset_stfind_avx2(const ip4addr_t *t, unsigned nb, ip4addr_t q) {
+  unsigned k = 0, i, f;
+  __m256i x, m;
+  const __m256i *p;
+  q ^= STBIAS;
+  f = q ^ 1;
+  x = _mm256_set1_epi32((int)q);
+  while(k < nb) {
+    p = (const __m256i *)(t + k * 16);
+    m = _mm256_packs_epi32(_mm256_cmpgt_epi32(x, p[0]),
+                           _mm256_cmpgt_epi32(x, p[1]));
+    i = __builtin_popcount((unsigned)_mm256_movemask_epi8(m)) >> 1;
+    f = i < 16 ? t[k * 16 + i] : f;
+    k = k * 17 + i + 1;
+  }
+  return f == q;
+}
+
+/* lookups/sec in the search tree of sorted e, or 0 if the CPU can't
+ * search it; the number of entries found is put into *ff */
+static double
+stbench(const ip4addr_t *e, unsigned n, const ip4addr_t *q, unsigned *ff) {
+  int (*stfind)(const ip4addr_t *, unsigned, ip4addr_t);
+  unsigned nb = (n + 15) / 16, i = 0;
+  ip4addr_t *t;
+  double s;
+
+  if (__builtin_cpu_supports("avx2"))
+    stfind = ds_ip4tset_stfind_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    stfind = ds_ip4tset_stfind_sse2;
+  else
+    return 0;
+  if (posix_memalign((void **)&t, 64, (nb + 1) * (size_t)64) != 0)
+    return 0;
+  ds_ip4tset_stbuild(t, nb, 0, e, n, &i);
+  s = now();
+  for(i = *ff = 0; i < NQUERIES; ++i)
+    *ff += stfind(t, nb, q[i]);
+  s = now() - s;
+  free(t);
+  return NQUERIES / s / 1e6;
+}
+
+#else
+#define stbench(e, n, q, ff) 0
+#endif
+
+static unsigned rnd;
+
+static unsigned xrand(void) {
+  rnd ^= rnd << 13;
+  rnd ^= rnd >> 17;
+  rnd ^= rnd << 5;
+  return rnd;
+}
+
+static void sort_addrs(ip4addr_t *e, unsigned n) {
+#   define QSORT_TYPE ip4addr_t
+#   define QSORT_BASE e
+#   define QSORT_NELT n
+#   define QSORT_LT(a,b) *a < *b
+#   define RSORT_NBYTES 4
+#   define RSORT_BYTE(p,i) ((*(p) >> ((i) << 3)) & 255u)
+#   include "rsort.c"
+#   undef RSORT_BYTE
+#   undef RSORT_NBYTES
+#   undef QSORT_LT
+#   undef QSORT_NELT
+#   undef QSORT_BASE
+#   undef QSORT_TYPE
+}
+
+static int bench(unsigned n) {
+  ip4addr_t *e = (ip4addr_t *)malloc(n * sizeof(*e));
+  ip4addr_t *y = NULL, *q = (ip4addr_t *)malloc(NQUERIES * sizeof(*q));
+  double t, tb, te, ts;
+  unsigned i, k, fb, fe, fs = 0;
+
+  /* even random addresses: queries with odd ones are not found */
+  rnd = 2463534242u;
+  if (e && q)
+    for(i = 0; i < n; ++i)
+      e[i] = xrand() & ~1u;
+  if (e && q) {
+    sort_addrs(e, n);
+    for(i = 0; i < NQUERIES; ++i)
+      q[i] = e[xrand() % n] | (xrand() & 1);
+  }
+  if (e && q && posix_memalign((void **)&y, EYTZ_LINE,
+                               (n + 1) * sizeof(*y)) != 0)
+    y = NULL;
+  if (!y) {
+    free(e); free(q);
+    return 0;
+  }
+  for(i = 0, k = eytz_first(n); k; ++i, k = eytz_next(k, n))
+    y[k] = e[i];
+
+  t = now();
+  for(i = fb = 0; i < NQUERIES; ++i)
+    fb += ds_ip4tset_find(e, n, q[i]);
+  tb = now() - t;
+  t = now();
+  for(i = fe = 0; i < NQUERIES; ++i)
+    fe += ds_ip4tset_eyfind(y, n, q[i]);
+  te = now() - t;
+  ts = stbench(e, n, q, &fs);
+  if (!ts)
+    fs = fb;
+  printf("%10u ip4tset entries: binary %6.2fM/s eytzinger %6.2fM/s "
+         "(x%.1f)", n, NQUERIES / tb / 1e6, NQUERIES / te / 1e6, tb / te);
+  if (ts)
+    printf(" simd %6.2fM/s (x%.1f)", ts, ts * tb / NQUERIES * 1e6);
+  printf("%s\n", fb == fe && fb == fs ? "" : " MISMATCH");
+  free(e); free(y); free(q);
+  return fb == fe && fb == fs;
+}
+
+int main(int argc, char **argv) {
+  int i, ok = 1;
+  if (argc < 2)
+    ok = bench(10000000);
+  for(i = 1; i < argc; ++i)
+    if (!bench(strtoul(argv[i], NULL, 0))) {
+      fprintf(stderr, "bench_find: %s entries failed\n", argv[i]);
+      ok = 0;
+    }
+  return ok ? 0 : 1;
+}
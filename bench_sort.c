@@ -0,0 +1,168 @@
+/* not a test: compare radix sort (rsort.c) with qsort.c on big arrays
+ * of ip4set and ip4tset entries, and check both give the same order.
+ * Usage: bench_sort [nentries...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+typedef unsigned ip4addr_t;
+
+struct entry {		/* the same as in rbldnsd_ip4set.c */
+  ip4addr_t addr;
+  ip4addr_t last;
+  const char *rr;
+};
+
+#define ip4set_lt(a,b) \
+   ((a)->addr < (b)->addr ? 1 : \
+    (a)->addr > (b)->addr ? 0 : \
+    (a)->rr < (b)->rr)
+
+static char rrs[64][8];		/* a few distinct values */
+
+static unsigned rnd;
+
+static unsigned xrand(void) {
+  rnd ^= rnd << 13;
+  rnd ^= rnd >> 17;
+  rnd ^= rnd << 5;
+  return rnd;
+}
+
+/* random addresses in a part of the address space, so there are some
+ * duplicates, with one of a few values or an exclusion */
+static void fill(struct entry *e, unsigned n) {
+  unsigned i, r;
+  rnd = 2463534242u;
+  for(i = 0; i < n; ++i) {
+    r = xrand();
+    e[i].addr = e[i].last = 0x0a000000u | (r % (n * 4u));
+    r = xrand() & 63;
+    e[i].rr = r ? rrs[r] : NULL;
+  }
+}
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static unsigned sum(const struct entry *e, unsigned n) {
+  unsigned i, s = 0;
+  for(i = 0; i < n; ++i)
+    s = s * 31 + e[i].addr * 7 + (e[i].rr ? e[i].rr - rrs[0] : 1);
+  return s;
+}
+
+static void sort_entries_q(struct entry *e, unsigned n) {
+#   define QSORT_TYPE struct entry
+#   define QSORT_BASE e
+#   define QSORT_NELT n
+#   define QSORT_LT(a,b) ip4set_lt(a,b)
+#   include "qsort.c"
+#   undef QSORT_LT
+#   undef QSORT_NELT
+#   undef QSORT_BASE
+#   undef QSORT_TYPE
+}
+
+static void sort_entries_r(struct entry *e, unsigned n) {
+#   define QSORT_TYPE struct entry
+#   define QSORT_BASE e
+#   define QSORT_NELT n
+#   define QSORT_LT(a,b) ip4set_lt(a,b)
+#   define RSORT_NBYTES 4
+#   define RSORT_BYTE(p,i) (((p)->addr >> ((i) << 3)) & 255u)
+#   define RSORT_KEYEQ(a,b) ((a)->addr == (b)->addr)
+#   include "rsort.c"
+#   undef RSORT_KEYEQ
+#   undef RSORT_BYTE
+#   undef RSORT_NBYTES
+#   undef QSORT_LT
+#   undef QSORT_NELT
+#   undef QSORT_BASE
+#   undef QSORT_TYPE
+}
+
+static void sort_addrs_q(ip4addr_t *e, unsigned n) {
+#   define QSORT_TYPE ip4addr_t
+#   define QSORT_BASE e
+#   define QSORT_NELT n
+#   define QSORT_LT(a,b) *a < *b
+#   include "qsort.c"
+#   undef QSORT_LT
+#   undef QSORT_NELT
+#   undef QSORT_BASE
+#   undef QSORT_TYPE
+}
+
+static void sort_addrs_r(ip4addr_t *e, unsigned n) {
+#   define QSORT_TYPE ip4addr_t
+#   define QSORT_BASE e
+#   define QSORT_NELT n
+#   define QSORT_LT(a,b) *a < *b
+#   define RSORT_NBYTES 4
+#   define RSORT_BYTE(p,i) ((*(p) >> ((i) << 3)) & 255u)
+#   include "rsort.c"
+#   undef RSORT_BYTE
+#   undef RSORT_NBYTES
+#   undef QSORT_LT
+#   undef QSORT_NELT
+#   undef QSORT_BASE
+#   undef QSORT_TYPE
+}
+
+static int bench(unsigned n) {
+  struct entry *e = (struct entry *)malloc(n * sizeof(*e));
+  ip4addr_t *a;
+  double t, tq, tr;
+  unsigned i, sq, sr;
+
+  if (!e)
+    return 0;
+
+  fill(e, n);
+  t = now(); sort_entries_q(e, n); tq = now() - t;
+  sq = sum(e, n);
+  fill(e, n);
+  t = now(); sort_entries_r(e, n); tr = now() - t;
+  sr = sum(e, n);
+  printf("%10u ip4set  entries: qsort %7.3fs radix %7.3fs (x%.1f)%s\n",
+         n, tq, tr, tq / tr, sq == sr ? "" : " MISMATCH");
+  if (sq != sr)
+    return 0;
+
+  a = (ip4addr_t *)e;		/* reuse the memory */
+  rnd = 2463534242u;
+  for(i = 0; i < n; ++i)
+    a[i] = xrand();
+  t = now(); sort_addrs_q(a, n); tq = now() - t;
+  for(sq = i = 0; i < n; ++i)
+    sq = sq * 31 + a[i];
+  rnd = 2463534242u;
+  for(i = 0; i < n; ++i)
+    a[i] = xrand();
+  t = now(); sort_addrs_r(a, n); tr = now() - t;
+  for(sr = i = 0; i < n; ++i)
+    sr = sr * 31 + a[i];
+  printf("%10u ip4tset entries: qsort %7.3fs radix %7.3fs (x%.1f)%s\n",
+         n, tq, tr, tq / tr, sq == sr ? "" : " MISMATCH");
+  free(e);
+  return sq == sr;
+}
+
+int main(int argc, char **argv) {
+  int i, ok = 1;
+  if (argc < 2)
+    ok = bench(10000000);
+  for(i = 1; i < argc; ++i)
+    if (!bench(strtoul(argv[i], NULL, 0))) {
+      fprintf(stderr, "bench_sort: %s entries failed\n", argv[i]);
+      ok = 0;
+    }
+  return ok ? 0 : 1;
+}
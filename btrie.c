@@ -1508,7 +1508,7 @@ count_free(const struct btrie *btrie)
 const char *
 btrie_stats(const struct btrie *btrie)
 {
-  static char buf[128];
+  static THREAD_LOCAL char buf[128];
   size_t n_nodes = btrie->n_lc_nodes + btrie->n_tbm_nodes;
   size_t alloc_free = (btrie->alloc_total
                        + sizeof(node_t) /* do not double-count the root node */
@@ -1568,8 +1568,6 @@ btrie_stats(const struct btrie *btrie)
 /****************************************************************/
 
 
-#ifndef NO_MASTER_DUMP
-
 struct walk_context {
   btrie_walk_cb_t *callback;
   void *user_data;
@@ -1678,9 +1676,6 @@ btrie_walk(const struct btrie *btrie,
   walk_node(&btrie->root, 0, &ctx);
 }
 
-
-#endif /* not NO_MASTER_DUMP */
-
 
 #ifdef TEST
 /*****************************************************************
@@ -76,12 +76,10 @@ const void *btrie_lookup(const struct btrie *btrie,
 
 const char *btrie_stats(const struct btrie *btrie);
 
-#ifndef NO_MASTER_DUMP
 typedef void btrie_walk_cb_t(const btrie_oct_t *prefix, unsigned len,
                              const void *data, int post, void *user_data);
 
 void btrie_walk(const struct btrie *btrie,
                 btrie_walk_cb_t *callback, void *user_data);
-#endif /* not NO_MASTER_DUMP */
 
 #endif /* _BTRIE_H_INCLUDED */
@@ -0,0 +1,9 @@
+/* rbldnsd autoconfiguration header file.
+ * Generated automatically by configure. */
+
+#define HAVE_SETITIMER 1
+#define NO_ZSTD
+#define NO_LZ4
+#define THREAD_LOCAL	__thread
+#define NO_DSO		1	/* disabled by default */
+#define NDEBUG		1	/* option disabled */
@@ -1,6 +1,7 @@
 /* IPv6 address-related routines
  */
 
+#include "config.h"
 #include "ip6addr.h"
 #include <string.h>
 #include <stdio.h>
@@ -154,7 +155,7 @@ int ip6mask(const ip6oct_t *ap, ip6oct_t *bp, unsigned n, unsigned bits) {
 }
 
 const char *ip6atos(const ip6oct_t *ap, unsigned an) {
-  static char buf[(4+1)*8+1];
+  static THREAD_LOCAL char buf[(4+1)*8+1];
   unsigned awords = an / 2;
   char *bp = buf;
   unsigned nzeros = 0, zstart = 0, i;
@@ -6,10 +6,28 @@
 #include <string.h>
 #include <errno.h>
 #include "config.h"
-#ifndef NO_ZLIB
+#ifndef NO_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <signal.h>
+#endif
+#if !defined(NO_ZLIB) || !defined(NO_ZSTD) || !defined(NO_LZ4)
+# define ISTREAM_UNCOMPRESS	/* some decompression is compiled in */
 #include <stdlib.h>
+#endif
+#ifndef NO_ZLIB
 #include <zlib.h>
 #endif
+#ifndef NO_ZSTD
+#include <zstd.h>
+#endif
+#ifndef NO_LZ4
+#include <lz4frame.h>
+#endif
+#if defined(ISTREAM_UNCOMPRESS) && !defined(NO_THREADS)
+#include <pthread.h>
+#endif
 #include "istream.h"
 
 #ifndef EPROTO
@@ -42,12 +60,18 @@
  * be able to avoid moving data in the buffer as much as possible,
  * AND to be able to read chunks of exactly BUFSIZE/2 size from the file,
  * to make i/o more efficient.
+ * A mapped file (see istream_init_mmap()) is all in memory already,
+ * so lines are returned right from the mapping.
  */
 
+static int istream_getmapline(struct istream *sp, char **linep, char delim);
+
 int istream_getline(struct istream *sp, char **linep, char delim) {
   unsigned char *x, *s;
   int r;
 
+  if (sp->map)
+    return istream_getmapline(sp, linep, delim);
   s = sp->readp;
   *linep = (char*)s;
   for (;;) {
@@ -91,6 +115,9 @@ int istream_getline(struct istream *sp, char **linep, char delim) {
 
 /* try to fill in a buffer if it contains less than BUFSIZE/2 bytes */
 int istream_fillbuf(struct istream *sp) {
+  if (sp->map)	/* nothing to read, just as if at end of file */
+    return (size_t)(sp->endp - sp->readp) < ISTREAM_BUFSIZE/2 ?
+      0 : ISTREAM_BUFSIZE/2;
   if ((unsigned)(sp->endp - sp->readp) < ISTREAM_BUFSIZE/2) {
     int r;
     /* if we've a 'gap' at the beginning, close it */
@@ -140,6 +167,7 @@ void istream_init(struct istream *sp,
   sp->readfn = readfn;
   sp->freefn = freefn;
   sp->readp = sp->endp = sp->buf;
+  sp->map = NULL;
 }
 
 void istream_destroy(struct istream *sp) {
@@ -152,15 +180,156 @@ void istream_init_fd(struct istream *sp, int fd) {
   istream_init(sp, istream_readfn, NULL, (void*)(long)fd);
 }
 
-/* check for gzip magic (2 bytes) */
-int istream_compressed(struct istream *sp) {
-  if (istream_ensurebytes(sp, 2) <= 0)
+#if !defined(NO_MMAP) || !defined(NO_ZLIB)
+/* always return end-of-file */
+static int
+istream_eof(struct istream UNUSED *sp, unsigned char UNUSED *buf,
+            int UNUSED size, int UNUSED szhint) {
+  return 0;
+}
+#endif
+
+/* Regular files are mapped into memory, to avoid copying all the data
+ * into buf and back.  The lines returned by istream_getline() point into
+ * the read-only mapping, so a caller which wants to modify a line should
+ * get a copy by istream_copyline().  A line which does not end with the
+ * delimiter (a long one or the last one) is copied into buf anyway, to
+ * have a null byte after it, as callers rely on a terminator after data.
+ * If the file is truncated while mapped, accessing pages past its new
+ * end raises SIGBUS: istream_sigbus() maps zeros in place of them, and
+ * the reader should notice the file size change afterwards.
+ * Only one stream per thread may be mapped at a time.
+ */
+
+#ifndef NO_MMAP
+
+static THREAD_LOCAL struct istream *istream_mapped;
+
+static void istream_sigbus(int sig, siginfo_t *si, void UNUSED *ctx) {
+  struct istream *sp = istream_mapped;
+  unsigned char *p = si->si_addr;
+  if (sp && p >= sp->map && p < sp->endp) {
+    p -= (p - sp->map) & ((unsigned long)sp->cookie - 1); /* page size */
+    if (mmap(p, sp->endp - p, PROT_READ,
+             MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0) != MAP_FAILED)
+      return;
+  }
+  signal(sig, SIG_DFL);	/* not ours, let it kill us */
+}
+
+static void istream_unmap(struct istream *sp) {
+  munmap(sp->map, sp->endp - sp->map);
+  istream_mapped = NULL;
+}
+
+int istream_init_mmap(struct istream *sp, int fd) {
+  struct stat st;
+  struct sigaction sa;
+  unsigned char *map;
+  size_t len;
+
+  /* small files are read by one read(2) anyway */
+  if (istream_mapped || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+      st.st_size < ISTREAM_BUFSIZE || (off_t)(size_t)st.st_size != st.st_size)
     return 0;
-  if (sp->readp[0] != 0x1f || sp->readp[1] != 0x8b)
+  len = st.st_size;
+  map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
     return 0;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = istream_sigbus;
+  sa.sa_flags = SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGBUS, &sa, NULL);
+  istream_init(sp, istream_eof, istream_unmap,
+               (void*)(unsigned long)sysconf(_SC_PAGESIZE));
+  sp->map = sp->readp = map;
+  sp->endp = map + len;
+  istream_mapped = sp;
+
+  if (istream_magic(map, 4)) {
+    /* compressed, leave it to istream_uncompress_setup() */
+    istream_destroy(sp);
+    return 0;
+  }
+  madvise(map, len, MADV_SEQUENTIAL);
   return 1;
 }
 
+#else
+
+int istream_init_mmap(struct istream UNUSED *sp, int UNUSED fd) {
+  return 0;
+}
+
+#endif
+
+static int istream_getmapline(struct istream *sp, char **linep, char delim) {
+  unsigned char *x, *s = sp->readp;
+  size_t n = sp->endp - s;
+
+  if (n > ISTREAM_BUFSIZE/2)
+    n = ISTREAM_BUFSIZE/2;
+  if ((x = memchr(s, delim, n)) != NULL) {
+    *linep = (char*)s;
+    return (sp->readp = x + 1) - s;
+  }
+  memcpy(sp->buf, s, n);
+  sp->buf[n] = '\0';
+  sp->readp = s + n;
+  *linep = (char*)sp->buf;
+  return n;
+}
+
+/* make the line returned by istream_getline() (len bytes of it)
+ * modifiable, null-terminated, and return it */
+char *istream_copyline(struct istream *sp, char *line, int len) {
+  if (sp->map) {
+    memmove(sp->buf, line, len);
+    line = (char*)sp->buf;
+  }
+  line[len] = '\0';
+  return line;
+}
+
+/* check for gzip (2 bytes), zstd and lz4 frame (4 bytes) magic */
+int istream_magic(const unsigned char *p, int len) {
+  if (len >= 2 && p[0] == 0x1f && p[1] == 0x8b)
+    return ISTREAM_GZIP;
+  if (len >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd)
+    return ISTREAM_ZSTD;
+  if (len >= 4 && p[0] == 0x04 && p[1] == 0x22 && p[2] == 0x4d && p[3] == 0x18)
+    return ISTREAM_LZ4;
+  return 0;
+}
+
+int istream_compressed(struct istream *sp) {
+  /* a shorter file is checked for whatever it has */
+  if (istream_ensurebytes(sp, 4) < 0)
+    return 0;
+  return istream_magic(sp->readp, sp->endp - sp->readp);
+}
+
+#ifdef ISTREAM_UNCOMPRESS
+
+/* Every decompressor reads compressed data from an istream of its own,
+ * which takes over the data source of the original stream together
+ * with any data left in its buffer.  The original stream is then
+ * re-initialized to read from the decompressor. */
+static void istream_move(struct istream *is, const struct istream *sp) {
+  int x = sp->endp - sp->readp;
+  is->cookie = sp->cookie;
+  is->readfn = sp->readfn;
+  is->freefn = sp->freefn;
+  is->map = NULL;
+  memcpy(is->buf, sp->readp, x);
+  is->readp = is->buf;
+  is->endp = is->buf + x;
+}
+
+#endif
+
 #ifndef NO_ZLIB
 
 struct zistream {
@@ -176,23 +345,67 @@ struct zistream {
 #define COMMENT      0x10 /* bit 4 set: file comment present */
 #define RESERVED     0xE0 /* bits 5..7: reserved */
 
-/* always return end-of-file */
-static int
-istream_eof(struct istream UNUSED *sp, unsigned char UNUSED *buf,
-            int UNUSED size, int UNUSED szhint) {
-  return 0;
+/* skip gzip member header at sp->readp */
+static int zistream_header(struct istream *sp) {
+  int r, x, flags;
+
+  errno = EPROTO;
+  if (istream_ensurebytes(sp, 10) <= 0)
+    return -1;
+  if (sp->readp[0] != 0x1f || sp->readp[1] != 0x8b ||
+      sp->readp[2] != Z_DEFLATED ||
+      (flags = sp->readp[3]) & RESERVED)
+    return -1;
+  sp->readp += 10;
+  if (flags & EXTRA_FIELD) {
+    if (istream_ensurebytes(sp, 2) <= 0)
+      return -1;
+    x = sp->readp[0] | ((unsigned)sp->readp[1] << 8);
+    sp->readp += 2;
+    while(sp->endp - sp->readp < x) {
+      x -= sp->endp - sp->readp;
+      sp->readp = sp->endp;
+      if (istream_fillbuf(sp) <= 0)
+        return -1;
+    }
+    sp->readp += x;
+  }
+  x = ((flags & ORIG_NAME) ? 1 : 0) + ((flags & COMMENT) ? 1 : 0);
+  while(x--) {
+    char *p;
+    do
+      if ((r = istream_getline(sp, &p, '\0')) <= 0)
+        return -1;
+    while (p[r-1] != '\0');
+  }
+  if (flags & HEAD_CRC) {
+    if (istream_ensurebytes(sp, 2) <= 0)
+      return -1;
+    sp->readp += 2;
+  }
+  return 1;
+}
+
+static unsigned zget32(const unsigned char *p) {
+  return ((unsigned)p[0] <<  0) | ((unsigned)p[1] <<  8) |
+         ((unsigned)p[2] << 16) | ((unsigned)p[3] << 24);
 }
 
+/* A gzip file may consist of several members one after another (as
+ * written by pigz or by concatenating gzip files), which are all read
+ * as one stream.  Anything else after a member is ignored, like gzip
+ * does. */
 static int
 zistream_readfn(struct istream *sp, unsigned char *buf,
                 int size, int UNUSED szhint) {
   struct zistream *zsp = sp->cookie;
   int r = Z_OK;
-  unsigned char *p;
+  unsigned char *p, *s = buf;	/* s: output of current member */
 
   zsp->zs.next_out = buf;
   zsp->zs.avail_out = size;
 
+next:
   while(r == Z_OK && zsp->zs.avail_out != 0) {
     if (zsp->is.readp == zsp->is.endp) {
       r = istream_fillbuf(&zsp->is);
@@ -211,15 +424,15 @@ zistream_readfn(struct istream *sp, unsigned char *buf,
     r = inflate(&zsp->zs, Z_NO_FLUSH);
     zsp->is.readp = zsp->zs.next_in;
   }
-  size -= zsp->zs.avail_out;
-  zsp->bytes += size;
-  zsp->crc32 = crc32(zsp->crc32, buf, size);
+  zsp->bytes += zsp->zs.next_out - s;
+  zsp->crc32 = crc32(zsp->crc32, s, zsp->zs.next_out - s);
+  s = zsp->zs.next_out;
 
   switch(r) {
     case Z_STREAM_END:
       break;
     case Z_OK:
-      return size;
+      return size - zsp->zs.avail_out;
     case Z_MEM_ERROR:
       errno = ENOMEM;
       return -1;
@@ -229,7 +442,6 @@ zistream_readfn(struct istream *sp, unsigned char *buf,
       return -1;
   }
 
-  inflateEnd(&zsp->zs);
   sp->readfn = istream_eof;
   r = istream_ensurebytes(&zsp->is, 8);  /* 8 bytes trailer */
   if (r <= 0) {
@@ -239,18 +451,26 @@ zistream_readfn(struct istream *sp, unsigned char *buf,
   }
   p = zsp->is.readp;
   zsp->is.readp += 8;
-  if ((((unsigned)p[0] <<  0) |
-       ((unsigned)p[1] <<  8) |
-       ((unsigned)p[2] << 16) |
-       ((unsigned)p[3] << 24)) != zsp->crc32 ||
-      (((unsigned)p[4] <<  0) |
-       ((unsigned)p[5] <<  8) |
-       ((unsigned)p[6] << 16) |
-       ((unsigned)p[7] << 24)) != (zsp->bytes & 0xffffffffu)) {
+  if (zget32(p) != zsp->crc32 ||
+      zget32(p + 4) != (zsp->bytes & 0xffffffffu)) {
     errno = EPROTO;
     return -1;
   }
-  return size;
+
+  /* next member, if any */
+  if ((r = istream_ensurebytes(&zsp->is, 2)) < 0)
+    return -1;
+  if (r && zsp->is.readp[0] == 0x1f && zsp->is.readp[1] == 0x8b) {
+    if (zistream_header(&zsp->is) < 0 || inflateReset(&zsp->zs) != Z_OK)
+      return -1;
+    sp->readfn = zistream_readfn;
+    zsp->bytes = 0;
+    zsp->crc32 = crc32(0, NULL, 0);
+    r = Z_OK;
+    if (zsp->zs.avail_out != 0)
+      goto next;
+  }
+  return size - zsp->zs.avail_out;
 }
 
 static void zistream_freefn(struct istream *sp) {
@@ -260,60 +480,19 @@ static void zistream_freefn(struct istream *sp) {
   free(zsp);
 }
 
-int istream_uncompress_setup(struct istream *sp) {
-  int r, x, flags;
+static int zistream_setup(struct istream *sp) {
+  int r;
   struct zistream *zsp;
 
-  if (!istream_compressed(sp))
-    return 0;
-
-  sp->readp += 2;
-  errno = EPROTO;
-  if (istream_ensurebytes(sp, 8) <= 0)
-    return -1;
-  if (sp->readp[0] != Z_DEFLATED ||
-      (flags = sp->readp[1]) & RESERVED)
+  if (zistream_header(sp) < 0)
     return -1;
-  sp->readp += 8;
-  if (flags & EXTRA_FIELD) {
-    if (istream_ensurebytes(sp, 2) <= 0)
-      return -1;
-    x = sp->readp[0] | ((unsigned)sp->readp[1] << 8);
-    sp->readp += 2;
-    while(sp->endp - sp->readp < x) {
-      x -= sp->endp - sp->readp;
-      sp->readp = sp->endp;
-      if (istream_fillbuf(sp) <= 0)
-        return -1;
-    }
-    sp->readp += x;
-  }
-  x = ((flags & ORIG_NAME) ? 1 : 0) + ((flags & COMMENT) ? 1 : 0);
-  while(x--) {
-    char *p;
-    do
-      if ((r = istream_getline(sp, &p, '\0')) <= 0)
-        return -1;
-    while (p[r-1] != '\0');
-  }
-  if (flags & HEAD_CRC) {
-    if (istream_ensurebytes(sp, 2) <= 0)
-      return -1;
-    sp->readp += 2;
-  }
 
   zsp = malloc(sizeof(*zsp));
   if (!zsp) {
     errno = ENOMEM;
     return -1;
   }
-  zsp->is.cookie = sp->cookie;
-  zsp->is.readfn = sp->readfn;
-  zsp->is.freefn = sp->freefn;
-  x = sp->endp - sp->readp;
-  memcpy(zsp->is.buf, sp->readp, x);
-  zsp->is.readp = zsp->is.buf;
-  zsp->is.endp = zsp->is.buf + x;
+  istream_move(&zsp->is, sp);
   zsp->zs.zalloc = NULL;
   zsp->zs.zfree = NULL;
   zsp->zs.opaque = NULL;
@@ -321,7 +500,7 @@ int istream_uncompress_setup(struct istream *sp) {
   zsp->crc32 = crc32(0, NULL, 0);
 
   zsp->zs.next_in = zsp->is.readp;
-  zsp->zs.avail_in = x;
+  zsp->zs.avail_in = zsp->is.endp - zsp->is.readp;
   r = inflateInit2(&zsp->zs, -MAX_WBITS);
   switch(r) {
   case Z_OK:
@@ -337,16 +516,582 @@ int istream_uncompress_setup(struct istream *sp) {
   return -1;
 }
 
-#else /* !ZLIB */
+#ifndef NO_THREADS
+
+/* BGZF (blocked gzip, as written by bgzip) is a series of gzip members
+ * of up to 64Kb each, with the size of every member recorded in its
+ * header ("BC" extra subfield).  So members can be cut out of the file
+ * without decompressing them, and are decompressed by several threads
+ * at once.  The reader cuts the members into a ring of blocks; worker
+ * threads take the blocks in order, and the reader returns them in the
+ * same order once they're done. */
+
+#define BGZF_MAXBLOCK	65536
+#define BGZF_MAXTHREADS	64
+
+struct bgzfblock {
+  int done;		/* decompressed by a worker */
+  int clen;		/* size of the member in in[] */
+  int len;		/* bytes in out[], <0 on error */
+  int err;		/* errno if len < 0 */
+  unsigned char in[BGZF_MAXBLOCK];
+  unsigned char out[BGZF_MAXBLOCK];
+};
+
+struct bgzfistream {
+  struct istream is;	/* compressed data */
+  pthread_mutex_t mu;
+  pthread_cond_t work;	/* block cut, or stop */
+  pthread_cond_t done;	/* block decompressed */
+  unsigned head;	/* blocks cut by the reader */
+  unsigned next;	/* blocks taken by workers */
+  unsigned tail;	/* blocks returned by the reader */
+  unsigned off;		/* bytes of the tail block returned so far */
+  int eof;		/* no more blocks: 1 at end of data, -1 on error */
+  int err;		/* errno if eof < 0 */
+  int stop;		/* workers should exit */
+  unsigned nb, nthr;
+  pthread_t *thr;
+  struct bgzfblock *b;
+};
 
-int istream_uncompress_setup(struct istream *sp) {
-  if (!istream_compressed(sp))
+/* size of BGZF member starting at p, or 0 if it isn't BGZF */
+static int bgzf_bsize(const unsigned char *p, int len) {
+  int xlen, x;
+  if (len < 12 ||
+      p[0] != 0x1f || p[1] != 0x8b || p[2] != Z_DEFLATED ||
+      !(p[3] & EXTRA_FIELD) || (p[3] & RESERVED))
     return 0;
-  errno = ENOSYS;
-  return -1;
+  xlen = p[10] | ((unsigned)p[11] << 8);
+  if (len < 12 + xlen)
+    return 0;
+  for(p += 12; xlen >= 4; p += x, xlen -= x) {
+    x = 4 + (p[2] | ((unsigned)p[3] << 8));
+    if (p[0] == 'B' && p[1] == 'C' && x == 6 && xlen >= 6)
+      return (p[4] | ((unsigned)p[5] << 8)) + 1;
+  }
+  return 0;
 }
 
+/* decompress block b, using zs */
+static void bgzf_inflate(struct bgzfblock *b, z_stream *zs) {
+  const unsigned char *p = b->in, *e = b->in + b->clen - 8;
+  int flags = p[3], r;
+
+  b->err = EPROTO;
+  b->len = -1;
+  p += 12 + (p[10] | ((unsigned)p[11] << 8));
+  if (flags & ORIG_NAME)
+    p = p < e && (p = memchr(p, 0, e - p)) ? p + 1 : e + 1;
+  if (flags & COMMENT)
+    p = p < e && (p = memchr(p, 0, e - p)) ? p + 1 : e + 1;
+  if (flags & HEAD_CRC)
+    p += 2;
+  if (p > e || inflateReset(zs) != Z_OK)
+    return;
+  zs->next_in = (unsigned char *)p;
+  zs->avail_in = e - p;
+  zs->next_out = b->out;
+  zs->avail_out = BGZF_MAXBLOCK;
+  r = inflate(zs, Z_FINISH);
+  if (r != Z_STREAM_END) {
+    if (r == Z_MEM_ERROR)
+      b->err = ENOMEM;
+    return;
+  }
+  r = BGZF_MAXBLOCK - zs->avail_out;
+  if (zs->avail_in ||
+      zget32(e) != crc32(crc32(0, NULL, 0), b->out, r) ||
+      zget32(e + 4) != (unsigned)r)
+    return;
+  b->len = r;
+}
+
+static void *bgzf_thread(void *arg) {
+  struct bgzfistream *bsp = arg;
+  struct bgzfblock *b;
+  z_stream zs;
+  int ok;
+
+  zs.zalloc = NULL;
+  zs.zfree = NULL;
+  zs.opaque = NULL;
+  zs.next_in = NULL;
+  zs.avail_in = 0;
+  ok = inflateInit2(&zs, -MAX_WBITS) == Z_OK;
+
+  pthread_mutex_lock(&bsp->mu);
+  for(;;) {
+    while(bsp->next == bsp->head && !bsp->stop)
+      pthread_cond_wait(&bsp->work, &bsp->mu);
+    if (bsp->stop)
+      break;
+    b = &bsp->b[bsp->next++ % bsp->nb];
+    pthread_mutex_unlock(&bsp->mu);
+    if (ok)
+      bgzf_inflate(b, &zs);
+    else {
+      b->len = -1;
+      b->err = ENOMEM;
+    }
+    pthread_mutex_lock(&bsp->mu);
+    b->done = 1;
+    pthread_cond_broadcast(&bsp->done);
+  }
+  pthread_mutex_unlock(&bsp->mu);
+  if (ok)
+    inflateEnd(&zs);
+  return NULL;
+}
+
+/* cut more blocks from the input while there's room in the ring */
+static void bgzf_cut(struct bgzfistream *bsp) {
+  struct istream *is = &bsp->is;
+  struct bgzfblock *b;
+  int r, n, x;
+
+  while(!bsp->eof && bsp->head - bsp->tail < bsp->nb) {
+    b = &bsp->b[bsp->head % bsp->nb];
+    if ((r = istream_ensurebytes(is, 18)) < 0) {
+      bsp->eof = -1;
+      bsp->err = errno;
+      break;
+    }
+    if (is->endp - is->readp < 2 ||
+        is->readp[0] != 0x1f || is->readp[1] != 0x8b) {
+      bsp->eof = 1;	/* anything but a gzip member is ignored */
+      break;
+    }
+    if (!r ||
+        istream_ensurebytes(is, 12 + (is->readp[10] |
+                                      ((unsigned)is->readp[11] << 8))) <= 0 ||
+        (b->clen = bgzf_bsize(is->readp, is->endp - is->readp)) < 26) {
+      bsp->eof = -1;
+      bsp->err = EPROTO;
+      break;
+    }
+    for(n = 0; n < b->clen; n += x) {
+      if (is->readp == is->endp && (r = istream_fillbuf(is)) <= 0) {
+        bsp->eof = -1;
+        bsp->err = r < 0 ? errno : EPROTO;
+        return;
+      }
+      x = is->endp - is->readp;
+      if (x > b->clen - n)
+        x = b->clen - n;
+      memcpy(b->in + n, is->readp, x);
+      is->readp += x;
+    }
+    b->done = 0;
+    pthread_mutex_lock(&bsp->mu);
+    ++bsp->head;
+    pthread_cond_signal(&bsp->work);
+    pthread_mutex_unlock(&bsp->mu);
+  }
+}
+
+static int
+bgzfistream_readfn(struct istream *sp, unsigned char *buf,
+                   int size, int UNUSED szhint) {
+  struct bgzfistream *bsp = sp->cookie;
+  struct bgzfblock *b;
+  int n;
+
+  for(;;) {
+    bgzf_cut(bsp);
+    if (bsp->tail == bsp->head) {
+      if (bsp->eof > 0)
+        return 0;
+      errno = bsp->err;
+      return -1;
+    }
+    b = &bsp->b[bsp->tail % bsp->nb];
+    pthread_mutex_lock(&bsp->mu);
+    while(!b->done)
+      pthread_cond_wait(&bsp->done, &bsp->mu);
+    pthread_mutex_unlock(&bsp->mu);
+    if (b->len < 0) {
+      errno = b->err;
+      return -1;
+    }
+    n = b->len - bsp->off;
+    if (n > size)
+      n = size;
+    memcpy(buf, b->out + bsp->off, n);
+    if ((bsp->off += n) == (unsigned)b->len) {
+      bsp->off = 0;
+      ++bsp->tail;
+    }
+    if (n)
+      return n;
+  }
+}
+
+static void bgzfistream_free(struct bgzfistream *bsp) {
+  unsigned i;
+  pthread_mutex_lock(&bsp->mu);
+  bsp->stop = 1;
+  pthread_cond_broadcast(&bsp->work);
+  pthread_mutex_unlock(&bsp->mu);
+  for(i = 0; i < bsp->nthr; ++i)
+    pthread_join(bsp->thr[i], NULL);
+  pthread_cond_destroy(&bsp->done);
+  pthread_cond_destroy(&bsp->work);
+  pthread_mutex_destroy(&bsp->mu);
+  free(bsp->thr);
+  free(bsp->b);
+  free(bsp);
+}
+
+static void bgzfistream_freefn(struct istream *sp) {
+  struct bgzfistream *bsp = sp->cookie;
+  istream_destroy(&bsp->is);
+  bgzfistream_free(bsp);
+}
+
+/* set up parallel decompression if sp is BGZF; returns 0 if it isn't
+ * or if the threads can't be started, to read it the usual way */
+static int bgzfistream_setup(struct istream *sp, int nthreads) {
+  struct bgzfistream *bsp;
+
+  if (istream_ensurebytes(sp, 18) <= 0 ||
+      istream_ensurebytes(sp, 12 + (sp->readp[10] |
+                                    ((unsigned)sp->readp[11] << 8))) <= 0 ||
+      !bgzf_bsize(sp->readp, sp->endp - sp->readp))
+    return 0;
+  if (!(bsp = malloc(sizeof(*bsp))))
+    return 0;
+  memset(bsp, 0, sizeof(*bsp));
+  if (nthreads > BGZF_MAXTHREADS)
+    nthreads = BGZF_MAXTHREADS;
+  bsp->nb = nthreads * 4;
+  bsp->b = malloc(bsp->nb * sizeof(*bsp->b));
+  bsp->thr = malloc(nthreads * sizeof(*bsp->thr));
+  pthread_mutex_init(&bsp->mu, NULL);
+  pthread_cond_init(&bsp->work, NULL);
+  pthread_cond_init(&bsp->done, NULL);
+  if (bsp->b && bsp->thr)
+    while(bsp->nthr < (unsigned)nthreads &&
+          pthread_create(&bsp->thr[bsp->nthr], NULL, bgzf_thread, bsp) == 0)
+      ++bsp->nthr;
+  if (bsp->nthr < 2) {
+    bgzfistream_free(bsp);
+    return 0;
+  }
+  istream_move(&bsp->is, sp);
+  istream_init(sp, bgzfistream_readfn, bgzfistream_freefn, bsp);
+  return 1;
+}
+
+#endif /* !NO_THREADS */
+
+#endif /* ZLIB */
+
+#ifndef NO_ZSTD
+
+/* Both zstd and lz4 frame decoders may keep some output when the
+ * output buffer is full, to be flushed by the next call, even without
+ * more input.  Otherwise a decoder is only called with some input: at
+ * the end of a frame, it would take an empty input as the start of the
+ * next frame, and the end of data could not be told from a truncated
+ * frame anymore. */
+
+struct zstdistream {
+  struct istream is;
+  ZSTD_DStream *ds;
+  size_t hint;		/* last ZSTD_decompressStream() result, 0: frame end */
+  int full;		/* last call filled the output buffer */
+};
+
+static int
+zstdistream_readfn(struct istream *sp, unsigned char *buf,
+                   int size, int UNUSED szhint) {
+  struct zstdistream *zsp = sp->cookie;
+  ZSTD_outBuffer out;
+  ZSTD_inBuffer in;
+  int r;
+
+  out.dst = buf;
+  out.size = size;
+  out.pos = 0;
+  for(;;) {
+    if (zsp->is.readp == zsp->is.endp && !(zsp->full && zsp->hint)) {
+      if ((r = istream_fillbuf(&zsp->is)) < 0)
+        return -1;
+      if (!r) {		/* end of input, should be at end of a frame */
+        if (zsp->hint && !out.pos) {
+          errno = EPROTO;
+          return -1;
+        }
+        break;
+      }
+    }
+    in.src = zsp->is.readp;
+    in.size = zsp->is.endp - zsp->is.readp;
+    in.pos = 0;
+    zsp->hint = ZSTD_decompressStream(zsp->ds, &out, &in);
+    zsp->is.readp += in.pos;
+    if (ZSTD_isError(zsp->hint)) {
+      errno = EPROTO;
+      return -1;
+    }
+    if ((zsp->full = out.pos == out.size))
+      break;
+  }
+  return out.pos;
+}
+
+static void zstdistream_freefn(struct istream *sp) {
+  struct zstdistream *zsp = sp->cookie;
+  ZSTD_freeDStream(zsp->ds);
+  istream_destroy(&zsp->is);
+  free(zsp);
+}
+
+static int zstdistream_setup(struct istream *sp) {
+  struct zstdistream *zsp = malloc(sizeof(*zsp));
+  if (!zsp || !(zsp->ds = ZSTD_createDStream())) {
+    free(zsp);
+    errno = ENOMEM;
+    return -1;
+  }
+  if (ZSTD_isError(ZSTD_initDStream(zsp->ds))) {
+    ZSTD_freeDStream(zsp->ds);
+    free(zsp);
+    errno = EPROTO;
+    return -1;
+  }
+  zsp->hint = 1;
+  zsp->full = 0;
+  istream_move(&zsp->is, sp);
+  istream_init(sp, zstdistream_readfn, zstdistream_freefn, zsp);
+  return 1;
+}
+
+#endif /* ZSTD */
+
+#ifndef NO_LZ4
+
+struct lz4istream {
+  struct istream is;
+  LZ4F_dctx *dctx;
+  size_t hint;		/* last LZ4F_decompress() result, 0: frame end */
+  int full;		/* last call filled the output buffer */
+};
+
+static int
+lz4istream_readfn(struct istream *sp, unsigned char *buf,
+                  int size, int UNUSED szhint) {
+  struct lz4istream *lsp = sp->cookie;
+  size_t dsz, ssz;
+  int n = 0, r;
+
+  for(;;) {
+    if (lsp->is.readp == lsp->is.endp && !(lsp->full && lsp->hint)) {
+      if ((r = istream_fillbuf(&lsp->is)) < 0)
+        return -1;
+      if (!r) {		/* end of input, should be at end of a frame */
+        if (lsp->hint && !n) {
+          errno = EPROTO;
+          return -1;
+        }
+        break;
+      }
+    }
+    dsz = size - n;
+    ssz = lsp->is.endp - lsp->is.readp;
+    lsp->hint = LZ4F_decompress(lsp->dctx, buf + n, &dsz,
+                                lsp->is.readp, &ssz, NULL);
+    if (LZ4F_isError(lsp->hint)) {
+      errno = EPROTO;
+      return -1;
+    }
+    lsp->is.readp += ssz;
+    if ((lsp->full = (n += dsz) == size))
+      break;
+  }
+  return n;
+}
+
+static void lz4istream_freefn(struct istream *sp) {
+  struct lz4istream *lsp = sp->cookie;
+  LZ4F_freeDecompressionContext(lsp->dctx);
+  istream_destroy(&lsp->is);
+  free(lsp);
+}
+
+static int lz4istream_setup(struct istream *sp) {
+  struct lz4istream *lsp = malloc(sizeof(*lsp));
+  if (!lsp ||
+      LZ4F_isError(LZ4F_createDecompressionContext(&lsp->dctx,
+                                                   LZ4F_VERSION))) {
+    free(lsp);
+    errno = ENOMEM;
+    return -1;
+  }
+  lsp->hint = 1;
+  lsp->full = 0;
+  istream_move(&lsp->is, sp);
+  istream_init(sp, lz4istream_readfn, lz4istream_freefn, lsp);
+  return 1;
+}
+
+#endif /* LZ4 */
+
+#if defined(ISTREAM_UNCOMPRESS) && !defined(NO_THREADS)
+
+/* Decompression is done by a separate thread, which passes chunks of
+ * uncompressed data to the reader through a small ring of buffers, so
+ * a file is decompressed and parsed at the same time.  A chunk with
+ * len <= 0 (end of data or error) stays in the ring till the end. */
+
+#define PIPE_NCHUNKS	4
+#define PIPE_CHUNK	(ISTREAM_BUFSIZE/2)
+
+struct pipechunk {
+  int len;		/* bytes in data, 0 at end of data, <0 on error */
+  int err;		/* errno if len < 0 */
+  unsigned char data[PIPE_CHUNK];
+};
+
+struct pistream {
+  struct istream is;	/* the decompressing stream, used by the thread */
+  pthread_t thr;
+  pthread_mutex_t mu;
+  pthread_cond_t cv;	/* chunk filled or taken, or stop */
+  unsigned head, tail;	/* chunks filled by the thread, taken by reader */
+  unsigned off;		/* bytes of the tail chunk taken so far */
+  int stop;		/* the reader is done, the thread should exit */
+  struct pipechunk c[PIPE_NCHUNKS];
+};
+
+static void *pistream_thread(void *arg) {
+  struct pistream *psp = arg;
+  struct pipechunk *c;
+  int len;
+
+  pthread_mutex_lock(&psp->mu);
+  for(;;) {
+    while(psp->head - psp->tail == PIPE_NCHUNKS && !psp->stop)
+      pthread_cond_wait(&psp->cv, &psp->mu);
+    if (psp->stop)
+      break;
+    c = &psp->c[psp->head % PIPE_NCHUNKS];
+    pthread_mutex_unlock(&psp->mu);
+    len = psp->is.readfn(&psp->is, c->data, PIPE_CHUNK, PIPE_CHUNK);
+    c->err = errno;
+    c->len = len;
+    pthread_mutex_lock(&psp->mu);
+    ++psp->head;
+    pthread_cond_signal(&psp->cv);
+    if (len <= 0)
+      break;
+  }
+  pthread_mutex_unlock(&psp->mu);
+  return NULL;
+}
+
+static int
+pistream_readfn(struct istream *sp, unsigned char *buf,
+                int size, int UNUSED szhint) {
+  struct pistream *psp = sp->cookie;
+  struct pipechunk *c;
+  int n;
+
+  pthread_mutex_lock(&psp->mu);
+  while(psp->head == psp->tail)
+    pthread_cond_wait(&psp->cv, &psp->mu);
+  pthread_mutex_unlock(&psp->mu);
+  c = &psp->c[psp->tail % PIPE_NCHUNKS];
+  if (c->len <= 0) {
+    errno = c->err;
+    return c->len;
+  }
+  n = c->len - psp->off;
+  if (n > size)
+    n = size;
+  memcpy(buf, c->data + psp->off, n);
+  if ((psp->off += n) == (unsigned)c->len) {
+    psp->off = 0;
+    pthread_mutex_lock(&psp->mu);
+    ++psp->tail;
+    pthread_cond_signal(&psp->cv);
+    pthread_mutex_unlock(&psp->mu);
+  }
+  return n;
+}
+
+static void pistream_freefn(struct istream *sp) {
+  struct pistream *psp = sp->cookie;
+  pthread_mutex_lock(&psp->mu);
+  psp->stop = 1;
+  pthread_cond_signal(&psp->cv);
+  pthread_mutex_unlock(&psp->mu);
+  pthread_join(psp->thr, NULL);
+  pthread_cond_destroy(&psp->cv);
+  pthread_mutex_destroy(&psp->mu);
+  istream_destroy(&psp->is);
+  free(psp);
+}
+
+/* move decompression of sp into a thread, if possible */
+static void pistream_setup(struct istream *sp) {
+  struct pistream *psp = malloc(sizeof(*psp));
+  if (!psp)
+    return;
+  /* sp has no data buffered right after the decompressor setup */
+  istream_init(&psp->is, sp->readfn, sp->freefn, sp->cookie);
+  psp->head = psp->tail = psp->off = 0;
+  psp->stop = 0;
+  pthread_mutex_init(&psp->mu, NULL);
+  pthread_cond_init(&psp->cv, NULL);
+  if (pthread_create(&psp->thr, NULL, pistream_thread, psp) != 0) {
+    pthread_cond_destroy(&psp->cv);
+    pthread_mutex_destroy(&psp->mu);
+    free(psp);
+    return;
+  }
+  istream_init(sp, pistream_readfn, pistream_freefn, psp);
+}
+
+#endif /* threads */
+
+int istream_uncompress_setup(struct istream *sp, int UNUSED nthreads) {
+  int r;
+
+  switch(istream_compressed(sp)) {
+  case 0:
+    return 0;
+#ifndef NO_ZLIB
+  case ISTREAM_GZIP:
+#ifndef NO_THREADS
+    if (nthreads > 1 && bgzfistream_setup(sp, nthreads))
+      return 1;		/* already decompressed by other threads */
+#endif
+    r = zistream_setup(sp);
+    break;
+#endif
+#ifndef NO_ZSTD
+  case ISTREAM_ZSTD:
+    r = zstdistream_setup(sp);
+    break;
 #endif
+#ifndef NO_LZ4
+  case ISTREAM_LZ4:
+    r = lz4istream_setup(sp);
+    break;
+#endif
+  default:			/* not compiled in */
+    errno = ENOSYS;
+    r = -1;
+    break;
+  }
+#if defined(ISTREAM_UNCOMPRESS) && !defined(NO_THREADS)
+  if (r > 0)
+    pistream_setup(sp);
+#endif
+  return r;
+}
 
 #ifdef TEST
 #include <stdio.h>
@@ -12,6 +12,7 @@ struct istream {
   unsigned char pad1[ISTREAM_PAD];
   unsigned char buf[ISTREAM_BUFSIZE]; /* the data pointer */
   unsigned char pad2[ISTREAM_PAD];
+  unsigned char *map;	/* start of the file mapping, if mapped */
   void *cookie;		/* cookie for readfn routine */
   int  (*readfn)(struct istream *sp, unsigned char *buf, int size, int szhint);
   void (*freefn)(struct istream *sp);
@@ -25,11 +26,23 @@ void istream_init(struct istream *sp,
                   int (*readfn)(struct istream*,unsigned char*,int,int),
                   void (*freefn)(struct istream*), void *cookie);
 void istream_init_fd(struct istream *sp, int fd);
+/* map regular uncompressed file, return 0 if can't (use istream_init_fd) */
+int istream_init_mmap(struct istream *sp, int fd);
+/* null-terminate a line returned by istream_getline() to modify it */
+char *istream_copyline(struct istream *sp, char *line, int len);
 void istream_destroy(struct istream *sp);
 
-/* checks whenever the given stream is in gzip format */
+/* compression formats, by magic bytes at the start of data */
+#define ISTREAM_GZIP	1
+#define ISTREAM_ZSTD	2
+#define ISTREAM_LZ4	3
+/* return compression format of data starting with len bytes at p, or 0 */
+int istream_magic(const unsigned char *p, int len);
+/* checks whenever the given stream is compressed, returns the format */
 int istream_compressed(struct istream *sp);
-/* setup istream to automatically uncompress input if compressed */
-int istream_uncompress_setup(struct istream *sp);
+/* setup istream to automatically uncompress input if compressed,
+ * using up to nthreads threads for BGZF (blocked gzip) data.
+ * Returns -1 with errno ENOSYS if the format is not compiled in */
+int istream_uncompress_setup(struct istream *sp, int nthreads);
 
 #endif /* include guard */
@@ -0,0 +1,61 @@
+/* k-way merge of sorted arrays ("runs") into one sorted array,
+ * using a binary heap of runs ordered by their current elements.
+ *
+ * Usage (similar to qsort.c):
+ * first, define the following:
+ *  KMERGE_NRUNS - number of runs
+ *  KMERGE_P - array of KMERGE_NRUNS pointers to the first element of
+ *    every run, advanced while merging
+ *  KMERGE_T - array of KMERGE_NRUNS pointers past the last element of
+ *    every run
+ *  KMERGE_HEAP - array of KMERGE_NRUNS unsigned ints, for internal use
+ *  KMERGE_OUT - pointer to output array, which should have room for all
+ *    elements of all runs.  It is advanced past the last element stored.
+ *  KMERGE_LT - KMERGE_LT(a,b) should return true if *a < *b
+ * and second, just #include this file into the place you want it.
+ */
+
+{
+  unsigned _kmn = 0, _kmi, _kmc, _kmr;
+
+  /* put every non-empty run to the heap */
+  for(_kmr = 0; _kmr < (KMERGE_NRUNS); ++_kmr) {
+    if (KMERGE_P[_kmr] >= KMERGE_T[_kmr])
+      continue;
+    for(_kmi = _kmn++; _kmi; _kmi = (_kmi - 1) >> 1) {
+      _kmc = KMERGE_HEAP[(_kmi - 1) >> 1];
+      if (!KMERGE_LT(KMERGE_P[_kmr], KMERGE_P[_kmc]))
+        break;
+      KMERGE_HEAP[_kmi] = _kmc;
+    }
+    KMERGE_HEAP[_kmi] = _kmr;
+  }
+
+  /* take the smallest element, and move its run down the heap */
+  while(_kmn) {
+    _kmr = KMERGE_HEAP[0];
+    *(KMERGE_OUT)++ = *KMERGE_P[_kmr]++;
+    if (KMERGE_P[_kmr] >= KMERGE_T[_kmr]) {	/* run is done */
+      if (!--_kmn)
+        break;
+      _kmr = KMERGE_HEAP[_kmn];
+    }
+    for(_kmi = 0; (_kmc = (_kmi << 1) + 1) < _kmn; _kmi = _kmc) {
+      if (_kmc + 1 < _kmn &&
+          KMERGE_LT(KMERGE_P[KMERGE_HEAP[_kmc + 1]],
+                    KMERGE_P[KMERGE_HEAP[_kmc]]))
+        ++_kmc;
+      if (!KMERGE_LT(KMERGE_P[KMERGE_HEAP[_kmc]], KMERGE_P[_kmr]))
+        break;
+      KMERGE_HEAP[_kmi] = KMERGE_HEAP[_kmc];
+    }
+    KMERGE_HEAP[_kmi] = _kmr;
+  }
+}
+
+#undef KMERGE_NRUNS
+#undef KMERGE_P
+#undef KMERGE_T
+#undef KMERGE_HEAP
+#undef KMERGE_OUT
+#undef KMERGE_LT
@@ -23,8 +23,8 @@ void *emalloc(unsigned size);
 #define MEMPOOL_CHUNKSIZE (65536-sizeof(unsigned)*4)
 
 struct mempool_chunk {
+  struct mempool_chunk *next;	/* first, the same as in mempool_cfull */
   char buf[MEMPOOL_CHUNKSIZE+alignto];
-  struct mempool_chunk *next;
   unsigned size;
 };
 
@@ -112,6 +112,23 @@ void mp_free(struct mempool *mp) {
   mp_init(mp);
 }
 
+/* move all memory of from to mp, to be freed together with it.
+ * No more allocations are made in chunks of from. */
+void mp_join(struct mempool *mp, struct mempool *from) {
+  struct mempool_chunk *c;
+  while((c = from->mp_chunk) != NULL) {
+    from->mp_chunk = c->next;
+    c->next = mp->mp_fullc;
+    mp->mp_fullc = c;
+  }
+  while((c = from->mp_fullc) != NULL) {
+    from->mp_fullc = c->next;
+    c->next = mp->mp_fullc;
+    mp->mp_fullc = c;
+  }
+  mp_init(from);
+}
+
 void *mp_memdup(struct mempool *mp, const void *buf, unsigned len) {
   void *b = mp_alloc(mp, len, 0);
   if (b)
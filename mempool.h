@@ -19,6 +19,7 @@ void mp_init(struct mempool *mp);
 void *mp_alloc(struct mempool *mp, unsigned size, int align);
 #define mp_talloc(mp, type) ((type*)mp_alloc((mp), sizeof(type), 1))
 void mp_free(struct mempool *mp);
+void mp_join(struct mempool *mp, struct mempool *from);
 char *mp_strdup(struct mempool *mp, const char *str);
 void *mp_memdup(struct mempool *mp, const void *buf, unsigned len);
 const char *mp_dstrdup(struct mempool *mp, const char *str);
@@ -9,6 +9,9 @@
 #define _GNU_SOURCE /* for unshare(2) */
 #include <sched.h>
 #endif
+#if !defined(NO_MMSG) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* for recvmmsg(2) and sendmmsg(2) */
+#endif
 
 #include "rbldnsd.h"
 
@@ -47,6 +50,9 @@
 /* if system have stdint.h, assume it have inttypes.h too */
 # include <inttypes.h>
 #endif
+#ifndef NO_MMSG
+# include <sys/uio.h>
+#endif
 #ifndef NO_STATS
 # ifndef NO_IOVEC
 #  include <sys/uio.h>
@@ -56,6 +62,9 @@
 #ifndef NO_DSO
 # include <dlfcn.h>
 #endif
+#ifndef NO_THREADS
+# include <pthread.h>
+#endif
 
 #ifdef USE_SYSTEMD
 # include <systemd/sd-daemon.h>
@@ -114,6 +123,61 @@ const char def_rr[5] = "\177\0\0\2\0";		/* default A RR */
 #define MAXSOCK	20	/* maximum # of supported sockets */
 static int sock[MAXSOCK];	/* array of active sockets */
 static int numsock;		/* number of active sockets in sock[] */
+
+/* packet buffer together with the peer address */
+struct wpacket {
+  struct dnspacket wp_pkt;
+#ifndef NO_IPv6
+  struct sockaddr_storage wp_peer_sa;
+#else
+  struct sockaddr_in wp_peer_sa;
+#endif
+  unsigned char wp_buf[DNS_EDNS0_MAXPACKET];
+};
+
+/* query-serving thread.  workers[0] is the main thread which also
+ * handles signals and reloads; with -T N, N-1 more threads are started,
+ * each with its own set of sockets bound to the same addresses */
+struct worker {
+  int w_sock[MAXSOCK];		/* sockets of this worker */
+  struct wpacket *w_pkt;	/* packet buffers, nbatch of them */
+  struct rcache *w_cache;	/* response cache if enabled */
+  struct rridx *w_rridx;	/* answer dedup index */
+#ifndef NO_STATS
+  struct dnsstats *w_stats;	/* counters shared by all w_pkt[] */
+  dnscnt_t w_nrecv, w_nrpkt;	/* # of batched receives and packets */
+#endif
+#ifndef NO_IO_URING
+  struct uring *w_uring;	/* io_uring if in use */
+#endif
+#ifndef NO_MMSG
+  struct mmsghdr *w_rmsg;	/* recvmmsg() headers, one per w_pkt[] */
+  struct mmsghdr *w_smsg;	/* sendmmsg() headers */
+  struct iovec *w_iov;		/* iovecs for the above */
+#endif
+#ifndef NO_TCP
+  struct tcpsrv *w_tcp;		/* set for the TCP thread */
+#endif
+#ifndef NO_THREADS
+  pthread_t w_thread;
+  pthread_mutex_t w_lock;	/* held while a query is being processed */
+#endif
+#ifndef NO_BGRELOAD
+  unsigned w_epoch;		/* rcu_epoch when the query started, or 0 */
+#endif
+};
+static struct worker *workers;
+static int nworkers = 1;	/* number of query-serving threads (-T) */
+static int nthreads = 1;	/* nworkers plus the TCP thread if any */
+int tcp_serving;
+#ifndef NO_TCP
+static unsigned tcp_maxconn;	/* max # of TCP connections, 0 = no TCP (-S) */
+static unsigned tcp_idle = 10;	/* TCP idle timeout, secs */
+#endif
+static int nbatch = 1;		/* max # of packets per recvmmsg() (-B) */
+static int use_uring;		/* use io_uring for network I/O (-U) */
+static unsigned rcsize;		/* response cache entries per thread (-R) */
+static unsigned nloaders = 1;	/* # of threads loading datasets (-L) */
 static FILE *flog;		/* log file */
 static int flushlog;		/* flush log after each line */
 static struct zone *zonelist;	/* list of zones we're authoritative for */
@@ -121,6 +185,10 @@ static int numzones;		/* number of zones in zonelist */
 int lazy;			/* don't return AUTH section by default */
 static int fork_on_reload;
   /* >0 - perform fork on reloads, <0 - this is a child of reloading parent */
+#ifndef NO_BGRELOAD
+static int bgreload;		/* reloads are done by the loader thread */
+static unsigned rcu_epoch = 1;	/* advanced after replacing data */
+#endif
 #if STATS_IPC_IOVEC
 static struct iovec *stats_iov;
 #endif
@@ -180,6 +248,23 @@ static void NORETURN usage(int exitcode) {
 " -n - do not become a daemon\n"
 " -f - fork a child process while reloading zones, to process requests\n"
 "  during reload (may double memory requiriments)\n"
+#ifndef NO_THREADS
+" -T nthreads - number of threads answering queries (1)\n"
+" -L nthreads - number of threads loading changed datasets (1)\n"
+#endif
+#ifndef NO_MMSG
+" -B nbatch - receive and send up to nbatch packets in one system call (1)\n"
+#endif
+#ifndef NO_IO_URING
+" -U - use io_uring for network I/O if supported by the kernel\n"
+#endif
+#ifndef NO_TCP
+" -S maxconn[:idle] - answer queries over TCP too, with up to maxconn\n"
+"  connections, closing connections idle for idle time (10s)\n"
+#endif
+" -R nentries - cache up to nentries replies per thread (no cache)\n"
+" -Z snapdir - keep snapshots of loaded ip4set and dnset datasets in\n"
+"  this directory, to load them faster on the next start\n"
 " -q - quickstart, load zones after backgrounding\n"
 " -l [+]logfile - log queries and answers to this file (+ for unbuffered)\n"
 #ifndef NO_STATS
@@ -193,7 +278,7 @@ static void NORETURN usage(int exitcode) {
 "  In future versions this mode will be the default.\n"
 " -A - put AUTH section in every reply.\n"
 " -F facility - Log facility for syslog. Default is 'daemon'.\n"
-#ifndef NO_ZLIB
+#if !defined(NO_ZLIB) || !defined(NO_ZSTD) || !defined(NO_LZ4)
 " -C - disable on-the-fly decompression of dataset files\n"
 #endif
 #ifndef NO_DZO
@@ -285,6 +370,24 @@ static int already_bound(const struct sockaddr *addr, socklen_t addrlen) {
   return 0;
 }
 
+/* with several workers, let each one bind its own socket to the same
+ * address, so the kernel will spread incoming queries among them */
+static void setreuseport(int UNUSED fd) {
+#if !defined(NO_THREADS) && defined(SO_REUSEPORT)
+  int on = 1;
+  if (nworkers > 1)
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void*)&on, sizeof(on));
+#endif
+}
+
+static void setrcvbuf(int fd) {
+  int x = 65536;
+  do
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (void*)&x, sizeof x) == 0)
+      break;
+  while ((x -= (x >> 5)) >= 1024);
+}
+
 #ifdef NO_IPv6
 static void newsocket(struct sockaddr_in *sin) {
   int fd;
@@ -297,6 +400,7 @@ static void newsocket(struct sockaddr_in *sin) {
   fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
   if (fd < 0)
     error(errno, "unable to create socket");
+  setreuseport(fd);
   if (bind(fd, (struct sockaddr *)sin, sizeof(*sin)) < 0)
     error(errno, "unable to bind to %s/%d", host, ntohs(sin->sin_port));
 
@@ -320,6 +424,7 @@ static int newsocket(struct addrinfo *ai) {
   getnameinfo(ai->ai_addr, ai->ai_addrlen,
               host, sizeof(host), serv, sizeof(serv),
               NI_NUMERICHOST|NI_NUMERICSERV);
+  setreuseport(fd);
   if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0)
         error(errno, "unable to bind to %s/%s", host, serv);
 
@@ -423,12 +528,100 @@ initsockets(const char *bindaddr[MAXSOCK], int nba, int UNUSED family) {
   endservent();
   endhostent();
 
-  for (i = 0; i < numsock; ++i) {
-    x = 65536;
-    do
-      if (setsockopt(sock[i], SOL_SOCKET, SO_RCVBUF, (void*)&x, sizeof x) == 0)
-        break;
-    while ((x -= (x >> 5)) >= 1024);
+  for (i = 0; i < numsock; ++i)
+    setrcvbuf(sock[i]);
+}
+
+#ifndef NO_THREADS
+/* create another socket bound to the same address as fd, for a worker.
+ * If that isn't possible (no SO_REUSEPORT, or a socket passed from
+ * systemd), the socket is shared between workers */
+static int clonesocket(int fd) {
+#ifdef SO_REUSEPORT
+#ifndef NO_IPv6
+  struct sockaddr_storage sa;
+#else
+  struct sockaddr_in sa;
+#endif
+  socklen_t salen = sizeof(sa);
+  int nfd, on = 1;
+
+  if (getsockname(fd, (struct sockaddr *)&sa, &salen) < 0)
+    error(errno, "getsockname failed");
+  nfd = socket(((struct sockaddr *)&sa)->sa_family, SOCK_DGRAM, 0);
+  if (nfd < 0)
+    error(errno, "unable to create socket");
+  if (setsockopt(nfd, SOL_SOCKET, SO_REUSEPORT, (void*)&on, sizeof(on)) == 0
+      && bind(nfd, (struct sockaddr *)&sa, salen) == 0) {
+    setrcvbuf(nfd);
+    return nfd;
+  }
+  close(nfd);
+#endif
+  return fd;
+}
+#endif
+
+static void initworkers(void) {
+  int n, i;
+#ifndef NO_THREADS
+  int shared = 0;
+#endif
+  nthreads = nworkers;
+#ifndef NO_TCP
+  if (tcp_maxconn)
+    ++nthreads;
+#endif
+  workers = (struct worker *)ezalloc(nthreads * sizeof(struct worker));
+  memcpy(workers[0].w_sock, sock, numsock * sizeof(int));
+#ifndef NO_THREADS
+  for (n = 1; n < nworkers; ++n) {
+    for (i = 0; i < numsock; ++i)
+      if ((workers[n].w_sock[i] = clonesocket(sock[i])) == sock[i])
+        shared = 1;
+    pthread_mutex_init(&workers[n].w_lock, NULL);
+  }
+  if (shared)
+    dslog(LOG_WARNING, 0,
+          "unable to create per-thread sockets, sharing sockets between threads");
+#endif
+#ifndef NO_TCP
+  /* the TCP thread is the last one */
+  if (tcp_maxconn) {
+    struct worker *w = workers + nworkers;
+    if (!(w->w_tcp = tcp_new(sock, numsock, tcp_maxconn, tcp_idle)))
+      error(errno, "unable to listen on TCP");
+    tcp_serving = 1;
+    pthread_mutex_init(&w->w_lock, NULL);
+  }
+#endif
+  for (n = 0; n < nthreads; ++n) {
+    if (rcsize)
+      workers[n].w_cache = rcache_new(rcsize);
+    workers[n].w_rridx = rridx_new();
+  }
+  for (n = 0; n < nworkers; ++n) {
+    struct worker *w = workers + n;
+    w->w_pkt = (struct wpacket *)ezalloc(nbatch * sizeof(struct wpacket));
+    for (i = 0; i < nbatch; ++i) {
+      w->w_pkt[i].wp_pkt.p_buf = w->w_pkt[i].wp_buf;
+      w->w_pkt[i].wp_pkt.p_cache = w->w_cache;
+      w->w_pkt[i].wp_pkt.p_rridx = w->w_rridx;
+      w->w_pkt[i].wp_pkt.p_peer = (struct sockaddr *)&w->w_pkt[i].wp_peer_sa;
+    }
+#ifndef NO_MMSG
+    if (nbatch > 1) {
+      w->w_rmsg = (struct mmsghdr *)ezalloc(nbatch * sizeof(struct mmsghdr));
+      w->w_smsg = (struct mmsghdr *)ezalloc(nbatch * sizeof(struct mmsghdr));
+      w->w_iov = (struct iovec *)emalloc(nbatch * sizeof(struct iovec));
+      for (i = 0; i < nbatch; ++i) {
+        w->w_iov[i].iov_base = w->w_pkt[i].wp_pkt.p_buf;
+        w->w_rmsg[i].msg_hdr.msg_name = &w->w_pkt[i].wp_peer_sa;
+        w->w_rmsg[i].msg_hdr.msg_iov = &w->w_iov[i];
+        w->w_rmsg[i].msg_hdr.msg_iovlen = 1;
+      }
+    }
+#endif
   }
 }
 
@@ -535,7 +728,7 @@ static void init(int argc, char **argv) {
 
   if (argc <= 1) usage(1);
 
-  while((c = getopt(argc, argv, "u:r:b:w:t:c:p:nel:qs:h46dvaAfF:Cx:X:")) != EOF)
+  while((c = getopt(argc, argv, "u:r:b:w:t:c:p:nel:qs:h46dvaAfF:Cx:X:T:L:B:US:R:Z:")) != EOF)
     switch(c) {
     case 'u': user = optarg; break;
     case 'r': rootdir = optarg; break;
@@ -617,6 +810,58 @@ break;
     case 'a': lazy = 1; break;
     case 'A': lazy = 0; break;
     case 'f': forkon = 1; break;
+    case 'T':
+      if ((nworkers = satoi(optarg)) < 1 || nworkers > 1024)
+        error(0, "invalid number of threads (-T) `%.50s'", optarg);
+#ifdef NO_THREADS
+      if (nworkers > 1)
+        error(0, "threads support isn't compiled in");
+#endif
+      break;
+    case 'L':
+      if ((c = satoi(optarg)) < 1 || c > 1024)
+        error(0, "invalid number of loading threads (-L) `%.50s'", optarg);
+#ifdef NO_THREADS
+      if (c > 1)
+        error(0, "threads support isn't compiled in");
+#endif
+      nloaders = c;
+      break;
+    case 'B':
+      if ((nbatch = satoi(optarg)) < 1 || nbatch > 1024)
+        error(0, "invalid batch size (-B) `%.50s'", optarg);
+#ifdef NO_MMSG
+      if (nbatch > 1)
+        error(0, "batched I/O (recvmmsg) support isn't compiled in");
+#endif
+      break;
+    case 'U':
+#ifdef NO_IO_URING
+      error(0, "io_uring support isn't compiled in");
+#endif
+      use_uring = 1;
+      break;
+    case 'S':
+#ifdef NO_TCP
+      error(0, "TCP support isn't compiled in");
+#else
+      if ((p = strchr(optarg, ':')) != NULL) {
+        char *e;
+        *p++ = '\0';
+        if (!(e = parse_time(p, &tcp_idle)) || *e || !tcp_idle)
+          error(0, "invalid TCP idle timeout (-S) `%.50s'", p);
+      }
+      if ((c = satoi(optarg)) < 1)
+        error(0, "invalid number of TCP connections (-S) `%.50s'", optarg);
+      tcp_maxconn = c;
+      break;
+#endif
+    case 'R':
+      if ((c = satoi(optarg)) < 0 || c > 0x1000000)
+        error(0, "invalid response cache size (-R) `%.50s'", optarg);
+      rcsize = c;
+      break;
+    case 'Z': snapdir = optarg; break;
     case 'F': facility = optarg; break;
     case 'C': nouncompress = 1; break;
 #ifndef NO_DSO
@@ -643,6 +888,7 @@ break;
     for(c = 0; c < argc; ++c)
       zonelist = addzone(zonelist, argv[c]);
     init_zones_caches(zonelist);
+    zindex_build(zonelist);
     if (rootdir && (chdir(rootdir) < 0 || chroot(rootdir) < 0))
       error(errno, "unable to chroot to %.50s", rootdir);
     if (workdir && chdir(workdir) < 0)
@@ -659,6 +905,11 @@ break;
   }
 #endif
 
+  if (forkon && nworkers > 1)
+    error(0, "-f and -T options are mutually exclusive");
+  if (forkon && use_uring)
+    error(0, "-f and -U options are mutually exclusive");
+
   if (!nba
 #ifdef USE_SYSTEMD
       && !sd_listen_fds(0)
@@ -750,6 +1001,8 @@ break;
   systemd_initsockets();
 #endif
 
+  initworkers();
+
 #ifndef NO_DSO
   if (ext) {
     void *handle = dlopen(ext, RTLD_NOW);
@@ -822,14 +1075,29 @@ break;
   if (extinit && extinit(extarg, zonelist) != 0)
     error(0, "unable to iniitialize extension `%s'", ext);
 #endif
+  zindex_build(zonelist);
 
   if (!quickstart && !do_reload(0))
     error(0, "zone loading errors, aborting");
 
   /* count number of zones */
   for(c = 0, z = zonelist; z; z = z->z_next)
+#ifndef NO_STATS
+    ((struct zone *)z)->z_idx = ++c;
+#else
     ++c;
+#endif
   numzones = c;
+#ifndef NO_STATS
+  for(c = 0; c < nthreads; ++c) {
+    struct worker *w = workers + c;
+    int i;
+    w->w_stats = (struct dnsstats *)
+      ezalloc((numzones + 1) * sizeof(struct dnsstats));
+    for(i = 0; w->w_pkt && i < nbatch; ++i)
+      w->w_pkt[i].wp_pkt.p_stats = w->w_stats;
+  }
+#endif
 
 #if STATS_IPC_IOVEC
   stats_iov = (struct iovec *)emalloc(numzones * sizeof(struct iovec));
@@ -913,6 +1181,37 @@ static void setup_signals(void) {
 struct dnsstats gstats;
 static struct dnsstats gptot;
 static time_t stats_time;
+static dnscnt_t nrecv, nrpkt;	/* batched receives and packets */
+static dnscnt_t rchits, rcmiss;	/* response cache hits and misses */
+
+/* move per-thread counters into gstats and z_stats.
+ * Must be called with all workers paused. */
+static void foldstats(void) {
+  struct dnsstats *s;
+  struct zone *z;
+  int n;
+#define add(t,x) t.x += s->x
+#define addstats(t) \
+    add(t,b_in); add(t,b_out); add(t,q_ok); add(t,q_nxd); add(t,q_err)
+  for(n = 0; n < nthreads; ++n) {
+    struct worker *w = workers + n;
+    s = w->w_stats;
+    addstats(gstats);
+    for(z = zonelist; z; z = z->z_next) {
+      s = w->w_stats + z->z_idx;
+      addstats(z->z_stats);
+    }
+    memset(w->w_stats, 0, (numzones + 1) * sizeof(*s));
+    nrecv += w->w_nrecv; w->w_nrecv = 0;
+    nrpkt += w->w_nrpkt; w->w_nrpkt = 0;
+    if (w->w_cache) {
+      rchits += w->w_cache->rc_hits; w->w_cache->rc_hits = 0;
+      rcmiss += w->w_cache->rc_miss; w->w_cache->rc_miss = 0;
+    }
+  }
+#undef addstats
+#undef add
+}
 
 static void dumpstats(void) {
   struct dnsstats tot;
@@ -994,6 +1293,15 @@ static void logstats(int reset) {
     tot.q_ok + tot.q_nxd + tot.q_err,
     tot.q_ok, tot.q_nxd, tot.q_err,
     tot.b_in, tot.b_out);
+  if (nbatch > 1 || use_uring)
+    dslog(LOG_INFO, 0,
+      "stats for %ldsec: batches=%" PRI_DNSCNT " packets=%" PRI_DNSCNT
+      " avg=%.2f", (long)d, nrecv, nrpkt,
+      nrecv ? (double)nrpkt / nrecv : 0.);
+  if (rcsize)
+    dslog(LOG_INFO, 0,
+      "stats for %ldsec: cache hits=%" PRI_DNSCNT " misses=%" PRI_DNSCNT,
+      (long)d, rchits, rcmiss);
 #undef C
   if (reset) {
     for(z = zonelist; z; z = z->z_next) {
@@ -1002,6 +1310,8 @@ static void logstats(int reset) {
     }
     memset(&gstats, 0, sizeof(gstats));
     memset(&gptot, 0, sizeof(gptot));
+    nrecv = nrpkt = 0;
+    rchits = rcmiss = 0;
     stats_time = t;
   }
 }
@@ -1025,10 +1335,73 @@ static void ipc_write_stats(int fd) {
 #endif
 
 #else
+# define foldstats()
 # define ipc_read_stats(fd)
 # define ipc_write_stats(fd)
 #endif
 
+#ifndef NO_THREADS
+/* workers hold their w_lock while processing a query; the main thread
+ * grabs all of them to stop query processing while it modifies data */
+static void pause_workers(void) {
+  int n;
+  for(n = 1; n < nthreads; ++n)
+    pthread_mutex_lock(&workers[n].w_lock);
+}
+static void resume_workers(void) {
+  int n;
+  for(n = 1; n < nthreads; ++n)
+    pthread_mutex_unlock(&workers[n].w_lock);
+}
+#else
+# define pause_workers()
+# define resume_workers()
+#endif
+
+/* a worker is inside wenter()..wleave() while it answers queries.  With
+ * background reloads it also records the current rcu_epoch there, so the
+ * loader thread knows when no query can use the data it replaced. */
+static inline void wenter(struct worker UNUSED *w) {
+#ifndef NO_THREADS
+  if (w != workers)
+    pthread_mutex_lock(&w->w_lock);
+#endif
+#ifndef NO_BGRELOAD
+  __atomic_store_n(&w->w_epoch, __atomic_load_n(&rcu_epoch, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline void wleave(struct worker UNUSED *w) {
+#ifndef NO_BGRELOAD
+  __atomic_store_n(&w->w_epoch, 0, __ATOMIC_RELEASE);
+#endif
+#ifndef NO_THREADS
+  if (w != workers)
+    pthread_mutex_unlock(&w->w_lock);
+#endif
+}
+
+/* wait until all queries which started before data was replaced are done */
+static void rcu_synchronize(void) {
+#ifndef NO_BGRELOAD
+  unsigned e, we;
+  int n;
+  if (!(e = __atomic_add_fetch(&rcu_epoch, 1, __ATOMIC_SEQ_CST)))
+    e = rcu_epoch = 1;		/* 0 marks idle workers */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for(n = 0; workers && n < nthreads; ++n)
+    while((we = __atomic_load_n(&workers[n].w_epoch, __ATOMIC_ACQUIRE)) != 0
+          && (int)(we - e) < 0) {
+      struct timespec ts;
+      ts.tv_sec = 0;
+      ts.tv_nsec = 1000000;
+      nanosleep(&ts, NULL);
+    }
+#endif
+}
+
 static void reopenlog(void) {
   if (logfile) {
     int fd;
@@ -1047,6 +1420,14 @@ static void reopenlog(void) {
   }
 }
 
+/* invalidate cached replies */
+static void newgen(void) {
+  unsigned gen = reload_gen + 1;
+  if (!gen)		/* 0 marks empty cache entries */
+    gen = 1;
+  rcu_assign(reload_gen, gen);
+}
+
 static void check_expires(void) {
   struct zone *zone;
   time_t now = time(NULL);
@@ -1055,7 +1436,8 @@ static void check_expires(void) {
       continue;
     if (zone->z_expires && zone->z_expires < now) {
       zlog(LOG_WARNING, zone, "zone data expired, zone will not be serviced");
-      zone->z_stamp = 0;
+      rcu_assign(zone->z_stamp, 0);
+      newgen();
     }
   }
 }
@@ -1129,12 +1511,7 @@ static int do_reload(int do_fork) {
   utm = tms.tms_utime;
 #endif /* NO_TIMES */
 
-  r = 1;
-  while(ds) {
-    if (!loaddataset(ds))
-      r = 0;
-    ds = nextdataset2reload(ds);
-  }
+  r = loaddatasets(zonelist, nloaders);
 
   for (zone = zonelist; zone; zone = zone->z_next) {
     time_t stamp = 0;
@@ -1161,7 +1538,7 @@ static int do_reload(int do_fork) {
     }
 
     zone->z_expires = expires;
-    zone->z_stamp = stamp;
+    rcu_assign(zone->z_stamp, stamp);
     if (!stamp) {
       zlog(LOG_WARNING, zone,
            "not all datasets are loaded, zone will not be serviced");
@@ -1176,6 +1553,12 @@ static int do_reload(int do_fork) {
   if (call_hook(reload, (zonelist)) != 0)
     r = 0;
 
+  /* all new data is in place; drop cached replies, and free old data
+   * once queries which might still use it are done */
+  newgen();
+  rcu_synchronize();
+  freeolddatasets();
+
   ip = ssprintf(ibuf, sizeof(ibuf), "zones reloaded");
 #ifndef NO_TIMES
   etm = times(&tms) - etm;
@@ -1235,8 +1618,110 @@ static int do_reload(int do_fork) {
   return r;
 }
 
+#ifndef NO_BGRELOAD
+/* with background reloads, signals only wake up the loader thread, and
+ * queries are answered from the current data while it loads new one */
+static pthread_t loader;
+static pthread_mutex_t loader_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loader_cond = PTHREAD_COND_INITIALIZER;
+static int loader_req;
+
+static void *loader_thread(void UNUSED *arg) {
+  for(;;) {
+    pthread_mutex_lock(&loader_lock);
+    while(!loader_req)
+      pthread_cond_wait(&loader_cond, &loader_lock);
+    loader_req = 0;
+    pthread_mutex_unlock(&loader_lock);
+    do_reload(0);
+  }
+  return NULL;
+}
+
+static void wakeloader(void) {
+  pthread_mutex_lock(&loader_lock);
+  loader_req = 1;
+  pthread_cond_signal(&loader_cond);
+  pthread_mutex_unlock(&loader_lock);
+}
+
+static void startloader(void) {
+  sigset_t ssall, ssold;
+  if (fork_on_reload)
+    return;		/* forking reloads stop serving anyway */
+  sigfillset(&ssall);
+  pthread_sigmask(SIG_SETMASK, &ssall, &ssold);
+  if ((errno = pthread_create(&loader, NULL, loader_thread, NULL)) != 0)
+    dslog(LOG_WARNING, 0, "unable to create loader thread (%s), "
+          "queries will be paused during reloads", strerror(errno));
+  else
+    bgreload = 1;
+  pthread_sigmask(SIG_SETMASK, &ssold, NULL);
+}
+#endif
+
+#ifndef NO_INOTIFY
+/* with background reloads, changes to data files are also noticed by
+ * inotify, and the loader is woken up once the files are quiet for
+ * WATCH_DELAY msec (at most WATCH_MAXDELAY msec after the first change),
+ * instead of at the next periodic check (which still happens). */
+#define WATCH_DELAY	250
+#define WATCH_MAXDELAY	2000
+
+static long msecs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *watch_thread(void *arg) {
+  struct pollfd pfd;
+  long deadline, left;
+
+  pfd.fd = (int)(long)arg;
+  pfd.events = POLLIN;
+  for(;;) {
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+      dslog(LOG_WARNING, 0, "inotify: %s", strerror(errno));
+      break;
+    }
+    if (!watchedchange(pfd.fd))
+      continue;
+    deadline = msecs() + WATCH_MAXDELAY;
+    while((left = deadline - msecs()) > 0 &&
+          poll(&pfd, 1, left < WATCH_DELAY ? (int)left : WATCH_DELAY) > 0)
+      watchedchange(pfd.fd);
+    wakeloader();
+  }
+  close(pfd.fd);
+  return NULL;
+}
+
+static void startwatcher(void) {
+  sigset_t ssall, ssold;
+  pthread_t t;
+  int fd;
+  if (!bgreload || !recheck)
+    return;		/* only automatic background reloads */
+  if ((fd = watchdatasets()) < 0)
+    return;
+  sigfillset(&ssall);
+  pthread_sigmask(SIG_SETMASK, &ssall, &ssold);
+  if ((errno = pthread_create(&t, NULL, watch_thread, (void*)(long)fd)) != 0) {
+    dslog(LOG_WARNING, 0, "unable to create inotify thread: %s",
+          strerror(errno));
+    close(fd);
+  }
+  else
+    pthread_detach(t);
+  pthread_sigmask(SIG_SETMASK, &ssold, NULL);
+}
+#endif
+
 static void do_signalled(void) {
   sigprocmask(SIG_SETMASK, &ssblock, NULL);
+  pause_workers();
+  foldstats();
   if (signalled & SIGNALLED_TERM) {
     if (fork_on_reload < 0) { /* this is a temp child; dump stats and exit */
       ipc_write_stats(1);
@@ -1270,71 +1755,177 @@ static void do_signalled(void) {
 #endif
   if (signalled & SIGNALLED_RELOG)
     reopenlog();
-  if (signalled & SIGNALLED_RELOAD)
+  if (signalled & SIGNALLED_RELOAD) {
+#ifndef NO_BGRELOAD
+    if (bgreload)
+      wakeloader();
+    else
+#endif
     do_reload(fork_on_reload);
+  }
   signalled = 0;
+  resume_workers();
   sigprocmask(SIG_SETMASK, &ssempty, NULL);
 }
 
-#ifndef NO_IPv6
-static struct sockaddr_storage peer_sa;
-#else
-static struct sockaddr_in peer_sa;
+#ifndef NO_MMSG
+/* receive up to nbatch queries at once, and send all replies at once */
+static void request_batch(struct worker *w, int fd) {
+  struct mmsghdr *rm = w->w_rmsg, *sm = w->w_smsg;
+  struct dnspacket *pkt;
+  int i, n, r, ns;
+
+  for(i = 0; i < nbatch; ++i) {
+    rm[i].msg_hdr.msg_namelen = sizeof(w->w_pkt[i].wp_peer_sa);
+    w->w_iov[i].iov_len = sizeof(w->w_pkt[i].wp_buf);
+  }
+  n = recvmmsg(fd, rm, nbatch, MSG_WAITFORONE, NULL);
+  if (n <= 0)			/* interrupted? */
+    return;
+#ifndef NO_STATS
+  w->w_nrecv += 1;
+  w->w_nrpkt += n;
 #endif
-static struct dnspacket pkt;
 
-static void request(int fd) {
+  wenter(w);
+  for(i = ns = 0; i < n; ++i) {
+    pkt = &w->w_pkt[i].wp_pkt;
+    pkt->p_peerlen = rm[i].msg_hdr.msg_namelen;
+    r = replypacket(pkt, rm[i].msg_len, zonelist);
+    if (!r)
+      continue;
+    if (flog)
+      logreply(pkt, flog, flushlog);
+    w->w_iov[i].iov_len = r;
+    sm[ns].msg_hdr = rm[i].msg_hdr;
+    ++ns;
+  }
+  wleave(w);
+
+  /* finally, send the replies, skipping over ones which fail */
+  for(i = 0; i < ns; ) {
+    r = sendmmsg(fd, sm + i, ns - i, 0);
+    if (r > 0)
+      i += r;
+    else if (r == 0 || errno != EINTR)
+      ++i;
+  }
+}
+#endif
+
+static void request(struct worker *w, int fd) {
+  struct dnspacket *pkt = &w->w_pkt->wp_pkt;
   int q, r;
-  socklen_t salen = sizeof(peer_sa);
+  socklen_t salen = sizeof(w->w_pkt->wp_peer_sa);
+
+#ifndef NO_MMSG
+  if (nbatch > 1) {
+    request_batch(w, fd);
+    return;
+  }
+#endif
 
-  q = recvfrom(fd, (void*)pkt.p_buf, sizeof(pkt.p_buf), 0,
-               (struct sockaddr *)&peer_sa, &salen);
+  q = recvfrom(fd, (void*)pkt->p_buf, sizeof(w->w_pkt->wp_buf), 0,
+               (struct sockaddr *)&w->w_pkt->wp_peer_sa, &salen);
   if (q <= 0)			/* interrupted? */
     return;
 
-  pkt.p_peerlen = salen;
-  r = replypacket(&pkt, q, zonelist);
+  pkt->p_peerlen = salen;
+  wenter(w);
+  r = replypacket(pkt, q, zonelist);
+  if (r && flog)
+    logreply(pkt, flog, flushlog);
+  wleave(w);
   if (!r)
     return;
-  if (flog)
-    logreply(&pkt, flog, flushlog);
 
   /* finally, send a reply */
-  while(sendto(fd, (void*)pkt.p_buf, r, 0,
-               (struct sockaddr *)&peer_sa, salen) < 0)
+  while(sendto(fd, (void*)pkt->p_buf, r, 0,
+               (struct sockaddr *)&w->w_pkt->wp_peer_sa, salen) < 0)
     if (errno != EINTR) break;
 
 }
 
-int main(int argc, char **argv) {
-  init(argc, argv);
-  setup_signals();
-  reopenlog();
-#ifdef HAVE_SETITIMER
-  if (recheck) {
-    struct itimerval itv;
-    itv.it_interval.tv_sec  = itv.it_value.tv_sec  = recheck;
-    itv.it_interval.tv_usec = itv.it_value.tv_usec = 0;
-    if (setitimer(ITIMER_REAL, &itv, NULL) < 0)
-      error(errno, "unable to setitimer()");
-  }
-#else
-  alarm(recheck);
+#if !defined(NO_IO_URING) || !defined(NO_TCP)
+/* answer a query for a worker; pkt belongs to the I/O backend */
+static unsigned wquery(void *arg, struct dnspacket *pkt, unsigned qlen) {
+  int r;
+#ifndef NO_STATS
+  pkt->p_stats = ((struct worker *)arg)->w_stats;
+#endif
+  pkt->p_cache = ((struct worker *)arg)->w_cache;
+  pkt->p_rridx = ((struct worker *)arg)->w_rridx;
+  r = replypacket(pkt, qlen, zonelist);
+  if (r && flog)
+    logreply(pkt, flog, flushlog);
+  return r;
+}
 #endif
+
+#ifndef NO_IO_URING
+static void NORETURN serve_uring(struct worker *w) {
+  unsigned UNUSED n;	/* only used for stats */
+  for(;;) {
+    if (signalled && w == workers) do_signalled();
+    if (uring_wait(w->w_uring) < 0)	/* interrupted? */
+      continue;
+    wenter(w);
+    n = uring_process(w->w_uring, wquery, w);
+    wleave(w);
 #ifndef NO_STATS
-  stats_time = time(NULL);
-  if (statsfile)
-    dumpstats_z();
+    if (n) {
+      w->w_nrecv += 1;
+      w->w_nrpkt += n;
+    }
+#endif
+  }
+}
+#endif
+
+#ifndef NO_TCP
+static void NORETURN serve_tcp(struct worker *w) {
+  for(;;) {
+    if (tcp_wait(w->w_tcp) < 0)	/* interrupted? */
+      continue;
+    wenter(w);
+    tcp_process(w->w_tcp, wquery, w);
+    wleave(w);
+  }
+}
+#endif
+
+/* query-serving loop.  Only the main thread (workers[0]) gets signals */
+static void NORETURN serve(struct worker *w) {
+  int *sk = w->w_sock;
+
+#ifndef NO_TCP
+  if (w->w_tcp)
+    serve_tcp(w);
 #endif
 
-  pkt.p_peer = (struct sockaddr *)&peer_sa;
+#ifndef NO_IO_URING
+  /* the ring is created by the thread which uses it */
+  if (use_uring) {
+    if ((w->w_uring = uring_new(sk, numsock)) != NULL)
+      serve_uring(w);
+    if (w == workers)
+      dslog(LOG_WARNING, 0, "unable to set up io_uring (%s), using %s",
+            strerror(errno),
+#ifdef NO_POLL
+            "select()"
+#else
+            "poll()"
+#endif
+            );
+  }
+#endif
 
   if (numsock == 1) {
     /* optimized case for only one socket */
-    int fd = sock[0];
+    int fd = sk[0];
     for(;;) {
-      if (signalled) do_signalled();
-      request(fd);
+      if (signalled && w == workers) do_signalled();
+      request(w, fd);
     }
   }
   else {
@@ -1342,21 +1933,21 @@ int main(int argc, char **argv) {
 #ifdef NO_POLL
     fd_set rfds;
     int maxfd = 0;
-    int *fdi, *fde = sock + numsock;
+    int *fdi, *fde = sk + numsock;
     FD_ZERO(&rfds);
-    for (fdi = sock; fdi < fde; ++fdi) {
+    for (fdi = sk; fdi < fde; ++fdi) {
       FD_SET(*fdi, &rfds);
       if (*fdi > maxfd) maxfd = *fdi;
     }
     ++maxfd;
     for(;;) {
       fd_set rfd = rfds;
-      if (signalled) do_signalled();
+      if (signalled && w == workers) do_signalled();
       if (select(maxfd, &rfd, NULL, NULL, NULL) <= 0)
         continue;
-      for(fdi = sock; fdi < fde; ++fdi) {
+      for(fdi = sk; fdi < fde; ++fdi) {
         if (FD_ISSET(*fdi, &rfd))
-          request(*fdi);
+          request(w, *fdi);
       }
     }
 #else /* !NO_POLL */
@@ -1364,16 +1955,16 @@ int main(int argc, char **argv) {
     struct pollfd *pfdi, *pfde = pfda + numsock;
     int r;
     for(r = 0; r < numsock; ++r) {
-      pfda[r].fd = sock[r];
+      pfda[r].fd = sk[r];
       pfda[r].events = POLLIN;
     }
     for(;;) {
-      if (signalled) do_signalled();
+      if (signalled && w == workers) do_signalled();
       r = poll(pfda, numsock, -1);
       if (r <= 0) continue;
       for(pfdi = pfda; pfdi < pfde; ++pfdi) {
         if (!(pfdi->revents & POLLIN)) continue;
-        request(pfdi->fd);
+        request(w, pfdi->fd);
         if (!--r) break;
       }
     }
@@ -1381,6 +1972,67 @@ int main(int argc, char **argv) {
   }
 }
 
+#ifndef NO_THREADS
+static void *worker_thread(void *arg) {
+  serve((struct worker *)arg);
+}
+
+static void startworkers(void) {
+  sigset_t ssall, ssold;
+  int n;
+  if (nthreads < 2)
+    return;
+  /* signals are handled by the main thread only */
+  sigfillset(&ssall);
+  pthread_sigmask(SIG_SETMASK, &ssall, &ssold);
+  for(n = 1; n < nthreads; ++n)
+    if ((errno = pthread_create(&workers[n].w_thread, NULL,
+                                worker_thread, workers + n)) != 0)
+      error(errno, "unable to create thread");
+  pthread_sigmask(SIG_SETMASK, &ssold, NULL);
+  if (nworkers > 1)
+    dslog(LOG_INFO, 0, "serving queries with %d threads", nworkers);
+#ifndef NO_TCP
+  if (tcp_maxconn)
+    dslog(LOG_INFO, 0, "serving TCP queries, up to %u connections",
+          tcp_maxconn);
+#endif
+}
+#endif
+
+int main(int argc, char **argv) {
+  init(argc, argv);
+  setup_signals();
+  reopenlog();
+#ifdef HAVE_SETITIMER
+  if (recheck) {
+    struct itimerval itv;
+    itv.it_interval.tv_sec  = itv.it_value.tv_sec  = recheck;
+    itv.it_interval.tv_usec = itv.it_value.tv_usec = 0;
+    if (setitimer(ITIMER_REAL, &itv, NULL) < 0)
+      error(errno, "unable to setitimer()");
+  }
+#else
+  alarm(recheck);
+#endif
+#ifndef NO_STATS
+  stats_time = time(NULL);
+  if (statsfile)
+    dumpstats_z();
+#endif
+
+#ifndef NO_THREADS
+  startworkers();
+#endif
+#ifndef NO_BGRELOAD
+  startloader();
+#endif
+#ifndef NO_INOTIFY
+  startwatcher();
+#endif
+  serve(workers);
+}
+
 void oom(void) {
   if (initialized)
     dslog(LOG_ERR, 0, "out of memory loading dataset");
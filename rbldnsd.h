@@ -23,6 +23,16 @@
 # define NORETURN __attribute__((noreturn))
 #endif
 
+/* pointers to data which the loader thread replaces while queries are
+ * using it are published with rcu_assign() and read with rcu_deref() */
+#ifndef NO_BGRELOAD
+# define rcu_assign(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+# define rcu_deref(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+#else
+# define rcu_assign(p, v) ((p) = (v))
+# define rcu_deref(p) (p)
+#endif
+
 extern char *progname; /* limited to 32 chars */
 extern int logto;
 #define LOGTO_STDOUT 0x01
@@ -35,9 +45,13 @@ struct dataset;
 struct dsdata;
 struct dsctx;
 struct sockaddr;
+struct dnsstats;
+struct rcache;
+struct rridx;
 
 struct dnspacket {		/* private structure */
-  unsigned char p_buf[DNS_EDNS0_MAXPACKET]; /* packet buffer */
+  unsigned char *p_buf;		/* packet buffer, DNS_EDNS0_MAXPACKET */
+  unsigned p_tcpsz;		/* TCP: size of p_buf, 0 for UDP */
   unsigned char *p_endp;	/* end of packet buffer */
   unsigned char *p_cur;		/* current pointer */
   unsigned char *p_sans;	/* start of answers */
@@ -45,6 +59,12 @@ struct dnspacket {		/* private structure */
   const struct dataset *p_substds;
   const struct sockaddr *p_peer;/* address of the requesting client */
   unsigned p_peerlen;
+  /* per-thread state, persists between queries */
+  unsigned p_cns;		/* NS rotation counter */
+  unsigned p_crr;		/* RRset rotation counter (generic) */
+  struct dnsstats *p_stats;	/* counters: [0] global, [z_idx] per zone */
+  struct rcache *p_cache;	/* response cache, NULL if disabled */
+  struct rridx *p_rridx;	/* answer dedup index, NULL: linear scan */
 };
 
 struct dnsquery {	/* q */
@@ -189,6 +209,12 @@ struct dsfile {	/* dsf */
   off_t  dsf_size;		/* last size of this file */
   struct dsfile *dsf_next;	/* next file in list */
   const char *dsf_name;		/* name of this file */
+  const char *dsf_dname;	/* name of its delta file */
+  time_t dsf_dstamp;		/* last timestamp of delta file, 0 if none */
+  off_t  dsf_dsize;		/* last size of delta file */
+  off_t  dsf_doff;		/* end of the last delta line applied */
+  off_t  dsf_dfull;		/* dsf_doff after the last full load */
+  unsigned long dsf_dseq;	/* $SEQ of the delta file */
 };
 
 struct dssoa { /* dssoa */
@@ -217,8 +243,10 @@ struct dataset {	/* ds */
   unsigned ds_ttl;			/* default ttl for a dataset */
   char *ds_subst[11];			/* substitution variables */
 #define SUBST_BASE_TEMPLATE	10
+  struct rrtxt *ds_rrtxt;		/* pre-encoded TXT RRs */
   struct mempool *ds_mp;		/* memory pool for data */
   struct dataset *ds_next;		/* next in global list */
+  struct dataset *ds_prev;		/* previous version, freed after reload */
 };
 
 struct dslist {	/* dsl */
@@ -246,8 +274,26 @@ struct dnsstats {
   dnscnt_t q_ok, q_nxd, q_err;	/* number of requests: OK, NXDOMAIN, ERROR */
 };
 extern struct dnsstats gstats;	/* global statistics counters */
+/* gstats and z_stats are only updated by the main thread, by folding
+ * per-thread pkt->p_stats[] counters into them (rbldnsd.c) */
 #endif /* NO_STATS */
 
+/* response cache (-R), one per query-serving thread (rbldnsd_packet.c).
+ * Entries are valid for the current reload_gen only. */
+struct rcentry;
+struct rcache {
+  struct rcentry *rc_e;		/* entries */
+  unsigned rc_mask;		/* number of entries - 1 */
+  unsigned rc_ins;		/* replacement counter */
+  unsigned rc_gen;		/* reload_gen at start of current query */
+#ifndef NO_STATS
+  dnscnt_t rc_hits, rc_miss;	/* folded by main thread like p_stats */
+#endif
+};
+struct rcache *rcache_new(unsigned nentries);
+struct rridx *rridx_new(void);
+extern unsigned reload_gen;	/* changes whenever zone data changes */
+
 #define MAX_NS 32
 
 struct zone {	/* zone, list of zones */
@@ -263,19 +309,21 @@ struct zone {	/* zone, list of zones */
   /* SOA record */
   const struct dssoa *z_dssoa;		/* original SOA from a dataset */
   struct zonesoa *z_zsoa;		/* pre-packed SOA record */
+  struct zonesoa *z_zsoa_spare;		/* previous one, reused on reload */
   const unsigned char *z_nsdna[MAX_NS];	/* array of nameserver DNs */
   unsigned z_nns;			/* number of NSes in z_dsnsa[] */
   unsigned z_nsttl;			/* ttl for NS records */
-  unsigned z_cns;			/* current NS in rotation */
-  unsigned z_nglue;			/* number of glue records */
-  struct zonens *z_zns;			/* pre-packed NS records */
+  struct zonens *z_zns;			/* pre-packed NS and glue records */
+  struct zonens *z_zns_spare;		/* previous one, reused on reload */
 #ifndef NO_STATS
+  unsigned z_idx;			/* index in pkt->p_stats[] */
   struct dnsstats z_stats;		/* statistic counters */
   struct dnsstats z_pstats;		/* for stats monitoring: prev values */
 #endif
 #ifndef NO_DSO
   void *z_hookdata;			/* data ptr for hooks */
 #endif
+  struct zindex *z_zidx;		/* index of the list (head only) */
   struct zone *z_next;			/* next in list */
 };
 
@@ -294,6 +342,35 @@ findqzone(const struct zone *zonelist,
 /* log a reply */
 void logreply(const struct dnspacket *pkt, FILE *flog, int flushlog);
 
+#ifndef NO_IO_URING
+/* io_uring-based network I/O (rbldnsd_uring.c) */
+struct uring;
+struct uring *uring_new(const int *sock, int nsock);
+int uring_wait(struct uring *u);
+unsigned
+uring_process(struct uring *u,
+              unsigned (*query)(void *arg, struct dnspacket *pkt,
+                                unsigned qlen),
+              void *arg);
+#endif
+
+/* set when queries are answered over TCP too (-S), so UDP replies
+ * which don't fit may have TC set */
+extern int tcp_serving;
+
+#ifndef NO_TCP
+/* DNS-over-TCP listener (rbldnsd_tcp.c) */
+struct tcpsrv;
+struct tcpsrv *tcp_new(const int *sock, int nsock,
+                       unsigned maxconn, unsigned idle);
+int tcp_wait(struct tcpsrv *t);
+void
+tcp_process(struct tcpsrv *t,
+            unsigned (*query)(void *arg, struct dnspacket *pkt,
+                              unsigned qlen),
+            void *arg);
+#endif
+
 /* details of DNS packet structure are in rbldnsd_packet.c */
 
 /* add a record into answer section */
@@ -325,6 +402,19 @@ void dump_ip6range(const ip6oct_t *beg, const ip6oct_t *end, const char *rr,
 int txtsubst(char txtbuf[TXTBUFSIZ], const char *template,
 	     const char *sub0, const struct dataset *ds);
 
+/* compiled TXT templates of A+TXT RRs.  Dataset finish routines add
+ * all their RRs (when substitution variables are known), and
+ * addrr_a_txt() uses rrtxt_rdata() to build TXT RDATA: RRs which does
+ * not depend on the query are copied as is, the rest only needs
+ * concatenation.  rrtxt_subst() tells if the query subject is needed. */
+void rrtxt_add(struct dataset *ds, const char *rr);
+int rrtxt_subst(const struct dataset *ds, const char *rr);
+const unsigned char *
+rrtxt_rdata(unsigned char sb[TXTBUFSIZ+1], const char *rr,
+            const char *subst, const struct dataset *ds);
+int rrtxt_copy(struct dataset *ds, const struct dataset *ods);
+void rrtxt_free(struct dataset *ds);
+
 struct zone *addzone(struct zone *zonelist, const char *spec);
 void connectdataset(struct zone *zone,
                     struct dataset *ds,
@@ -332,8 +422,28 @@ void connectdataset(struct zone *zone,
 struct zone *newzone(struct zone **zonelist,
                      unsigned char *dn, unsigned dnlen,
                      struct mempool *mp);
+/* hash index of a zone list for findqzone(), set up in the list head */
+void zindex_build(struct zone *zonelist);
+void zindex_free(struct zone *zonelist);
+const struct zone *
+zindex_find(const struct zindex *zi, unsigned dnlen, unsigned dnlab,
+            unsigned char *const *const dnlptr);
 struct dataset *nextdataset2reload(struct dataset *ds);
-int loaddataset(struct dataset *ds);
+#ifndef NO_INOTIFY
+/* inotify descriptor watching all data files, or -1 */
+int watchdatasets(void);
+/* read pending events from fd, return 1 if any data file changed */
+int watchedchange(int fd);
+#endif
+int loaddatasets(struct zone *zonelist, unsigned nthreads);
+void freeolddatasets(void);
+
+/* log lines of a dataset loaded in parallel with others, to be written
+ * out in order when all loads are done */
+struct dslogbuf {
+  char *lb_buf;
+  unsigned lb_len, lb_size;
+};
 
 struct dsctx {
   struct dataset *dsc_ds;	/* currently loading dataset */
@@ -342,14 +452,144 @@ struct dsctx {
   int dsc_lineno;		/* current line number */
   int dsc_warns;		/* number of warnings so far */
   unsigned dsc_ip4maxrange;	/* max IP4 range allowed */
+  int dsc_nomem;		/* finishfn ran out of memory */
+  struct dslogbuf *dsc_logbuf;	/* save log lines here if not NULL */
 };
 
+void dslogflush(struct dslogbuf *lb);
+void dslogjoin(struct dsctx *dsc, struct dslogbuf *lb, int warns);
 void PRINTFLIKE(3,4) dslog(int level, struct dsctx *dsc, const char *fmt, ...);
 void PRINTFLIKE(2,3) dswarn(struct dsctx *dsc, const char *fmt, ...);
 void PRINTFLIKE(2,3) dsloaded(struct dsctx *dsc, const char *fmt, ...);
 void PRINTFLIKE(3,4)
 zlog(int level, const struct zone *zone, const char *fmt, ...);
 
+/* blocked Bloom filter over dataset keys, to reject most negative
+ * lookups without searching (rbldnsd_util.c).  Every key sets one bit in
+ * each of BLOOM_K words of a single block.  A filter without bits (empty
+ * or failed to allocate) says "maybe" for every key. */
+#define BLOOM_K 8
+struct bloom {
+  unsigned *bf_bits;		/* BLOOM_K words per block */
+  unsigned bf_mask;		/* number of blocks - 1 */
+};
+int bloom_init(struct bloom *bf, unsigned nkeys);
+void bloom_free(struct bloom *bf);
+void bloom_add(struct bloom *bf, unsigned hash);
+unsigned bloom_hash(const unsigned char *p, unsigned len, unsigned seed);
+const char *bloom_stats(const struct bloom *bf);
+
+static inline unsigned bloom_hash32(unsigned h) {	/* murmur3 fmix32 */
+  h ^= h >> 16; h *= 0x85ebca6bu;
+  h ^= h >> 13; h *= 0xc2b2ae35u;
+  return h ^ (h >> 16);
+}
+
+static inline int bloom_maybe(const struct bloom *bf, unsigned hash) {
+  extern const unsigned bloom_salt[BLOOM_K];
+  const unsigned *w;
+  unsigned i, h2;
+  if (!bf->bf_bits)
+    return 1;
+  w = bf->bf_bits + (hash & bf->bf_mask) * BLOOM_K;
+  h2 = bloom_hash32(hash ^ 0x9e3779b9u);
+  for(i = 0; i < BLOOM_K; ++i)
+    if (!(w[i] & (1u << ((h2 * bloom_salt[i]) >> 27))))
+      return 0;
+  return 1;
+}
+
+/* sort an array of n entries of the given size by DN, for dnset and
+ * generic datasets (rbldnsd_util.c).  Every entry starts with a pointer
+ * to DN with length byte first; entries with equal DNs are ordered by
+ * lt() and then kept in their original order, and are made to point to
+ * the same DN string.  Returns 0 (array is untouched) if out of memory. */
+int dnsort(void *base, unsigned n, unsigned size,
+           int (*lt)(const void *a, const void *b));
+
+/* Eytzinger (BFS) layout of a sorted array, for lookups (rbldnsd_util.c).
+ * Element k (1..n) has children 2k and 2k+1, so the top levels of every
+ * search share a few cache lines, and the next levels can be prefetched.
+ * eytzinger() returns a copy of n sorted elements laid out so, with
+ * unused element 0, aligned to EYTZ_LINE bytes, or NULL if out of memory.
+ * eytz_first() and eytz_next() give positions in sorted order, 0 at end.
+ * A search goes down from k = 1 while k <= n, by k = 2k + (e[k] < q) for
+ * eytz_lb(k), the first element not less than q, or by 2k + (e[k] <= q)
+ * for eytz_le(k), the last one not greater than q; both 0 if none. */
+#define EYTZ_LINE 64
+void *eytzinger(const void *a, unsigned n, unsigned size);
+unsigned eytz_first(unsigned n);
+unsigned eytz_next(unsigned k, unsigned n);
+#ifdef __GNUC__
+# define eytz_ffs(k) __builtin_ffs((int)(k))
+/* elements a few levels below k, in one cache line */
+# define eytz_prefetch(e,k) \
+   __builtin_prefetch((e) + (k) * (EYTZ_LINE / sizeof(*(e))))
+#else
+# include <strings.h>
+# define eytz_ffs(k) ffs((int)(k))
+# define eytz_prefetch(e,k)
+#endif
+#define eytz_lb(k) ((k) >> eytz_ffs(~(k)))
+#define eytz_le(k) ((k) >> eytz_ffs(k))
+
+/* changes read from delta files, see rbldnsd_zones.c.
+ * Only the last change for every distinct line is kept. */
+struct dschange {	/* dc */
+  char *dc_line;		/* data line, without leading +/- */
+  int dc_add;			/* 1 to add the line, 0 to remove it */
+  int dc_lineno;		/* line number in the delta file */
+  unsigned dc_hash;		/* hash of dc_line */
+  unsigned dc_hnext;		/* next change in hash chain + 1, or 0 */
+};
+
+struct dsdelta {	/* dd */
+  struct dschange *dd_c;	/* changes, in file order */
+  unsigned dd_n, dd_a;		/* number of changes, allocated */
+  unsigned dd_nadd;		/* number of additions among them */
+  unsigned *dd_htab;		/* hash table: index in dd_c + 1, or 0 */
+  unsigned dd_hmask;		/* size of dd_htab - 1 */
+  struct mempool dd_mp;		/* for dc_line */
+};
+
+/* from rbldnsd_ip4set.c: build ds from the data of ods plus changes */
+int ds_ip4set_delta(struct dataset *ds, const struct dataset *ods,
+                    const struct dsdelta *dd, struct dsctx *dsc);
+
+/* from rbldnsd_ip4set.c and rbldnsd_dnset.c: loading big files in
+ * parts, each parsed into a dataset of its own, see rbldnsd_zones.c */
+struct dsparts {
+  /* set up a new part of ds, after ds read the header of a file */
+  void (*dp_startfn)(struct dataset *part, const struct dataset *ds);
+  /* sort a part after all its lines are read */
+  void (*dp_sortfn)(struct dataset *part);
+  /* merge entries of all parts (which are freed) into ds, sorted */
+  int (*dp_mergefn)(struct dataset *ds, struct dataset **parts, unsigned n);
+};
+extern const struct dsparts ds_ip4set_parts, ds_dnset_parts;
+
+/* from rbldnsd_snap.c: dataset snapshots.  Strings (RRs, DNs) are
+ * stored in a pool and referred to by snap_ref() */
+struct snap;
+extern const char *snapdir;	/* -Z option, NULL if none */
+void snap_put(struct snap *sn, const void *p, unsigned len);
+int snap_get(struct snap *sn, void *p, unsigned len);
+int snap_fits(struct snap *sn, unsigned n, unsigned sz);
+int snap_pooladd(struct snap *sn, const void *p, unsigned len);
+void snap_putpool(struct snap *sn);
+unsigned snap_ref(struct snap *sn, const void *p);
+int snap_getpool(struct snap *sn, struct mempool *mp);
+const void *snap_ptr(struct snap *sn, unsigned ref, unsigned len);
+struct dssnap {
+  /* write type-specific data of ds, return 0 on error */
+  int (*ss_savefn)(const struct dataset *ds, struct snap *sn);
+  /* read it back into an empty ds, ready for its finishfn */
+  int (*ss_loadfn)(struct dataset *ds, struct snap *sn);
+};
+extern const struct dssnap ds_ip4set_snap, ds_dnset_snap;
+int snap_load(struct dataset *ds, struct dsctx *dsc);
+void snap_save(const struct dataset *ds, struct dsctx *dsc);
+
 /* from rbldnsd_combined.c, special routine used inside ds_special() */
 int ds_combined_newset(struct dataset *ds, char *line, struct dsctx *dsc);
 
@@ -359,6 +599,7 @@ extern int accept_in_cidr;
 extern int nouncompress;
 extern struct dataset *g_dsacl;	/* global acl */
 
+extern const char *version;
 extern const char *show_version; /* version.bind CH TXT */
 
 void oom(void);
@@ -421,6 +662,9 @@ int PRINTFLIKE(3, 4) ssprintf(char *buf, int bufsz, const char *fmt, ...);
       ) \
   )
 
+/* size of an RR (A and TXT) */
+#define rrs_size(rr) (5 + strlen((rr) + 4))
+
 /* hooks from a DSO extensions */
 #ifndef NO_DSO
 
@@ -4,6 +4,8 @@
 """
 import errno
 from itertools import count
+import os
+import signal
 import subprocess
 from tempfile import NamedTemporaryFile, TemporaryFile
 import time
@@ -62,8 +64,11 @@ class Rbldnsd(object):
     def __init__(self, datasets=None,
                  daemon_addr='localhost', daemon_port=5300,
                  daemon_bin='./rbldnsd',
+                 options=(),
                  stderr=None):
         self._daemon = None
+        self._output = b''
+        self.options = list(options)
         self.datasets = []
         self.daemon_addr = daemon_addr
         self.daemon_port = daemon_port
@@ -104,13 +109,30 @@ class Rbldnsd(object):
             assert len(resp.answers[0]['data']) == 1
             return resp.answers[0]['data'][0]
 
+    def reload(self):
+        """ Make rbldnsd check its data files and reload changed ones.
+
+        Reloading is asynchronous: the new data is served some time later.
+        """
+        if not self._daemon:
+            raise DaemonError("daemon not running")
+        self._daemon.send_signal(signal.SIGHUP)
+
+    def output(self):
+        """ What rbldnsd has logged to its standard output (so far)
+        """
+        if self._daemon:
+            # the daemon shares the file offset, so don't move it
+            return os.pread(self._stdout.fileno(), 1 << 20, 0)
+        return self._output
+
     def _start_daemon(self):
         if len(self.datasets) == 0:
             raise ValueError("no datasets defined")
 
         cmd = [ self.daemon_bin, '-n',
                 '-b', '%s/%u' % (self.daemon_addr, self.daemon_port),
-                ]
+                ] + self.options
         for zone, ds_type, file in self.datasets:
             if isinstance(file, str):
                 filename = file
@@ -160,6 +182,7 @@ class Rbldnsd(object):
                     raise DaemonError("can not kill stop rbldnsd")
                 time.sleep(0.1)
 
+        self._output = os.pread(self._stdout.fileno(), 1 << 20, 0)
         self._stdout.close()
 
         self._daemon = None
@@ -167,6 +190,21 @@ class Rbldnsd(object):
             raise DaemonError("rbldnsd exited with code %d"
                               % daemon.returncode)
 
+    def has_option(self, option):
+        """ Is the command-line switch option (like '-6') described in
+        the help message?
+        """
+        # options disabled at compile time are not described there
+        cmd = [self.daemon_bin, '-h']
+        proc = subprocess.Popen(cmd, stdout=subprocess.PIPE)
+        help_message = proc.stdout.readlines()
+        if proc.wait() != 0:
+            raise subprocess.CalledProcessError(proc.returncode, cmd)
+
+        return any(line.lstrip().startswith(bytes(option + ' ',
+                                                  encoding='utf-8'))
+                   for line in help_message)
+
     @property
 
     def no_ipv6(self):
@@ -175,14 +213,7 @@ class Rbldnsd(object):
         # If rbldnsd was compiled with -DNO_IPv6, the (therefore
         # unsupported) '-6' command-line switch will not be described
         # in the help message
-        cmd = [self.daemon_bin, '-h']
-        proc = subprocess.Popen(cmd, stdout=subprocess.PIPE)
-        help_message = proc.stdout.readlines()
-        if proc.wait() != 0:
-            raise subprocess.CalledProcessError(proc.returncode, cmd)
-
-        return not any(line.lstrip().startswith(b'-6 ')
-                       for line in help_message)
+        return not self.has_option('-6')
 
 
 class TestRbldnsd(unittest.TestCase):
@@ -170,7 +170,20 @@ ds_acl_line(struct dataset *ds, char *s, struct dsctx *dsc) {
   }
 }
 
+/* compile TXT templates of A+TXT values (not keywords) */
+static void
+rrtxt_cb(const btrie_oct_t UNUSED *prefix, unsigned UNUSED len,
+         const void *data, int post, void *user_data)
+{
+  if (!post && (unsigned long)data > RR_PASS)
+    rrtxt_add((struct dataset *)user_data, (const char *)data);
+}
+
 static void ds_acl_finish(struct dataset *ds, struct dsctx *dsc) {
+  btrie_walk(ds->ds_dsd->ip4_trie, rrtxt_cb, ds);
+#ifndef NO_IPv6
+  btrie_walk(ds->ds_dsd->ip6_trie, rrtxt_cb, ds);
+#endif
   dsloaded(dsc, "loaded");
   dslog(LOG_INFO, dsc, "ip4 trie: %s", btrie_stats(ds->ds_dsd->ip4_trie));
 #ifndef NO_IPv6
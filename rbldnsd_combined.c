@@ -33,6 +33,7 @@ static void ds_combined_reset(struct dsdata *dsd, int freeall) {
     struct dataset *ds = dslist;
     dslist = dslist->ds_next;
     ds->ds_type->dst_resetfn(ds->ds_dsd, freeall);
+    rrtxt_free(ds);
     if (freeall) free(ds);
   }
   dslist = dsd->sdslist;
@@ -43,6 +44,7 @@ static void ds_combined_reset(struct dsdata *dsd, int freeall) {
     free(ds);
   }
   dslist = dsd->dslist;
+  zindex_free(dsd->zlist);
   memset(dsd, 0, sizeof(*dsd));
   if (!freeall) dsd->sdslist = dslist;
   dsd->dslastp = &dsd->dslist;
@@ -76,6 +78,7 @@ static void ds_combined_finish(struct dataset *ds, struct dsctx *dsc) {
   ds_combined_finishlast(dsc);
   for(nzones = 0, zone = dsd->zlist; zone; zone = zone->z_next)
     ++nzones;
+  zindex_build(dsd->zlist);
   dsloaded(dsc, "subzones=%u datasets=%u", nzones, dsd->nds);
 }
 
@@ -88,7 +91,7 @@ int ds_combined_newset(struct dataset *ds, char *line, struct dsctx *dsc) {
   struct zone *zone;
   unsigned char dn[DNS_MAXDN];
   unsigned dnlen;
-  char *name;
+  char *name, *sp;
 
   ds_combined_finishlast(dsc);
 
@@ -98,7 +101,7 @@ int ds_combined_newset(struct dataset *ds, char *line, struct dsctx *dsc) {
       *p = '\0';
       break;
     }
-  p = strtok(line, space);	/* dataset type */
+  p = strtok_r(line, space, &sp);	/* dataset type */
   if (!p) return 0;
   if ((name = strchr(p, ':')) != NULL)
     *name++ = '\0';
@@ -155,7 +158,7 @@ int ds_combined_newset(struct dataset *ds, char *line, struct dsctx *dsc) {
       return -1;
   }
 
-  if (!(p = strtok(NULL, space)))
+  if (!(p = strtok_r(NULL, space, &sp)))
     dswarn(dsc, "no subzone(s) specified for dataset, data will be ignored");
   else do {
     if (p[0] == '@' && p[1] == '\0') {
@@ -172,7 +175,7 @@ int ds_combined_newset(struct dataset *ds, char *line, struct dsctx *dsc) {
     dsl = mp_talloc(ds->ds_mp, struct dslist);
     if (!zone || !dsl) return -1;
     connectdataset(zone, dssub, dsl);
-  } while((p = strtok(NULL, space)) != NULL);
+  } while((p = strtok_r(NULL, space, &sp)) != NULL);
 
   ++dsd->nds;
   dsc->dsc_subset = dssub;
@@ -22,8 +22,12 @@ struct dnarr {
   unsigned h;			/* hint: number of ent to alloc next time */
   struct entry *e;		/* (sorted) array of entries */
   unsigned minlab, maxlab;	/* min and max no. of labels in array */
+  int sorted;			/* sorted already (merged from parts) */
+  struct bloom bf;		/* all DNs in array */
 };
 
+#define bfkey(dn,len0) bloom_hash(dn, len0, 0)
+
 /* There are two similar arrays -
  * for plain entries and for wildcard entries.
  */
@@ -40,6 +44,8 @@ static void ds_dnset_reset(struct dsdata *dsd, int UNUSED unused_freeall) {
   unsigned hp = dsd->p.h, hw = dsd->w.h;
   if (dsd->p.e) free(dsd->p.e);
   if (dsd->w.e) free(dsd->w.e);
+  bloom_free(&dsd->p.bf);
+  bloom_free(&dsd->w.bf);
   memset(dsd, 0, sizeof(*dsd));
   dsd->p.minlab = dsd->w.minlab = DNS_MAXDN;
   dsd->p.h = hp; dsd->w.h = hw;
@@ -152,7 +158,26 @@ static int ds_dnset_lt(const struct entry *a, const struct entry *b) {
      a->rr < b->rr;
 }
 
+static int ds_dnset_rrlt(const void *a, const void *b) {
+  return ((const struct entry *)a)->rr < ((const struct entry *)b)->rr;
+}
+
+/* returns 1 if all the same DNs point to one string after sorting */
+static int ds_dnset_sort(struct dnarr *arr) {
+  if (dnsort(arr->e, arr->n, sizeof(struct entry), ds_dnset_rrlt))
+    return 1;
+  {
+# define QSORT_TYPE struct entry
+# define QSORT_BASE arr->e
+# define QSORT_NELT arr->n
+# define QSORT_LT(a,b) ds_dnset_lt(a,b)
+# include "qsort.c"
+  }
+  return 0;
+}
+
 static void ds_dnset_finish_arr(struct dnarr *arr) {
+  unsigned i;
   if (!arr->n) {
     arr->h = 0;
     return;
@@ -161,14 +186,10 @@ static void ds_dnset_finish_arr(struct dnarr *arr) {
   while((arr->h >> 1) >= arr->n)
     arr->h >>= 1;
 
-# define QSORT_TYPE struct entry
-# define QSORT_BASE arr->e
-# define QSORT_NELT arr->n
-# define QSORT_LT(a,b) ds_dnset_lt(a,b)
-# include "qsort.c"
-
-  /* we make all the same DNs point to one string for faster searches */
-  { register struct entry *e, *t;
+  /* we make all the same DNs point to one string for faster searches;
+   * dnsort() does it while sorting, but merged arrays need a pass */
+  if (arr->sorted || !ds_dnset_sort(arr)) {
+    register struct entry *e, *t;
     for(e = arr->e, t = e + arr->n - 1; e < t; ++e)
       if (memcmp(e[0].ldn, e[1].ldn, e[0].ldn[0] + 1) == 0)
         e[1].ldn = e[0].ldn;
@@ -176,15 +197,209 @@ static void ds_dnset_finish_arr(struct dnarr *arr) {
 #define dnset_eeq(a,b) a.ldn == b.ldn && rrs_equal(a,b)
   REMOVE_DUPS(struct entry, arr->e, arr->n, dnset_eeq);
   SHRINK_ARRAY(struct entry, arr->e, arr->n, arr->a);
+
+  if (bloom_init(&arr->bf, arr->n))
+    for(i = 0; i < arr->n; ++i)
+      bloom_add(&arr->bf, bfkey(arr->e[i].ldn + 1, arr->e[i].ldn[0]));
 }
 
 static void ds_dnset_finish(struct dataset *ds, struct dsctx *dsc) {
   struct dsdata *dsd = ds->ds_dsd;
+  char pbf[40];
+  const struct entry *e, *t;
   ds_dnset_finish_arr(&dsd->p);
   ds_dnset_finish_arr(&dsd->w);
-  dsloaded(dsc, "e/w=%u/%u", dsd->p.n, dsd->w.n);
+  for(e = dsd->p.e, t = e + dsd->p.n; e < t; ++e)
+    rrtxt_add(ds, e->rr);
+  for(e = dsd->w.e, t = e + dsd->w.n; e < t; ++e)
+    rrtxt_add(ds, e->rr);
+  strncpy(pbf, bloom_stats(&dsd->p.bf), sizeof(pbf) - 1);
+  pbf[sizeof(pbf) - 1] = '\0';
+  dsloaded(dsc, "e/w=%u/%u %s / %s",
+           dsd->p.n, dsd->w.n, pbf, bloom_stats(&dsd->w.bf));
+}
+
+/* Loading in parts (see rbldnsd_zones.c): every part of a big file is
+ * parsed into a dataset of its own and sorted there, and the sorted
+ * arrays of all parts are merged into ds at the end. */
+
+static void ds_dnset_partstart(struct dataset *part,
+                               const struct dataset *ds) {
+  part->ds_dsd->def_rr = ds->ds_dsd->def_rr;
+}
+
+static void ds_dnset_partsort(struct dataset *part) {
+  if (part->ds_dsd->p.n)
+    ds_dnset_sort(&part->ds_dsd->p);
+  if (part->ds_dsd->w.n)
+    ds_dnset_sort(&part->ds_dsd->w);
+}
+
+static int
+ds_dnset_mergearr(struct dnarr *arr, struct dnarr **parts, unsigned np,
+                  const struct entry **p, unsigned *heap) {
+  const struct entry **t = p + np + 1;
+  struct entry *e, *o;
+  unsigned i, n = arr->n;
+
+  for(i = 0; i < np; ++i)
+    n += parts[i]->n;
+  if (!n)
+    return 1;
+  if (!(e = trealloc(struct entry, NULL, n)))
+    return 0;
+  p[0] = arr->e; t[0] = p[0] + arr->n;
+  for(i = 0; i < np; ++i) {
+    p[i+1] = parts[i]->e; t[i+1] = p[i+1] + parts[i]->n;
+  }
+  o = e;
+# define KMERGE_NRUNS (np + 1)
+# define KMERGE_P p
+# define KMERGE_T t
+# define KMERGE_HEAP heap
+# define KMERGE_OUT o
+# define KMERGE_LT(a,b) ds_dnset_lt(a,b)
+# include "kmerge.c"
+  free(arr->e);
+  arr->e = e;
+  arr->n = arr->a = n;
+  for(i = 0; i < np; ++i) {	/* free parts as we go */
+    if (arr->minlab > parts[i]->minlab) arr->minlab = parts[i]->minlab;
+    if (arr->maxlab < parts[i]->maxlab) arr->maxlab = parts[i]->maxlab;
+    free(parts[i]->e);
+    parts[i]->e = NULL;
+    parts[i]->n = parts[i]->a = 0;
+  }
+  arr->sorted = 1;
+  return 1;
+}
+
+static int
+ds_dnset_partmerge(struct dataset *ds, struct dataset **parts, unsigned np) {
+  struct dsdata *dsd = ds->ds_dsd;
+  struct dnarr **arrs;
+  const struct entry **p;
+  unsigned *heap;
+  unsigned i;
+  int ok;
+
+  arrs = (struct dnarr **)malloc(np * sizeof(*arrs));
+  p = (const struct entry **)malloc((np + 1) * 2 * sizeof(*p));
+  heap = (unsigned *)malloc((np + 1) * sizeof(*heap));
+  ok = arrs && p && heap;
+  if (ok) {
+    ds_dnset_partsort(ds);	/* entries added to ds itself */
+    for(i = 0; i < np; ++i)
+      arrs[i] = &parts[i]->ds_dsd->p;
+    ok = ds_dnset_mergearr(&dsd->p, arrs, np, p, heap);
+  }
+  if (ok) {
+    for(i = 0; i < np; ++i)
+      arrs[i] = &parts[i]->ds_dsd->w;
+    ok = ds_dnset_mergearr(&dsd->w, arrs, np, p, heap);
+  }
+  free(arrs);
+  free(p);
+  free(heap);
+  return ok;
+}
+
+const struct dsparts ds_dnset_parts = {
+  ds_dnset_partstart, ds_dnset_partsort, ds_dnset_partmerge
+};
+
+/* Snapshots (see rbldnsd_snap.c): both sorted arrays, with DNs and RRs
+ * in the snapshot pool.  Loaded arrays need no sorting. */
+
+struct snapent {
+  unsigned ldn, rr;	/* references to the DN and the RR in the pool */
+};
+
+static int ds_dnset_snapadd(const struct dnarr *arr, struct snap *sn) {
+  const struct entry *e, *t;
+  for(e = arr->e, t = e + arr->n; e < t; ++e) {
+    if (e == arr->e || e->ldn != e[-1].ldn)
+      snap_pooladd(sn, e->ldn, e->ldn[0] + 2);
+    if (e->rr && (e == arr->e || e->rr != e[-1].rr))
+      snap_pooladd(sn, e->rr, rrs_size(e->rr));
+  }
+  return snap_pooladd(sn, NULL, 0);
+}
+
+static void ds_dnset_snapput(const struct dnarr *arr, struct snap *sn) {
+  const struct entry *e, *t;
+  struct snapent se;
+  snap_put(sn, &arr->n, sizeof(arr->n));
+  snap_put(sn, &arr->minlab, sizeof(arr->minlab));
+  snap_put(sn, &arr->maxlab, sizeof(arr->maxlab));
+  for(e = arr->e, t = e + arr->n; e < t; ++e) {
+    se.ldn = snap_ref(sn, e->ldn);
+    se.rr = snap_ref(sn, e->rr);
+    snap_put(sn, &se, sizeof(se));
+  }
+}
+
+static int ds_dnset_snapsave(const struct dataset *ds, struct snap *sn) {
+  const struct dsdata *dsd = ds->ds_dsd;
+  unsigned ref;
+  if (dsd->def_rr)
+    snap_pooladd(sn, dsd->def_rr, rrs_size(dsd->def_rr));
+  if (!ds_dnset_snapadd(&dsd->p, sn) || !ds_dnset_snapadd(&dsd->w, sn))
+    return 0;
+  snap_putpool(sn);
+  ref = snap_ref(sn, dsd->def_rr);
+  snap_put(sn, &ref, sizeof(ref));
+  ds_dnset_snapput(&dsd->p, sn);
+  ds_dnset_snapput(&dsd->w, sn);
+  return 1;
 }
 
+static int ds_dnset_snapget(struct dnarr *arr, struct snap *sn) {
+  struct snapent se[256];
+  struct entry *e;
+  const unsigned char *ldn;
+  unsigned n, i, j, k;
+
+  if (!snap_get(sn, &n, sizeof(n)) || !snap_fits(sn, n, sizeof(*se)) ||
+      !snap_get(sn, &arr->minlab, sizeof(arr->minlab)) ||
+      !snap_get(sn, &arr->maxlab, sizeof(arr->maxlab)))
+    return 0;
+  if (!n)
+    return 1;
+  if (!(e = trealloc(struct entry, NULL, n)))
+    return 0;
+  arr->e = e;
+  arr->n = arr->a = n;
+  for(i = 0; i < n; i += k) {
+    k = n - i < 256 ? n - i : 256;
+    if (!snap_get(sn, se, k * sizeof(*se)))
+      return 0;
+    for(j = 0; j < k; ++j, ++e) {
+      ldn = snap_ptr(sn, se[j].ldn, 2);
+      if (!ldn || !snap_ptr(sn, se[j].ldn, ldn[0] + 2) ||
+          dns_dnlen(ldn + 1) != ldn[0] + 1u)
+        return 0;
+      e->ldn = ldn;
+      e->rr = snap_ptr(sn, se[j].rr, 5);
+    }
+  }
+  arr->sorted = 1;
+  return 1;
+}
+
+static int ds_dnset_snapload(struct dataset *ds, struct snap *sn) {
+  struct dsdata *dsd = ds->ds_dsd;
+  unsigned ref;
+  if (!snap_getpool(sn, ds->ds_mp) || !snap_get(sn, &ref, sizeof(ref)))
+    return 0;
+  dsd->def_rr = snap_ptr(sn, ref, 5);
+  return ds_dnset_snapget(&dsd->p, sn) && ds_dnset_snapget(&dsd->w, sn);
+}
+
+const struct dssnap ds_dnset_snap = {
+  ds_dnset_snapsave, ds_dnset_snapload
+};
+
 static const struct entry *
 ds_dnset_find(const struct entry *e, int n,
               const unsigned char *dn, unsigned dnlen0) {
@@ -231,6 +446,7 @@ ds_dnset_query(const struct dataset *ds, const struct dnsqinfo *qi,
 
   if (qlab > dsd->p.maxlab 	/* if we have less labels, search unnec. */
       || qlab < dsd->p.minlab	/* ditto for more */
+      || !bloom_maybe(&dsd->p.bf, bfkey(dn, qlen0))
       || !(e = ds_dnset_find(dsd->p.e, dsd->p.n, dn, qlen0))) {
 
     /* try wildcard */
@@ -250,7 +466,8 @@ ds_dnset_query(const struct dataset *ds, const struct dnsqinfo *qi,
          * minimum we have listed.  Nothing to search anymore */
         return 0;
 
-      if ((e = ds_dnset_find(dsd->w.e, dsd->w.n, dn, qlen0)))
+      if (bloom_maybe(&dsd->w.bf, bfkey(dn, qlen0)) &&
+          (e = ds_dnset_find(dsd->w.e, dsd->w.n, dn, qlen0)))
         break;			/* found, listed */
 
       /* remove next label at the end of rdn */
@@ -267,11 +484,14 @@ ds_dnset_query(const struct dataset *ds, const struct dnsqinfo *qi,
 
   if (!e->rr) return 0;	/* exclusion */
 
+  /* the name is only needed for templates with substitutions */
   dn = e->ldn;
-  if (qi->qi_tflag & NSQUERY_TXT)
-    dns_dntop(e->ldn + 1, name, sizeof(name));
-  do addrr_a_txt(pkt, qi->qi_tflag, e->rr, name, ds);
-  while(++e < t && e->ldn == dn);
+  name[0] = '\0';
+  do {
+    if (!name[0] && (qi->qi_tflag & NSQUERY_TXT) && rrtxt_subst(ds, e->rr))
+      dns_dntop(e->ldn + 1, name, sizeof(name));
+    addrr_a_txt(pkt, qi->qi_tflag, e->rr, name, ds);
+  } while(++e < t && e->ldn == dn);
 
   return NSQUERY_FOUND;
 }
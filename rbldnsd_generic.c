@@ -165,18 +165,22 @@ static int ds_generic_lt(const struct entry *a, const struct entry *b) {
   else return a->dtyp < b->dtyp;
 }
 
+static int ds_generic_typlt(const void *a, const void *b) {
+  return ((const struct entry *)a)->dtyp < ((const struct entry *)b)->dtyp;
+}
+
 static void ds_generic_finish(struct dataset *ds, struct dsctx *dsc) {
   struct dsdata *dsd = ds->ds_dsd;
   if (dsd->n) {
 
+    /* dnsort() also collects all equal DNs to point to the same place */
+    if (!dnsort(dsd->e, dsd->n, sizeof(struct entry), ds_generic_typlt)) {
+      struct entry *e, *t;
 #   define QSORT_TYPE struct entry
 #   define QSORT_BASE dsd->e
 #   define QSORT_NELT dsd->n
 #   define QSORT_LT(a,b) ds_generic_lt(a,b)
 #   include "qsort.c"
-
-    /* collect all equal DNs to point to the same place */
-    { struct entry *e, *t;
       for(e = dsd->e, t = e + dsd->n - 1; e < t; ++e)
         if (memcmp(e[0].ldn, e[1].ldn, e[0].ldn[0] + 1) == 0)
           e[1].ldn = e[0].ldn;
@@ -223,10 +227,10 @@ ds_generic_add_rrs(struct dnspacket *pkt, const struct entry *e, const struct en
   /* this routine should randomize order of the RRs when placing them
    * into the resulting packet.  Currently, we use plain "dumb" round-robin,
    * that is, given N RRs, we chose some M in between, based on a single
-   * sequence nn, and will return M..N-1 records first, and 0..M-1 records
-   * second.  Dumb, dumb, I know, but this is very simple to implement!.. ;) */
-  static unsigned nn;
-  const struct entry *m = (l - e > 1) ? e + nn++ % (l - e) : e;
+   * per-thread sequence pkt->p_crr, and will return M..N-1 records first,
+   * and 0..M-1 records second.  Dumb, dumb, I know, but this is very
+   * simple to implement!.. ;) */
+  const struct entry *m = (l - e > 1) ? e + pkt->p_crr++ % (l - e) : e;
   const struct entry *t;
   for(t = m; t < l; ++t) ds_generic_add_rr(pkt, t);
   for(t = e; t < m; ++t) ds_generic_add_rr(pkt, t);
@@ -7,8 +7,18 @@
 #include <stdlib.h>
 #include "rbldnsd.h"
 
+/* Every entry is an interval of /32s, /24s, /16s or /8s with the same
+ * value, in one of 4 arrays by prefix length, so a range from a data
+ * line becomes at most 2 entries per array instead of one for every /32
+ * to /8 in it.  After loading, intervals of an array are normalized
+ * (ds_ip4set_norm()): overlapping ones are split, every piece getting
+ * all values of the intervals which cover it (a "group" of entries with
+ * the same addr and last), and adjacent pieces with the same values are
+ * joined.  Like the pieces of a range, intervals of /32s never cross a
+ * /24 boundary, of /24s a /16 one and of /16s a /8 one. */
 struct entry {
-  ip4addr_t addr;	/* key: IP address */
+  ip4addr_t addr;	/* key: first IP address of the interval */
+  ip4addr_t last;	/* last /32, /24, /16 or /8 in it */
   const char *rr;	/* A and TXT RRs */
 };
 
@@ -18,8 +28,41 @@ struct dsdata {
   unsigned h[4];	/* hint, how much to allocate next time */
   struct entry *e[4];	/* entries */
   const char *def_rr;	/* default A and TXT RRs */
+  int sorted;		/* 1 if arrays are sorted already (merged from parts),
+			 * 2 if normalized too (from a snapshot) */
+  struct bloom bf;	/* all addresses of all 4 arrays */
+  unsigned bfrng;	/* bit for every array with long intervals */
+  struct ip4idx *idx;	/* index by /16, for big datasets, or NULL */
+  struct eykey *ey[4];	/* else Eytzinger layout of groups, or NULL */
+  unsigned ney[4];	/* number of groups there */
 };
 
+/* lookup key of a group of entries with the same interval */
+struct eykey {
+  ip4addr_t addr;	/* its first address */
+  unsigned i;		/* index of its first entry */
+};
+
+/* Index of big datasets, one slot for every /16 (65536 of them plus an
+ * end marker): where its entries start in the /32 and /24 arrays (they
+ * end where the next slot's ones start), and the first entry of the
+ * /16 and /8 arrays which covers it, if any.  Instead of up to 4 binary
+ * searches over whole arrays, a query looks at one slot and searches
+ * only a small slice of the /32 or /24 array. */
+struct ip4idx {
+  unsigned i32, i24;	/* first /32 and /24 entry of this /16 */
+  unsigned i16, i08;	/* first /16 and /8 entry covering it, or NOIDX */
+};
+#define NOIDX 0xffffffffu
+/* build the index if the /32 and /24 arrays have that many entries,
+ * when its 1Mb are about 16 bytes per entry or less */
+#define IP4IDX_MIN 65536
+
+/* bloom filter key: the same address in different arrays differs.
+ * Long intervals are there by their block instead, with idx + 4 */
+#define bfkey(idx,a) bloom_hash32((a) ^ (idx))
+#define BFUNITS 8	/* intervals longer than that are there by block */
+
 /* indexes */
 #define E32 0
 #define E24 1
@@ -34,6 +77,10 @@ struct dsdata {
 #define H16 0x0000ffffu
 #define M08 0xff000000u
 #define H08 0x00ffffffu
+/* intervals of every array are within one such block */
+static const ip4addr_t blkmask[4] = { M24, M16, M08, 0 };
+/* an array holds /32s, /24s, /16s or /8s: shift to get them */
+#define ushift(idx) ((idx) << 3)
 
 definedstype(ip4set, DSTF_IP4REV, "set of (ip4 range, value) pairs");
 
@@ -45,7 +92,17 @@ static void ds_ip4set_reset(struct dsdata *dsd, int UNUSED unused_freeall) {
     dsd->e[r] = NULL;
     dsd->n[r] = dsd->a[r] = 0;
   }
+  for (r = 0; r < 4; ++r) {
+    free(dsd->ey[r]);
+    dsd->ey[r] = NULL;
+    dsd->ney[r] = 0;
+  }
+  bloom_free(&dsd->bf);
+  dsd->bfrng = 0;
+  free(dsd->idx);
+  dsd->idx = NULL;
   dsd->def_rr = NULL;
+  dsd->sorted = 0;
 }
 
 static int
@@ -53,12 +110,13 @@ ds_ip4set_addent(struct dsdata *dsd, unsigned idx,
                  ip4addr_t a, unsigned count,
                  const char *rr) {
   struct entry *e = dsd->e[idx];
-  ip4addr_t step = 1 << (idx << 3);
 
-  if (dsd->n[idx] + count > dsd->a[idx]) {
+  if (!count)		/* ip4range_expand_octet() may give that */
+    return 1;
+  if (dsd->n[idx] >= dsd->a[idx]) {
     if (!dsd->a[idx])
       dsd->a[idx] = dsd->h[idx] ? dsd->h[idx] : 64;
-    while(dsd->n[idx] + count > dsd->a[idx])
+    else
       dsd->a[idx] <<= 1;
     e = trealloc(struct entry, e, dsd->a[idx]);
     if (!e)
@@ -66,12 +124,10 @@ ds_ip4set_addent(struct dsdata *dsd, unsigned idx,
     dsd->e[idx] = e;
   }
 
-  e += dsd->n[idx];
-  dsd->n[idx] += count;
-  for(; count--; a += step, ++e) {
-    e->addr = a;
-    e->rr = rr;
-  }
+  e += dsd->n[idx]++;
+  e->addr = a;
+  e->last = a + ((count - 1) << ushift(idx));
+  e->rr = rr;
 
   return 1;
 }
@@ -168,8 +224,283 @@ ds_ip4set_line(struct dataset *ds, char *s, struct dsctx *dsc) {
 
 }
 
-static void ds_ip4set_finish(struct dataset *ds, struct dsctx *dsc) {
+#define ip4set_eeq(a,b) a.addr == b.addr && rrs_equal(a,b)
+#define ip4set_lt(a,b) \
+   ((a)->addr < (b)->addr ? 1 : \
+    (a)->addr > (b)->addr ? 0 : \
+    (a)->rr < (b)->rr)
+
+/* radix sort by address, then entries of the same address by rr */
+static void ds_ip4set_sort(struct dsdata *dsd, unsigned r) {
+#   define QSORT_TYPE struct entry
+#   define QSORT_BASE dsd->e[r]
+#   define QSORT_NELT dsd->n[r]
+#   define QSORT_LT(a,b) ip4set_lt(a,b)
+#   define RSORT_NBYTES 4
+#   define RSORT_BYTE(p,i) (((p)->addr >> ((i) << 3)) & 255u)
+#   define RSORT_KEYEQ(a,b) ((a)->addr == (b)->addr)
+#   include "rsort.c"
+#   undef RSORT_KEYEQ
+#   undef RSORT_BYTE
+#   undef RSORT_NBYTES
+#   undef QSORT_LT
+#   undef QSORT_NELT
+#   undef QSORT_BASE
+#   undef QSORT_TYPE
+}
+
+/* the same values: the same pointer, or A and TXT are equal */
+static int ds_ip4set_rreq(const char *a, const char *b) {
+  return a == b ||
+    (a && b && memcmp(a, b, 4) == 0 && strcmp(a + 4, b + 4) == 0);
+}
+
+struct ents {		/* growing array of entries */
+  struct entry *e;
+  unsigned n, a;
+};
+
+static int
+ds_ip4set_put(struct ents *x, ip4addr_t a, ip4addr_t last, const char *rr) {
+  if (x->n >= x->a) {
+    unsigned n = x->a + (x->a >> 2) + 16;
+    struct entry *e = trealloc(struct entry, x->e, n);
+    if (!e)
+      return 0;
+    x->e = e;
+    x->a = n;
+  }
+  x->e[x->n].addr = a;
+  x->e[x->n].last = last;
+  x->e[x->n].rr = rr;
+  ++x->n;
+  return 1;
+}
+
+/* Normalize intervals e..e+n of array r (sorted by addr) into o, as
+ * described at the top, leaving out the units of entries which have the
+ * same value as a covering entry of d..d+nd (sorted too).  This goes
+ * over all pieces between starts and ends of the intervals, keeping the
+ * ones which cover the current piece (usually just one) aside, so it is
+ * linear unless many intervals overlap.  Returns 0 if out of memory. */
+static int
+ds_ip4set_norm(struct ents *o, unsigned r,
+               const struct entry *e, unsigned n,
+               const struct entry *d, unsigned nd) {
+  const unsigned sh = ushift(r);
+  struct ents act, del;		/* intervals covering the current piece */
+  unsigned i = 0, j = 0, k, x, y, g, pg = 0, pk = 0;
+  ip4addr_t pos = 0, end, plast = 0;
+
+  memset(o, 0, sizeof(*o));
+  memset(&act, 0, sizeof(act));
+  memset(&del, 0, sizeof(del));
+  if (n && !(o->e = trealloc(struct entry, NULL, n)))
+    return 0;
+  o->a = n;
+
+  while(i < n || act.n) {
+    if (!act.n)
+      pos = e[i].addr >> sh;
+    for(; i < n && (e[i].addr >> sh) == pos; ++i)
+      if (!ds_ip4set_put(&act, e[i].addr, e[i].last, e[i].rr))
+        goto nomem;
+    for(k = 0; k < del.n; )	/* deletes which ended in a gap */
+      if ((del.e[k].last >> sh) < pos)
+        del.e[k] = del.e[--del.n];
+      else
+        ++k;
+    for(; j < nd && (d[j].addr >> sh) <= pos; ++j)
+      if ((d[j].last >> sh) >= pos &&
+          !ds_ip4set_put(&del, d[j].addr, d[j].last, d[j].rr))
+        goto nomem;
+
+    /* the piece ends where something starts or ends */
+    end = i < n ? (e[i].addr >> sh) - 1 : 0xffffffffu >> sh;
+    if (j < nd && (d[j].addr >> sh) - 1 < end)
+      end = (d[j].addr >> sh) - 1;
+    for(k = 0; k < act.n; ++k)
+      if ((act.e[k].last >> sh) < end)
+        end = act.e[k].last >> sh;
+    for(k = 0; k < del.n; ++k)
+      if ((del.e[k].last >> sh) < end)
+        end = del.e[k].last >> sh;
+
+    /* the group of this piece: values not deleted, sorted by pointer,
+     * without duplicates (and only the exclusion if there is one) */
+    g = o->n;
+    for(k = 0; k < act.n; ++k) {
+      for(x = 0; x < del.n && !ds_ip4set_rreq(del.e[x].rr, act.e[k].rr); ++x)
+        ;
+      if (x == del.n &&
+          !ds_ip4set_put(o, pos << sh, end << sh, act.e[k].rr))
+        goto nomem;
+    }
+    if ((k = o->n - g) > 1) {
+      struct entry *ge = o->e + g, t;
+      for(x = 1; x < k; ++x) {
+        t = ge[x];
+        for(y = x; y && t.rr < ge[y-1].rr; --y)
+          ge[y] = ge[y-1];
+        ge[y] = t;
+      }
+      REMOVE_DUPS(struct entry, ge, k, ip4set_eeq);
+      o->n = g + k;
+    }
+
+    /* join with the previous group if it has the same values */
+    if (k && k == pk && pos == plast + 1 &&
+        (r == E08 || (pos >> 8) == (plast >> 8))) {
+      for(x = 0; x < k && o->e[pg + x].rr == o->e[g + x].rr; ++x)
+        ;
+      if (x == k) {
+        for(x = 0; x < k; ++x)
+          o->e[pg + x].last = end << sh;
+        o->n = g;
+        g = pg;
+      }
+    }
+    if (k) {
+      pg = g;
+      pk = k;
+      plast = end;
+    }
+    else
+      pk = 0;
+
+    for(k = 0; k < act.n; )
+      if ((act.e[k].last >> sh) == end)
+        act.e[k] = act.e[--act.n];
+      else
+        ++k;
+    for(k = 0; k < del.n; )
+      if ((del.e[k].last >> sh) == end)
+        del.e[k] = del.e[--del.n];
+      else
+        ++k;
+    pos = end + 1;
+  }
+  free(act.e);
+  free(del.e);
+  return 1;
+
+nomem:
+  free(act.e);
+  free(del.e);
+  free(o->e);
+  memset(o, 0, sizeof(*o));
+  return 0;
+}
+
+/* build /16 index of sorted entries, if they're many */
+static void ds_ip4set_mkidx(struct dsdata *dsd) {
+  struct ip4idx *x;
+  const struct entry *e;
+  unsigned s, i, n, l;
+
+  free(dsd->idx);
+  dsd->idx = NULL;
+  if (dsd->n[E32] + dsd->n[E24] < IP4IDX_MIN)
+    return;
+  if (!(x = trealloc(struct ip4idx, NULL, 65537)))
+    return;		/* lookups will do without it */
+
+  e = dsd->e[E32]; n = dsd->n[E32];
+  for(i = s = 0; s <= 65536; ++s) {
+    while(i < n && (e[i].addr >> 16) < s)
+      ++i;
+    x[s].i32 = i;
+  }
+  e = dsd->e[E24]; n = dsd->n[E24];
+  for(i = s = 0; s <= 65536; ++s) {
+    while(i < n && (e[i].addr >> 16) < s)
+      ++i;
+    x[s].i24 = i;
+    x[s].i16 = x[s].i08 = NOIDX;
+  }
+  e = dsd->e[E16]; n = dsd->n[E16];
+  for(i = 0; i < n; ++i)
+    if (!i || e[i].addr != e[i-1].addr)
+      for(s = e[i].addr >> 16, l = e[i].last >> 16; s <= l; ++s)
+        x[s].i16 = i;
+  e = dsd->e[E08]; n = dsd->n[E08];
+  for(i = 0; i < n; ++i)
+    if (!i || e[i].addr != e[i-1].addr)
+      for(s = e[i].addr >> 16, l = (e[i].last >> 16) | 255; s <= l; ++s)
+        x[s].i08 = i;
+  dsd->idx = x;
+}
+
+/* Eytzinger layout of groups of sorted entries, for datasets without
+ * index: a lookup searches 8-byte keys going down the tree, without
+ * branches, instead of doing binary search over 16-byte entries */
+static void ds_ip4set_mkey(struct dsdata *dsd) {
+  struct eykey *k;
+  const struct entry *e;
+  unsigned r, i, n;
+
+  for(r = 0; r < 4; ++r) {
+    free(dsd->ey[r]);
+    dsd->ey[r] = NULL;
+    dsd->ney[r] = 0;
+    if (dsd->idx || !dsd->n[r])
+      continue;
+    if (!(k = trealloc(struct eykey, NULL, dsd->n[r])))
+      continue;		/* lookups will do without it */
+    for(i = n = 0, e = dsd->e[r]; i < dsd->n[r]; ++i)
+      if (!i || e[i].addr != e[i-1].addr) {
+        k[n].addr = e[i].addr;
+        k[n++].i = i;
+      }
+    if ((dsd->ey[r] = (struct eykey *)eytzinger(k, n, sizeof(*k))) != NULL)
+      dsd->ney[r] = n;
+    free(k);
+  }
+}
+
+/* number of /32s, /24s etc in the interval of e in array r */
+#define nunits(e,r) ((((e)->last - (e)->addr) >> ushift(r)) + 1)
+
+/* build bloom filter, index and TXT RRs for sorted entries, and report */
+static void ds_ip4set_index(struct dataset *ds, struct dsctx *dsc,
+                            const char *what) {
   struct dsdata *dsd = ds->ds_dsd;
+  const struct entry *e;
+  unsigned r, i, u, nk = 0;
+  ip4addr_t a;
+
+  dsd->bfrng = 0;
+  for(r = 0; r < 4; ++r)
+    for(i = 0, e = dsd->e[r]; i < dsd->n[r]; ++i, ++e)
+      if (!i || e->addr != e[-1].addr)
+        nk += (u = nunits(e, r)) <= BFUNITS || r == E08 ? u : 1;
+  if (bloom_init(&dsd->bf, nk))
+    for(r = 0; r < 4; ++r)
+      for(i = 0, e = dsd->e[r]; i < dsd->n[r]; ++i, ++e) {
+        if (i && e->addr == e[-1].addr)
+          continue;
+        if ((u = nunits(e, r)) <= BFUNITS || r == E08)
+          for(a = e->addr; u--; a += 1u << ushift(r))
+            bloom_add(&dsd->bf, bfkey(r, a));
+        else {
+          bloom_add(&dsd->bf, bfkey(r + 4, e->addr & blkmask[r]));
+          dsd->bfrng |= 1u << r;
+        }
+      }
+  ds_ip4set_mkidx(dsd);
+  ds_ip4set_mkey(dsd);
+  for(r = 0; r < 4; ++r)
+    for(i = 0; i < dsd->n[r]; ++i)
+      if (!i || dsd->e[r][i].rr != dsd->e[r][i-1].rr)
+        rrtxt_add(ds, dsd->e[r][i].rr);
+  dsloaded(dsc, "e32/24/16/8=%u/%u/%u/%u%s %s%s",
+           dsd->n[E32], dsd->n[E24], dsd->n[E16], dsd->n[E08],
+           what, bloom_stats(&dsd->bf), dsd->idx ? " idx=/16" : "");
+}
+
+/* sort and normalize all arrays, returns 0 if out of memory */
+static int ds_ip4set_sortall(struct dsdata *dsd) {
+  struct ents x;
   unsigned r;
   for(r = 0; r < 4; ++r) {
     if (!dsd->n[r]) {
@@ -180,38 +511,300 @@ static void ds_ip4set_finish(struct dataset *ds, struct dsctx *dsc) {
     while((dsd->h[r] >> 1) >= dsd->n[r])
       dsd->h[r] >>= 1;
 
-#   define QSORT_TYPE struct entry
-#   define QSORT_BASE dsd->e[r]
-#   define QSORT_NELT dsd->n[r]
-#   define QSORT_LT(a,b) \
-       a->addr < b->addr ? 1 : \
-       a->addr > b->addr ? 0 : \
-       a->rr < b->rr
-#   include "qsort.c"
+    if (dsd->sorted > 1)
+      continue;
+    if (!dsd->sorted)
+      ds_ip4set_sort(dsd, r);
+    if (!ds_ip4set_norm(&x, r, dsd->e[r], dsd->n[r], NULL, 0))
+      return 0;
+    free(dsd->e[r]);
+    dsd->e[r] = x.e;
+    dsd->n[r] = x.n;
+    dsd->a[r] = x.a;
+    SHRINK_ARRAY(struct entry, dsd->e[r], dsd->n[r], dsd->a[r]);
+  }
+  return 1;
+}
 
-#define ip4set_eeq(a,b) a.addr == b.addr && rrs_equal(a,b)
-    REMOVE_DUPS(struct entry, dsd->e[r], dsd->n[r], ip4set_eeq);
+static void ds_ip4set_finish(struct dataset *ds, struct dsctx *dsc) {
+  if (!ds_ip4set_sortall(ds->ds_dsd))
+    dsc->dsc_nomem = 1;
+  else
+    ds_ip4set_index(ds, dsc, "");
+}
+
+/* Loading in parts (see rbldnsd_zones.c): every part of a big file is
+ * parsed into a dataset of its own and sorted there, and the sorted
+ * arrays of all parts are merged into ds at the end. */
+
+static void ds_ip4set_partstart(struct dataset *part,
+                                const struct dataset *ds) {
+  part->ds_dsd->def_rr = ds->ds_dsd->def_rr;
+}
+
+static void ds_ip4set_partsort(struct dataset *part) {
+  unsigned r;
+  for(r = 0; r < 4; ++r)
+    if (part->ds_dsd->n[r])
+      ds_ip4set_sort(part->ds_dsd, r);
+}
+
+static int
+ds_ip4set_partmerge(struct dataset *ds, struct dataset **parts, unsigned np)
+{
+  struct dsdata *dsd = ds->ds_dsd, *pd;
+  const struct entry **p, **t;
+  struct entry *e, *o;
+  unsigned *heap;
+  unsigned r, i, n;
+
+  p = (const struct entry **)malloc((np + 1) * 2 * sizeof(*p));
+  heap = (unsigned *)malloc((np + 1) * sizeof(*heap));
+  if (!p || !heap) {
+    free(p);
+    free(heap);
+    return 0;
+  }
+  t = p + np + 1;
+
+  ds_ip4set_partsort(ds);	/* entries added to ds itself */
+  for(r = 0; r < 4; ++r) {
+    n = dsd->n[r];
+    for(i = 0; i < np; ++i)
+      n += parts[i]->ds_dsd->n[r];
+    if (!n)
+      continue;
+    if (!(e = trealloc(struct entry, NULL, n)))
+      break;
+    p[0] = dsd->e[r]; t[0] = p[0] + dsd->n[r];
+    for(i = 0; i < np; ++i) {
+      pd = parts[i]->ds_dsd;
+      p[i+1] = pd->e[r]; t[i+1] = p[i+1] + pd->n[r];
+    }
+    o = e;
+#   define KMERGE_NRUNS (np + 1)
+#   define KMERGE_P p
+#   define KMERGE_T t
+#   define KMERGE_HEAP heap
+#   define KMERGE_OUT o
+#   define KMERGE_LT(a,b) ip4set_lt(a,b)
+#   include "kmerge.c"
+    free(dsd->e[r]);
+    dsd->e[r] = e;
+    dsd->n[r] = dsd->a[r] = n;
+    for(i = 0; i < np; ++i) {	/* free parts as we go */
+      pd = parts[i]->ds_dsd;
+      free(pd->e[r]);
+      pd->e[r] = NULL;
+      pd->n[r] = pd->a[r] = 0;
+    }
+  }
+  free(p);
+  free(heap);
+  if (r < 4)
+    return 0;
+  dsd->sorted = 1;
+  return 1;
+}
+
+const struct dsparts ds_ip4set_parts = {
+  ds_ip4set_partstart, ds_ip4set_partsort, ds_ip4set_partmerge
+};
+
+/* Snapshots (see rbldnsd_snap.c): the normalized arrays, with RRs in
+ * the snapshot pool.  Loaded arrays need no sorting, only the index. */
+
+struct snapent {
+  ip4addr_t addr, last;
+  unsigned rr;		/* reference to the RR in the pool */
+};
+
+static int ds_ip4set_snapsave(const struct dataset *ds, struct snap *sn) {
+  const struct dsdata *dsd = ds->ds_dsd;
+  struct snapent se;
+  const struct entry *e, *t;
+  unsigned r;
+
+  if (dsd->def_rr)
+    snap_pooladd(sn, dsd->def_rr, rrs_size(dsd->def_rr));
+  for(r = 0; r < 4; ++r)
+    for(e = dsd->e[r], t = e + dsd->n[r]; e < t; ++e)
+      if (e->rr && (e == dsd->e[r] || e->rr != e[-1].rr))
+        if (!snap_pooladd(sn, e->rr, rrs_size(e->rr)))
+          return 0;
+  snap_putpool(sn);
+  r = snap_ref(sn, dsd->def_rr);
+  snap_put(sn, &r, sizeof(r));
+  for(r = 0; r < 4; ++r) {
+    snap_put(sn, &dsd->n[r], sizeof(dsd->n[r]));
+    memset(&se, 0, sizeof(se));
+    for(e = dsd->e[r], t = e + dsd->n[r]; e < t; ++e) {
+      se.addr = e->addr;
+      se.last = e->last;
+      se.rr = snap_ref(sn, e->rr);
+      snap_put(sn, &se, sizeof(se));
+    }
+  }
+  return 1;
+}
+
+static int ds_ip4set_snapload(struct dataset *ds, struct snap *sn) {
+  struct dsdata *dsd = ds->ds_dsd;
+  struct snapent se[256];
+  struct entry *e;
+  unsigned r, n, i, j, k, ref;
+
+  if (!snap_getpool(sn, ds->ds_mp) || !snap_get(sn, &ref, sizeof(ref)))
+    return 0;
+  dsd->def_rr = snap_ptr(sn, ref, 5);
+  for(r = 0; r < 4; ++r) {
+    if (!snap_get(sn, &n, sizeof(n)) || !snap_fits(sn, n, sizeof(*se)))
+      return 0;
+    if (!n)
+      continue;
+    if (!(e = trealloc(struct entry, NULL, n)))
+      return 0;
+    dsd->e[r] = e;
+    dsd->n[r] = dsd->a[r] = n;
+    for(i = 0; i < n; i += k) {
+      k = n - i < 256 ? n - i : 256;
+      if (!snap_get(sn, se, k * sizeof(*se)))
+        return 0;
+      for(j = 0; j < k; ++j, ++e) {
+        e->addr = se[j].addr;
+        e->last = se[j].last;
+        e->rr = snap_ptr(sn, se[j].rr, 5);
+      }
+    }
+  }
+  dsd->sorted = 2;
+  return 1;
+}
+
+const struct dssnap ds_ip4set_snap = {
+  ds_ip4set_snapsave, ds_ip4set_snapload
+};
+
+/* Incremental update from delta files: the changed lines are parsed
+ * into two small sets of entries, to add and to remove (with values of
+ * the latter in a scratch pool, freed at the end).  Entries to add
+ * are merged with the (normalized) entries of the current version, and
+ * the result is normalized again without the entries to remove.  This
+ * is linear in the number of entries, without parsing or sorting them.
+ * With ods == ds, finishes a freshly loaded ds with its deltas instead,
+ * so a full load gives exactly the same data as incremental updates. */
+int ds_ip4set_delta(struct dataset *ds, const struct dataset *ods,
+                    const struct dsdelta *dd, struct dsctx *dsc) {
+  struct dsdata *dsd = ds->ds_dsd, add, del;
+  const struct dsdata *odsd = ods->ds_dsd;
+  struct dataset tds = *ds;
+  struct mempool dmp;	/* values of removed lines, only compared */
+  char what[64];
+  unsigned r, i;
+  int ok = 1;
+
+  memset(&add, 0, sizeof(add));
+  memset(&del, 0, sizeof(del));
+  mp_init(&dmp);
+  add.def_rr = del.def_rr = odsd->def_rr;
+  for(i = 0; ok && i < dd->dd_n; ++i) {
+    if (dd->dd_c[i].dc_add) {
+      tds.ds_dsd = &add;
+      tds.ds_mp = ds->ds_mp;
+    }
+    else {
+      tds.ds_dsd = &del;
+      tds.ds_mp = &dmp;
+    }
+    dsc->dsc_lineno = dd->dd_c[i].dc_lineno;
+    ok = ds_ip4set_line(&tds, dd->dd_c[i].dc_line, dsc);
+  }
+  dsc->dsc_lineno = 0;
+  dsc->dsc_fname = NULL;
+  dsd->def_rr = add.def_rr;
+  if (ok && ods == ds && !ds_ip4set_sortall(dsd))
+    ok = 0;
+
+  for(r = 0; ok && r < 4; ++r) {
+    struct entry *oe = odsd->e[r], *m = oe;
+    const struct entry *o = oe, *ot = o + odsd->n[r], *a, *at;
+    struct ents x;
+    unsigned n = odsd->n[r] + add.n[r];
+
+    dsd->h[r] = odsd->h[r];
+    if (!n)
+      continue;
+    if (add.n[r]) {
+      if (!(m = trealloc(struct entry, NULL, n))) {
+        ok = 0;
+        break;
+      }
+      ds_ip4set_sort(&add, r);
+      a = add.e[r]; at = a + add.n[r];
+      for(n = 0; o < ot || a < at; ++n)
+        m[n] = a >= at || (o < ot && !ip4set_lt(a, o)) ? *o++ : *a++;
+    }
+    if (del.n[r])
+      ds_ip4set_sort(&del, r);
+    ok = ds_ip4set_norm(&x, r, m, n, del.e[r], del.n[r]);
+    if (m != oe)
+      free(m);
+    if (!ok)
+      break;
+    if (ods == ds)
+      free(oe);
+    dsd->e[r] = x.e;
+    dsd->a[r] = x.a;
+    if (!(dsd->n[r] = x.n)) {
+      free(x.e);
+      dsd->e[r] = NULL;
+      dsd->a[r] = 0;
+      continue;
+    }
     SHRINK_ARRAY(struct entry, dsd->e[r], dsd->n[r], dsd->a[r]);
   }
-  dsloaded(dsc, "e32/24/16/8=%u/%u/%u/%u",
-           dsd->n[E32], dsd->n[E24], dsd->n[E16], dsd->n[E08]);
+  ds_ip4set_reset(&add, 0);
+  ds_ip4set_reset(&del, 0);
+  mp_free(&dmp);
+  if (!ok)
+    return 0;
+
+  ssprintf(what, sizeof(what), " delta=+%u/-%u",
+           dd->dd_nadd, dd->dd_n - dd->dd_nadd);
+  ds_ip4set_index(ds, dsc, what);
+  return 1;
 }
 
+/* find the group of intervals covering q: the last interval starting
+ * at q or below, if it ends at q or above */
 static const struct entry *
 ds_ip4set_find(const struct entry *e, int b, ip4addr_t q) {
   int a = 0, m;
   --b;
   while(a <= b) {
-    if (e[(m = (a + b) >> 1)].addr == q) {
-      const struct entry *p = e + m - 1;
-      while(p >= e && p->addr == q)
-        --p;
-      return p + 1;
-    }
-    else if (e[m].addr < q) a = m + 1;
+    if (e[(m = (a + b) >> 1)].addr <= q) a = m + 1;
     else b = m - 1;
   }
-  return NULL;
+  if (b < 0 || e[b].last < q)
+    return NULL;
+  for(q = e[b].addr; b > 0 && e[b-1].addr == q; --b)
+    ;
+  return e + b;
+}
+
+/* the same using Eytzinger layout y of n groups of e */
+static const struct entry *
+ds_ip4set_eyfind(const struct entry *e, const struct eykey *y, unsigned n,
+                 ip4addr_t q) {
+  unsigned k = 1;
+  while(k <= n) {
+    eytz_prefetch(y, k);
+    k = 2 * k + (y[k].addr <= q);
+  }
+  if (!(k = eytz_le(k)))
+    return NULL;
+  e += y[k].i;
+  return e->last < q ? NULL : e;
 }
 
 static int
@@ -226,22 +819,55 @@ ds_ip4set_query(const struct dataset *ds, const struct dnsqinfo *qi,
   if (!qi->qi_ip4valid) return 0;
   check_query_overwrites(qi);
 
+/* bloom filter has either f in array i or its block */
+#define bfmaybe(i,f) \
+ (bloom_maybe(&dsd->bf, bfkey(i, f)) || \
+  ((dsd->bfrng >> (i)) & 1 && \
+   bloom_maybe(&dsd->bf, bfkey((i) + 4, (f) & blkmask[i]))))
+
 #define try(i,mask) \
  (dsd->n[i] && \
+  bfmaybe(i, f = q & mask) && \
+  (t = dsd->e[i] + dsd->n[i], \
+   e = dsd->ey[i] ? \
+       ds_ip4set_eyfind(dsd->e[i], dsd->ey[i], dsd->ney[i], f) : \
+       ds_ip4set_find(dsd->e[i], dsd->n[i], f)) != NULL)
+
+/* the same over the slice of slot x */
+#define tryidx(i,mask,xi) \
+ (x[0].xi < x[1].xi && \
+  bfmaybe(i, f = q & mask) && \
   (t = dsd->e[i] + dsd->n[i], \
-   e = ds_ip4set_find(dsd->e[i], dsd->n[i], (f = q & mask))) != NULL)
+   e = ds_ip4set_find(dsd->e[i] + x[0].xi, x[1].xi - x[0].xi, f)) != NULL)
 
-  if (!try(E32, M32) &&
-      !try(E24, M24) &&
-      !try(E16, M16) &&
-      !try(E08, M08))
+  if (dsd->idx) {
+    const struct ip4idx *x = dsd->idx + (q >> 16);
+    if (tryidx(E32, M32, i32) || tryidx(E24, M24, i24))
+      ;
+    else if (x->i16 != NOIDX) {
+      e = dsd->e[E16] + x->i16; t = dsd->e[E16] + dsd->n[E16];
+    }
+    else if (x->i08 != NOIDX) {
+      e = dsd->e[E08] + x->i08; t = dsd->e[E08] + dsd->n[E08];
+    }
+    else
+      return 0;
+  }
+  else if (!try(E32, M32) &&
+           !try(E24, M24) &&
+           !try(E16, M16) &&
+           !try(E08, M08))
     return 0;
 
   if (!e->rr) return 0;		/* exclusion */
 
-  ipsubst = (qi->qi_tflag & NSQUERY_TXT) ? ip4atos(q) : NULL;
-  do addrr_a_txt(pkt, qi->qi_tflag, e->rr, ipsubst, ds);
-  while(++e < t && e->addr == f);
+  f = e->addr;			/* the group */
+  ipsubst = NULL;
+  do {
+    if (!ipsubst && (qi->qi_tflag & NSQUERY_TXT) && rrtxt_subst(ds, e->rr))
+      ipsubst = ip4atos(q);
+    addrr_a_txt(pkt, qi->qi_tflag, e->rr, ipsubst, ds);
+  } while(++e < t && e->addr == f);
 
   return NSQUERY_FOUND;
 }
@@ -280,19 +906,24 @@ struct dumpdata {		/* state. */
   FILE *f;			/* file to dump data to */
 };
 
-/* dump a group of entries with the same IP address.
- * idx shows how many octets we want to print --
- * used only with E08, E16 or E24, not with E32.
+/* dump a group of entries with the same IP addresses, for every
+ * /24, /16 or /8 (hmask shows which) of saddr..slast -- used only with
+ * E08, E16 or E24, not with E32.  Every one is dumped separately, even
+ * when they make up a bigger block, not to clash with that block's own.
  * e is where to start, and t is the end of the array.
  * Returns pointer to the next element after the group.
  */
 static const struct entry *
 ds_ip4set_dump_group(const struct dumpdata *dd,
-                     ip4addr_t saddr, ip4addr_t hmask,
+                     ip4addr_t saddr, ip4addr_t slast, ip4addr_t hmask,
                      const struct entry *e, const struct entry *t) {
-  ip4addr_t addr = e->addr;
+  ip4addr_t addr = e->addr, a;
   do
-    dump_ip4range(saddr, saddr | hmask, e->rr, dd->ds, dd->f);
+    for(a = saddr; ; a += hmask + 1) {
+      dump_ip4range(a, a | hmask, e->rr, dd->ds, dd->f);
+      if ((a | hmask) >= slast)
+        break;
+    }
   while(++e < t && e->addr == addr);
   return e;
 }
@@ -304,7 +935,7 @@ ds_ip4set_dump32(struct dumpdata *dd, ip4addr_t last,
                  const struct entry *u08, const struct entry *u16,
                  const struct entry *u24) {
   const struct entry *e = dd->e[E32], *t = dd->t[E32];
-  ip4addr_t m16 = 1, m24 = 1;
+  ip4addr_t m16 = 1, m24 = 1, a;
   /* up_rr is true if there's anything non-excluded that is on upper level. */
   int up_rr = (u24 ? u24->rr : u16 ? u16->rr : u08 ? u08->rr : NULL) != NULL;
   while(e < t && e->addr <= last) {
@@ -324,7 +955,7 @@ ds_ip4set_dump32(struct dumpdata *dd, ip4addr_t last,
         /* if there's no parent /16, but there is parent /8:
          * repeat that /8 in current /16, but only once per /16. */
         m16 = m24 & M16;
-        ds_ip4set_dump_group(dd, m16, H16, u08, dd->t[E08]);
+        ds_ip4set_dump_group(dd, m16, m16, H16, u08, dd->t[E08]);
       }
       /* several cases:
          u16!=0 and isn't exclusion: dump it in upper /24.
@@ -332,12 +963,16 @@ ds_ip4set_dump32(struct dumpdata *dd, ip4addr_t last,
          u08!=0 - dump it.
       */
       if (!u16)			/* u08 is here as per condition above */
-        ds_ip4set_dump_group(dd, m24, H24, u08, dd->t[E08]);
+        ds_ip4set_dump_group(dd, m24, m24, H24, u08, dd->t[E08]);
       else if (u16->rr)
-        ds_ip4set_dump_group(dd, m24, H24, u16, dd->t[E16]);
+        ds_ip4set_dump_group(dd, m24, m24, H24, u16, dd->t[E16]);
       /* else nothing: the upper-upper /16 is an exclusion anyway */
     }
-    dump_ip4(e->addr, e->rr, dd->ds, dd->f);
+    for(a = e->addr; ; ++a) {
+      dump_ip4(a, e->rr, dd->ds, dd->f);
+      if (a == e->last)
+        break;
+    }
     ++e;
   }
   dd->e[E32] = e;
@@ -369,12 +1004,12 @@ ds_ip4set_dump24(struct dumpdata *dd, ip4addr_t last,
        * repeat that /8 in this new /16.
        * This produces *.x.y entry from y/8 and y.x.z/24. */
       m16 = a & M16;
-      ds_ip4set_dump_group(dd, m16, H16, u08, dd->t[E08]);
+      ds_ip4set_dump_group(dd, m16, m16, H16, u08, dd->t[E08]);
     }
     /* dump all lower-level entries covering by our group */
-    ds_ip4set_dump32(dd, a | H24, u08, u16, e);
+    ds_ip4set_dump32(dd, e->last | H24, u08, u16, e);
     /* dump our group */
-    e = ds_ip4set_dump_group(dd, a, H24, e, t);
+    e = ds_ip4set_dump_group(dd, a, e->last, H24, e, t);
   }
   /* and finally, dump the rest in lower-level groups up to last */
   ds_ip4set_dump32(dd, last, u08, u16, 0);
@@ -397,9 +1032,9 @@ ds_ip4set_dump16(struct dumpdata *dd, ip4addr_t last,
       /* dump all preceeding lower-level entries if any */
       ds_ip4set_dump24(dd, e->addr - 1, u08, 0);
     /* dump all lower-level entries covering by this group */
-    ds_ip4set_dump24(dd, e->addr | H16, u08, e);
+    ds_ip4set_dump24(dd, e->last | H16, u08, e);
     /* dump the group itself */
-    e = ds_ip4set_dump_group(dd, e->addr, H16, e, t);
+    e = ds_ip4set_dump_group(dd, e->addr, e->last, H16, e, t);
   }
   /* and finally, dump the rest in lower levels, up to last */
   ds_ip4set_dump24(dd, last, u08, 0);
@@ -420,9 +1055,9 @@ ds_ip4set_dump08(struct dumpdata *dd) {
       /* dump any preceeding lower-level entries if any */
       ds_ip4set_dump16(dd, e->addr - 1, 0);
     /* dump all entries covered by our group */
-    ds_ip4set_dump16(dd, e->addr | H08, e);
+    ds_ip4set_dump16(dd, e->last | H08, e);
     /* dump our own group too */
-    e = ds_ip4set_dump_group(dd, e->addr, H08, e, t);
+    e = ds_ip4set_dump_group(dd, e->addr, e->last, H08, e, t);
   }
   /* and finally, dump the rest */
   ds_ip4set_dump16(dd, M32, 0);
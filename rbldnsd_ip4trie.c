@@ -93,7 +93,17 @@ ds_ip4trie_line(struct dataset *ds, char *s, struct dsctx *dsc) {
   }
 }
 
+/* add all RRs in the trie for TXT pre-encoding */
+static void
+rrtxt_cb(const btrie_oct_t UNUSED *prefix, unsigned UNUSED len,
+         const void *data, int post, void *user_data)
+{
+  if (!post)
+    rrtxt_add((struct dataset *)user_data, (const char *)data);
+}
+
 static void ds_ip4trie_finish(struct dataset *ds, struct dsctx *dsc) {
+  btrie_walk(ds->ds_dsd->btrie, rrtxt_cb, ds);
   dsloaded(dsc, "%s", btrie_stats(ds->ds_dsd->btrie));
 }
 
@@ -113,7 +123,8 @@ ds_ip4trie_query(const struct dataset *ds, const struct dnsqinfo *qi,
     return 0;
 
   addrr_a_txt(pkt, qi->qi_tflag, rr,
-              qi->qi_tflag & NSQUERY_TXT ? ip4atos(qi->qi_ip4) : NULL, ds);
+              qi->qi_tflag & NSQUERY_TXT && rrtxt_subst(ds, rr) ?
+              ip4atos(qi->qi_ip4) : NULL, ds);
   return NSQUERY_FOUND;
 }
 
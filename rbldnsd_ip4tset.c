@@ -5,13 +5,24 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include "rbldnsd.h"
 
+#if !defined(NO_SIMD) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+# include <immintrin.h>
+# define STREE	/* 16-ary search tree, see ds_ip4tset_stree() */
+#endif
+
 struct dsdata {
   unsigned n;		/* count */
   unsigned a;		/* allocated (only for loading) */
   unsigned h;		/* hint: how much to allocate next time */
   ip4addr_t *e;		/* array of entries */
+  int ey;		/* e is in Eytzinger layout, e[1..n] */
+  /* or e is a search tree of nb nodes, searched by stfind() */
+  int (*stfind)(const ip4addr_t *t, unsigned nb, ip4addr_t q);
+  unsigned nb;
   const char *def_rr;	/* default A and TXT RRs */
 };
 
@@ -23,6 +34,9 @@ static void ds_ip4tset_reset(struct dsdata *dsd, int UNUSED unused_freeall) {
     dsd->e = NULL;
     dsd->n = dsd->a = 0;
   }
+  dsd->ey = 0;
+  dsd->stfind = NULL;
+  dsd->nb = 0;
   dsd->def_rr = NULL;
 }
 
@@ -69,6 +83,120 @@ ds_ip4tset_line(struct dataset *ds, char *s, struct dsctx *dsc) {
   return 1;
 }
 
+#ifdef STREE
+
+/* 16-ary search tree (as in FAST or S-tree) for CPUs with SIMD: node k
+ * is 16 sorted keys in one 64-byte cache line, all compared with the
+ * query at once, and the number i of keys less than it leads to child
+ * node k*17+i+1.  Nodes are filled in order, the last keys repeating the
+ * biggest one.  Keys have their top bit flipped, since SSE2 and AVX2
+ * only compare signed integers.  The tree is built if the CPU supports
+ * either of them, and is put into huge pages where possible, which
+ * matters as much as SIMD for big sets.  Lookups are 2-3 times faster
+ * than in Eytzinger layout, which is used for other CPUs. */
+
+#define STBIAS 0x80000000u
+
+static void
+ds_ip4tset_stbuild(ip4addr_t *t, unsigned nb, unsigned k,
+                   const ip4addr_t *e, unsigned n, unsigned *i) {
+  unsigned j;
+  if (k >= nb)
+    return;
+  for(j = 0; j < 16; ++j) {
+    ds_ip4tset_stbuild(t, nb, k * 17 + j + 1, e, n, i);
+    t[k * 16 + j] = (*i < n ? e[(*i)++] : e[n - 1]) ^ STBIAS;
+  }
+  ds_ip4tset_stbuild(t, nb, k * 17 + 17, e, n, i);
+}
+
+/* i keys of node k are less than q, so key i (if i < 16) is the first
+ * one not less than q in the subtree, and the answer is the last such */
+static int __attribute__((target("sse2")))
+ds_ip4tset_stfind_sse2(const ip4addr_t *t, unsigned nb, ip4addr_t q) {
+  unsigned k = 0, i, f;
+  __m128i x, a, b;
+  const __m128i *p;
+  q ^= STBIAS;
+  f = q ^ 1;			/* not found yet */
+  x = _mm_set1_epi32((int)q);
+  while(k < nb) {
+    p = (const __m128i *)(t + k * 16);
+    a = _mm_packs_epi32(_mm_cmpgt_epi32(x, p[0]), _mm_cmpgt_epi32(x, p[1]));
+    b = _mm_packs_epi32(_mm_cmpgt_epi32(x, p[2]), _mm_cmpgt_epi32(x, p[3]));
+    i = __builtin_ctz(~(unsigned)_mm_movemask_epi8(_mm_packs_epi16(a, b)));
+    f = i < 16 ? t[k * 16 + i] : f;
+    k = k * 17 + i + 1;
+  }
+  return f == q;
+}
+
+/* here, byte order of the comparison mask is mixed, so keys are counted */
+static int __attribute__((target("avx2,popcnt")))
+ds_ip4tset_stfind_avx2(const ip4addr_t *t, unsigned nb, ip4addr_t q) {
+  unsigned k = 0, i, f;
+  __m256i x, m;
+  const __m256i *p;
+  q ^= STBIAS;
+  f = q ^ 1;
+  x = _mm256_set1_epi32((int)q);
+  while(k < nb) {
+    p = (const __m256i *)(t + k * 16);
+    m = _mm256_packs_epi32(_mm256_cmpgt_epi32(x, p[0]),
+                           _mm256_cmpgt_epi32(x, p[1]));
+    i = __builtin_popcount((unsigned)_mm256_movemask_epi8(m)) >> 1;
+    f = i < 16 ? t[k * 16 + i] : f;
+    k = k * 17 + i + 1;
+  }
+  return f == q;
+}
+
+/* build the tree of n sorted entries e if the CPU can search it */
+static int
+ds_ip4tset_stree(struct dsdata *dsd, const ip4addr_t *e, unsigned n) {
+  unsigned nb = (n + 15) / 16, i = 0;
+  size_t sz = (nb + 1) * (size_t)64;	/* and a node to read past the end */
+  ip4addr_t *t;
+  void *p;
+
+  if (__builtin_cpu_supports("avx2"))
+    dsd->stfind = ds_ip4tset_stfind_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    dsd->stfind = ds_ip4tset_stfind_sse2;
+  else
+    return 0;
+  if (nb >= 0xffffffffu / 17 ||		/* child indexes would overflow */
+      posix_memalign(&p, sz >= (2u << 20) ? (2u << 20) : 64, sz) != 0) {
+    dsd->stfind = NULL;
+    return 0;
+  }
+  t = (ip4addr_t *)p;
+#ifdef MADV_HUGEPAGE
+  if (sz >= (2u << 20))
+    madvise(t, sz, MADV_HUGEPAGE);
+#endif
+  ds_ip4tset_stbuild(t, nb, 0, e, n, &i);
+  memset(t + nb * 16, 0, 64);
+  dsd->e = t;
+  dsd->nb = nb;
+  dsd->a = nb * 16;
+  return 1;
+}
+
+static const char *
+ds_ip4tset_stname(int (*stfind)(const ip4addr_t *, unsigned, ip4addr_t)) {
+  return
+    stfind == ds_ip4tset_stfind_avx2 ? " simd=avx2" :
+    stfind == ds_ip4tset_stfind_sse2 ? " simd=sse2" : "";
+}
+
+#else
+
+#define ds_ip4tset_stree(dsd, e, n) 0
+#define ds_ip4tset_stname(stfind) ""
+
+#endif
+
 static void ds_ip4tset_finish(struct dataset *ds, struct dsctx *dsc) {
   struct dsdata *dsd = ds->ds_dsd;
   ip4addr_t *e = dsd->e;
@@ -85,17 +213,35 @@ static void ds_ip4tset_finish(struct dataset *ds, struct dsctx *dsc) {
 #   define QSORT_BASE e
 #   define QSORT_NELT n
 #   define QSORT_LT(a,b) *a < *b
-#   include "qsort.c"
+#   define RSORT_NBYTES 4
+#   define RSORT_BYTE(p,i) ((*(p) >> ((i) << 3)) & 255u)
+#   include "rsort.c"
+#   undef RSORT_BYTE
+#   undef RSORT_NBYTES
+#   undef QSORT_LT
+#   undef QSORT_NELT
+#   undef QSORT_BASE
+#   undef QSORT_TYPE
 
 #define ip4tset_eeq(a,b) a == b
     REMOVE_DUPS(ip4addr_t, e, n, ip4tset_eeq);
-    SHRINK_ARRAY(ip4addr_t, e, n, dsd->a);
-    dsd->e = e;
+    if (ds_ip4tset_stree(dsd, e, n))
+      free(e);
+    else if ((dsd->e = (ip4addr_t *)eytzinger(e, n, sizeof(*e))) != NULL) {
+      free(e);
+      dsd->a = n + 1;
+      dsd->ey = 1;
+    }
+    else {		/* binary search over sorted array then */
+      SHRINK_ARRAY(ip4addr_t, e, n, dsd->a);
+      dsd->e = e;
+    }
     dsd->n = n;
   }
 
   if (!dsd->def_rr) dsd->def_rr = def_rr;
-  dsloaded(dsc, "cnt=%u", n);
+  rrtxt_add(ds, dsd->def_rr);
+  dsloaded(dsc, "cnt=%u%s", n, ds_ip4tset_stname(dsd->stfind));
 }
 
 static int
@@ -110,6 +256,18 @@ ds_ip4tset_find(const ip4addr_t *e, int b, ip4addr_t q) {
   return 0;
 }
 
+/* the same in Eytzinger layout, without branches but the loop itself */
+static int
+ds_ip4tset_eyfind(const ip4addr_t *e, unsigned n, ip4addr_t q) {
+  unsigned k = 1;
+  while(k <= n) {
+    eytz_prefetch(e, k);
+    k = 2 * k + (e[k] < q);
+  }
+  k = eytz_lb(k);
+  return k && e[k] == q;
+}
+
 static int
 ds_ip4tset_query(const struct dataset *ds, const struct dnsqinfo *qi,
                 struct dnspacket *pkt) {
@@ -119,10 +277,14 @@ ds_ip4tset_query(const struct dataset *ds, const struct dnsqinfo *qi,
   if (!qi->qi_ip4valid) return 0;
   check_query_overwrites(qi);
 
-  if (!dsd->n || !ds_ip4tset_find(dsd->e, dsd->n, qi->qi_ip4))
+  if (!dsd->n ||
+      !(dsd->stfind ? dsd->stfind(dsd->e, dsd->nb, qi->qi_ip4) :
+        dsd->ey ? ds_ip4tset_eyfind(dsd->e, dsd->n, qi->qi_ip4) :
+        ds_ip4tset_find(dsd->e, dsd->n, qi->qi_ip4)))
     return 0;
 
-  ipsubst = (qi->qi_tflag & NSQUERY_TXT) ? ip4atos(qi->qi_ip4) : NULL;
+  ipsubst = (qi->qi_tflag & NSQUERY_TXT) && rrtxt_subst(ds, dsd->def_rr) ?
+    ip4atos(qi->qi_ip4) : NULL;
   addrr_a_txt(pkt, qi->qi_tflag, dsd->def_rr, ipsubst, ds);
 
   return NSQUERY_FOUND;
@@ -130,14 +292,46 @@ ds_ip4tset_query(const struct dataset *ds, const struct dnsqinfo *qi,
 
 #ifndef NO_MASTER_DUMP
 
+#ifdef STREE
+/* entries of the search tree in order, n of them */
+static void
+ds_ip4tset_stdump(const struct dataset *ds, unsigned k, unsigned *n,
+                  FILE *f) {
+  const struct dsdata *dsd = ds->ds_dsd;
+  unsigned j;
+  if (k >= dsd->nb)
+    return;
+  for(j = 0; j < 16 && *n; ++j) {
+    ds_ip4tset_stdump(ds, k * 17 + j + 1, n, f);
+    if (*n) {
+      --*n;
+      dump_ip4(dsd->e[k * 16 + j] ^ STBIAS, dsd->def_rr, ds, f);
+    }
+  }
+  ds_ip4tset_stdump(ds, k * 17 + 17, n, f);
+}
+#endif
+
 static void
 ds_ip4tset_dump(const struct dataset *ds,
                const unsigned char UNUSED *unused_odn,
                FILE *f) {
   const struct dsdata *dsd = ds->ds_dsd;
   const ip4addr_t *e = dsd->e, *t = e + dsd->n;
-  while(e < t)
-    dump_ip4(*e++, dsd->def_rr, ds, f);
+  unsigned k;
+#ifdef STREE
+  if (dsd->stfind) {
+    k = dsd->n;
+    ds_ip4tset_stdump(ds, 0, &k, f);
+  }
+  else
+#endif
+  if (dsd->ey)
+    for(k = eytz_first(dsd->n); k; k = eytz_next(k, dsd->n))
+      dump_ip4(e[k], dsd->def_rr, ds, f);
+  else
+    while(e < t)
+      dump_ip4(*e++, dsd->def_rr, ds, f);
 }
 
 #endif
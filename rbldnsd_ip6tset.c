@@ -23,9 +23,13 @@ struct dsdata {
   unsigned a_hnt, e_hnt; /* hint: how much to allocate next time */
   struct ip6half *a;	 /* array of entries */
   struct ip6full *e;	 /* array of exclusions */
+  int a_ey, e_ey;	 /* a or e is in Eytzinger layout, [1..cnt] */
   const char *def_rr;	 /* default A and TXT RRs */
+  struct bloom bf;	 /* regular entries */
 };
 
+#define bfkey(a) bloom_hash(a, IP6ADDR_HALF, 0)
+
 definedstype(ip6tset, DSTF_IP6REV, "(trivial) set of ip6 addresses");
 
 static void ds_ip6tset_reset(struct dsdata *dsd, int UNUSED unused_freeall) {
@@ -33,6 +37,8 @@ static void ds_ip6tset_reset(struct dsdata *dsd, int UNUSED unused_freeall) {
   free(dsd->e); dsd->e = NULL;
   dsd->a_alc = dsd->e_alc = 0;
   dsd->a_cnt = dsd->e_cnt = 0;
+  dsd->a_ey = dsd->e_ey = 0;
+  bloom_free(&dsd->bf);
   dsd->def_rr = NULL;
 }
 
@@ -113,6 +119,7 @@ static void ds_ip6tset_finish(struct dataset *ds, struct dsctx *dsc) {
 
 #define ip6tset_eeq(a,b) memcmp(&a, &b, sizeof(a)) == 0
 #define QSORT_LT(a,b) (memcmp(a, b, sizeof(*a)) < 0)
+#define RSORT_BYTE(p,i) ((p)->a[sizeof((p)->a) - 1 - (i)])
 
   /* regular entries, ip6halves */
   n = dsd->a_cnt;
@@ -128,15 +135,24 @@ static void ds_ip6tset_finish(struct dataset *ds, struct dsctx *dsc) {
 #   define QSORT_TYPE struct ip6half
 #   define QSORT_BASE a
 #   define QSORT_NELT n
-#   include "qsort.c"
+#   define RSORT_NBYTES IP6ADDR_HALF
+#   include "rsort.c"
+#   undef RSORT_NBYTES
 #   undef QSORT_NELT
 #   undef QSORT_BASE
 #   undef QSORT_TYPE
 
     REMOVE_DUPS(struct ip6half, a, n, ip6tset_eeq);
-    SHRINK_ARRAY(struct ip6half, a, n, dsd->a_alc);
-    dsd->a = a;
     dsd->a_cnt = n;
+    if ((dsd->a = (struct ip6half *)eytzinger(a, n, sizeof(*a))) != NULL) {
+      free(a);
+      dsd->a_alc = n + 1;
+      dsd->a_ey = 1;
+    }
+    else {
+      SHRINK_ARRAY(struct ip6half, a, n, dsd->a_alc);
+      dsd->a = a;
+    }
   }
 
   /* exclusions, ip6fulls */
@@ -153,19 +169,34 @@ static void ds_ip6tset_finish(struct dataset *ds, struct dsctx *dsc) {
 #   define QSORT_TYPE struct ip6full
 #   define QSORT_BASE e
 #   define QSORT_NELT n
-#   include "qsort.c"
+#   define RSORT_NBYTES IP6ADDR_FULL
+#   include "rsort.c"
+#   undef RSORT_NBYTES
 #   undef QSORT_NELT
 #   undef QSORT_BASE
 #   undef QSORT_TYPE
 
     REMOVE_DUPS(struct ip6full, e, n, ip6tset_eeq);
-    SHRINK_ARRAY(struct ip6full, e, n, dsd->a_alc);
-    dsd->e = e;
     dsd->e_cnt = n;
+    if ((dsd->e = (struct ip6full *)eytzinger(e, n, sizeof(*e))) != NULL) {
+      free(e);
+      dsd->e_alc = n + 1;
+      dsd->e_ey = 1;
+    }
+    else {
+      SHRINK_ARRAY(struct ip6full, e, n, dsd->e_alc);
+      dsd->e = e;
+    }
   }
 
+  if (bloom_init(&dsd->bf, dsd->a_cnt))
+    for(n = dsd->a_ey; n < dsd->a_cnt + dsd->a_ey; ++n)
+      bloom_add(&dsd->bf, bfkey(dsd->a[n].a));
+
   if (!dsd->def_rr) dsd->def_rr = def_rr;
-  dsloaded(dsc, "cnt=%u exl=%u", dsd->a_cnt, dsd->e_cnt);
+  rrtxt_add(ds, dsd->def_rr);
+  dsloaded(dsc, "cnt=%u exl=%u %s", dsd->a_cnt, dsd->e_cnt,
+           bloom_stats(&dsd->bf));
 }
 
 static int
@@ -196,6 +227,42 @@ ds_ip6tset_find_excl(const struct ip6full *arr, int b, const ip6oct_t *q) {
   return 0;
 }
 
+/* 8 bytes of an address as a number, to compare in one go */
+static inline unsigned long long ip6key(const ip6oct_t *p) {
+  return
+    (unsigned long long)p[0] << 56 | (unsigned long long)p[1] << 48 |
+    (unsigned long long)p[2] << 40 | (unsigned long long)p[3] << 32 |
+    (unsigned long long)p[4] << 24 | (unsigned long long)p[5] << 16 |
+    (unsigned long long)p[6] << 8 | p[7];
+}
+
+/* the same two in Eytzinger layout, without branches but the loop */
+static int
+ds_ip6tset_eyfind(const struct ip6half *arr, unsigned n, const ip6oct_t *q) {
+  unsigned long long qh = ip6key(q);
+  unsigned k = 1;
+  while(k <= n) {
+    eytz_prefetch(arr, k);
+    k = 2 * k + (ip6key(arr[k].a) < qh);
+  }
+  k = eytz_lb(k);
+  return k && ip6key(arr[k].a) == qh;
+}
+
+static int
+ds_ip6tset_eyfind_excl(const struct ip6full *arr, unsigned n,
+                       const ip6oct_t *q) {
+  unsigned long long qh = ip6key(q), ql = ip6key(q + 8), h;
+  unsigned k = 1;
+  while(k <= n) {
+    eytz_prefetch(arr, k);
+    h = ip6key(arr[k].a);
+    k = 2 * k + ((h < qh) | ((h == qh) & (ip6key(arr[k].a + 8) < ql)));
+  }
+  k = eytz_lb(k);
+  return k && memcmp(arr[k].a, q, sizeof(*arr)) == 0;
+}
+
 static int
 ds_ip6tset_query(const struct dataset *ds, const struct dnsqinfo *qi,
                 struct dnspacket *pkt) {
@@ -205,12 +272,16 @@ ds_ip6tset_query(const struct dataset *ds, const struct dnsqinfo *qi,
   if (!qi->qi_ip6valid) return 0;
   check_query_overwrites(qi);
 
-  if (!ds_ip6tset_find(dsd->a, dsd->a_cnt, qi->qi_ip6))
+  if (!bloom_maybe(&dsd->bf, bfkey(qi->qi_ip6)) ||
+      !(dsd->a_ey ? ds_ip6tset_eyfind(dsd->a, dsd->a_cnt, qi->qi_ip6) :
+        ds_ip6tset_find(dsd->a, dsd->a_cnt, qi->qi_ip6)))
     return 0;
-  if (dsd->e_cnt && ds_ip6tset_find_excl(dsd->e, dsd->e_cnt, qi->qi_ip6))
+  if (dsd->e_cnt &&
+      (dsd->e_ey ? ds_ip6tset_eyfind_excl(dsd->e, dsd->e_cnt, qi->qi_ip6) :
+       ds_ip6tset_find_excl(dsd->e, dsd->e_cnt, qi->qi_ip6)))
     return 0;
 
-  ipsubst = (qi->qi_tflag & NSQUERY_TXT) ?
+  ipsubst = (qi->qi_tflag & NSQUERY_TXT) && rrtxt_subst(ds, dsd->def_rr) ?
     ip6atos(qi->qi_ip6, IP6ADDR_FULL) : NULL;
   addrr_a_txt(pkt, qi->qi_tflag, dsd->def_rr, ipsubst, ds);
 
@@ -225,17 +296,23 @@ ds_ip6tset_dump(const struct dataset *ds,
                FILE *f) {
   const struct dsdata *dsd = ds->ds_dsd;
 
-  { const struct ip6half *a = dsd->a, *at = a + dsd->a_cnt;
-    while(a < at) {
-      dump_ip6((a++)->a, 16, dsd->def_rr, ds, f);
-    }
-  }
+  unsigned k, n;
 
-  { const struct ip6full *e = dsd->e, *et = e + dsd->e_cnt;
-    while(e < et) {
-      dump_ip6((e++)->a, 0, NULL, ds, f);
-    }
-  }
+  n = dsd->a_cnt;
+  if (dsd->a_ey)
+    for(k = eytz_first(n); k; k = eytz_next(k, n))
+      dump_ip6(dsd->a[k].a, 16, dsd->def_rr, ds, f);
+  else
+    for(k = 0; k < n; ++k)
+      dump_ip6(dsd->a[k].a, 16, dsd->def_rr, ds, f);
+
+  n = dsd->e_cnt;
+  if (dsd->e_ey)
+    for(k = eytz_first(n); k; k = eytz_next(k, n))
+      dump_ip6(dsd->e[k].a, 0, NULL, ds, f);
+  else
+    for(k = 0; k < n; ++k)
+      dump_ip6(dsd->e[k].a, 0, NULL, ds, f);
 
 }
 
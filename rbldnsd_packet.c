@@ -8,18 +8,13 @@
 #include <unistd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <netdb.h>
 #include <syslog.h>
 #include "rbldnsd.h"
 
 #ifndef NO_IPv6
-# ifndef NI_MAXHOST
-#  define IPSIZE 1025
-# else
-#  define IPSIZE NI_MAXHOST
-# endif
+# define IPSIZE INET6_ADDRSTRLEN
 #else
-# define IPSIZE 16
+# define IPSIZE INET_ADDRSTRLEN
 #endif
 
 #define MAX_GLUE (MAX_NS*2)
@@ -28,6 +23,21 @@ static int addrr_soa(struct dnspacket *pkt, const struct zone *zone, int auth);
 static int addrr_ns(struct dnspacket *pkt, const struct zone *zone, int auth);
 static int version_req(struct dnspacket *pkt, const struct dnsquery *qry);
 
+/* format peer address the way getnameinfo(NI_NUMERICHOST) does,
+ * but without its overhead (it is done for every ADDPEER reply) */
+static const char *peerntop(const struct dnspacket *pkt, char buf[IPSIZE]) {
+  const struct sockaddr *sa = pkt->p_peer;
+  if (sa->sa_family == AF_INET)
+    return inet_ntop(AF_INET, &((const struct sockaddr_in *)sa)->sin_addr,
+                     buf, IPSIZE);
+#ifndef NO_IPv6
+  if (sa->sa_family == AF_INET6)
+    return inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)sa)->sin6_addr,
+                     buf, IPSIZE);
+#endif
+  return NULL;
+}
+
 /* DNS packet:
  * bytes comment */
 /* 0:1   identifier (client supplied) */
@@ -89,6 +99,8 @@ parsequery(struct dnspacket *pkt, unsigned qlen,
    * UDP buffer size (DNS_MAXPACKET), and if not (which means we're replying
    * to EDNS0-aware client due to the above rules), we just add proper OPT
    * record at the end.
+   * For TCP queries (pkt->p_tcpsz is set) the whole p_buf is available,
+   * and no OPT record is ever added.
    */
 
   register unsigned const char *q = pkt->p_buf;
@@ -146,14 +158,16 @@ parsequery(struct dnspacket *pkt, unsigned qlen,
     /* 11 bytes are needed to encode minimal EDNS0 OPT record */
     if (qlen < DNS_MAXPACKET + 11)
       qlen = DNS_MAXPACKET;
-    else if (qlen > sizeof(pkt->p_buf) - 11)
-      qlen = sizeof(pkt->p_buf) - 11;
+    else if (qlen > DNS_EDNS0_MAXPACKET - 11)
+      qlen = DNS_EDNS0_MAXPACKET - 11;
     else
       qlen -= 11;
     pkt->p_endp = d + qlen;
   }
   else
     pkt->p_endp = d + DNS_MAXPACKET;
+  if (pkt->p_tcpsz)		/* no size limits (and no OPT) for TCP */
+    pkt->p_endp = d + pkt->p_tcpsz;
 
   return 1;
 }
@@ -250,7 +264,11 @@ findqzone(const struct zone *zone,
           struct dnsqinfo *qi) {
   const unsigned char *q;
 
-  for(;; zone = zone->z_next) {
+  if (zone && zone->z_zidx) {
+    if (!(zone = zindex_find(zone->z_zidx, dnlen, dnlab, dnlptr)))
+      return NULL;
+  }
+  else for(;; zone = zone->z_next) {
     if (!zone) return NULL;
     if (zone->z_dnlab > dnlab) continue;
     q = dnlptr[dnlab - zone->z_dnlab];
@@ -268,11 +286,193 @@ findqzone(const struct zone *zone,
   return zone;
 }
 
+/* response cache.  Replies which fit into DNS_MAXPACKET are remembered,
+ * keyed on query DN (lowercased), type and class, reply size limit and
+ * global ACL outcome.  Entry holds reply header without ID, query DN and
+ * the rest of the reply after the question section.  Zone ACL outcome is
+ * checked on every hit, since zone isn't known before the lookup. */
+
+#define RC_PROBE 4	/* number of entries to look at, starting at hash */
+#define RC_ACL	(NSQUERY_IGNORE|NSQUERY_REFUSE|NSQUERY_EMPTY|NSQUERY_ALWAYS)
+
+struct rcentry {
+  unsigned re_gen;		/* reload_gen when added, 0 if empty */
+  unsigned re_hash;
+  const struct zone *re_zone;
+  unsigned short re_type, re_class;
+  unsigned short re_size;	/* reply size limit, p_endp - p_buf */
+  unsigned char re_gacl, re_zacl;	/* ACL outcome, RC_ACL >> 16 */
+  unsigned char re_nxd;		/* negative reply (for stats) */
+  unsigned char re_dnlen;	/* length of query DN */
+  unsigned short re_alen;	/* length of the reply after question */
+  unsigned char re_hdr[p_hdrsize - 2];	/* reply header after ID */
+  unsigned char re_data[DNS_MAXPACKET - p_hdrsize - 4];	/* DN and reply */
+};
+
+unsigned reload_gen = 1;
+
+struct rcache *rcache_new(unsigned nentries) {
+  struct rcache *rc = (struct rcache *)ezalloc(sizeof(*rc));
+  unsigned n = RC_PROBE;
+  while(n < nentries)
+    n <<= 1;
+  rc->rc_e = (struct rcentry *)ezalloc(n * sizeof(struct rcentry));
+  rc->rc_mask = n - 1;
+  return rc;
+}
+
+static unsigned
+rc_hash(const struct dnsquery *q, unsigned size, unsigned gacl) {
+  const unsigned char *dn = q->q_dn, *e = dn + q->q_dnlen;
+  unsigned h = 2166136261u;	/* FNV-1a */
+  while(dn < e)
+    h = (h ^ *dn++) * 16777619u;
+  h = (h ^ (q->q_type | (q->q_class << 16))) * 16777619u;
+  h = (h ^ (size | (gacl << 24))) * 16777619u;
+  /* FNV low bits are poor, mix them as we use low bits as index */
+  h ^= h >> 16; h *= 0x85ebca6bu;
+  h ^= h >> 13; h *= 0xc2b2ae35u;
+  return h ^ (h >> 16);
+}
+
+static struct rcentry *
+rc_find(const struct rcache *rc, const struct dnsquery *q,
+        unsigned h, unsigned size, unsigned gacl) {
+  struct rcentry *e;
+  unsigned i;
+  for(i = 0; i < RC_PROBE; ++i) {
+    e = &rc->rc_e[(h + i) & rc->rc_mask];
+    if (e->re_gen == rc->rc_gen && e->re_hash == h &&
+        e->re_type == q->q_type && e->re_class == q->q_class &&
+        e->re_size == size && e->re_gacl == gacl &&
+        e->re_dnlen == q->q_dnlen &&
+        memcmp(e->re_data, q->q_dn, q->q_dnlen) == 0)
+      return e;
+  }
+  return NULL;
+}
+
+/* remember reply in pkt, replacing an entry with the same key if any */
+static void
+rc_add(struct dnspacket *pkt, const struct dnsquery *q,
+       unsigned h, unsigned size, unsigned gacl, unsigned zacl,
+       const struct zone *zone, int nxd) {
+  struct rcache *rc = pkt->p_cache;
+  struct rcentry *e;
+  unsigned i, alen = pkt->p_cur - pkt->p_sans;
+
+  if (q->q_dnlen + alen > sizeof(e->re_data))
+    return;
+  if (!(e = rc_find(rc, q, h, size, gacl))) {
+    for(i = 0; i < RC_PROBE; ++i) {
+      e = &rc->rc_e[(h + i) & rc->rc_mask];
+      if (e->re_gen != rc->rc_gen)	/* empty or stale */
+        break;
+    }
+    if (i == RC_PROBE)
+      e = &rc->rc_e[(h + rc->rc_ins++ % RC_PROBE) & rc->rc_mask];
+  }
+  e->re_gen = rc->rc_gen;
+  e->re_hash = h;
+  e->re_zone = zone;
+  e->re_type = q->q_type;
+  e->re_class = q->q_class;
+  e->re_size = size;
+  e->re_gacl = gacl;
+  e->re_zacl = zacl;
+  e->re_nxd = nxd;
+  e->re_dnlen = q->q_dnlen;
+  e->re_alen = alen;
+  memcpy(e->re_hdr, pkt->p_buf + p_f1, sizeof(e->re_hdr));
+  e->re_hdr[0] &= ~pf1_rd;
+  memcpy(e->re_data, q->q_dn, q->q_dnlen);
+  memcpy(e->re_data + q->q_dnlen, pkt->p_sans, alen);
+}
+
+/* construct reply from cache entry, unless zone ACL outcome differs */
+static int rc_reply(struct dnspacket *pkt, const struct rcentry *e) {
+  const struct zone *zone = e->re_zone;
+  const struct dataset *dsacl = rcu_deref(zone->z_dsacl);
+  unsigned char *h = pkt->p_buf;
+  if (dsacl && dsacl->ds_stamp &&
+      (ds_acl_query(dsacl, pkt) & RC_ACL) >> 16 != e->re_zacl)
+    return 0;
+  h[p_f1] = (h[p_f1] & pf1_rd) | e->re_hdr[0];
+  memcpy(h + p_f2, e->re_hdr + 1, sizeof(e->re_hdr) - 1);
+  memcpy(pkt->p_sans, e->re_data + e->re_dnlen, e->re_alen);
+  pkt->p_cur = pkt->p_sans + e->re_alen;
+#ifndef NO_STATS
+  if (e->re_nxd)
+    pkt->p_stats[zone->z_idx].q_nxd += 1;
+  else
+    pkt->p_stats[zone->z_idx].q_ok += 1;
+  pkt->p_stats[zone->z_idx].b_out += pkt->p_cur - h;
+#endif
+  return 1;
+}
+
+/* index of the RRs added by addrr_any() to the answer section of the
+ * current reply, so that duplicate checking does not have to rescan the
+ * whole answer for every new RR.  RRs are hashed by type and data.  All
+ * RRs of the same type should have the same (smallest) TTL; it is kept
+ * per type and written into the RRs once by rridx_finish() when it has
+ * been lowered.  One index is used by a thread for all its packets, and
+ * is reset for each query.  Without it (glue lookups at load time),
+ * checkrr_present() is used instead. */
+
+#define RRIDX_MAXRR 255		/* max # of answers, see p_ancnt2 */
+#define RRIDX_SIZE 512		/* # of hash slots, > 2 * RRIDX_MAXRR */
+
+struct rridx {
+  unsigned ri_nrr;		/* # of RRs indexed */
+  unsigned ri_ntp;		/* # of distinct RR types */
+  unsigned ri_lowered;		/* TTL of some type has been lowered */
+  unsigned ri_slot;		/* free slot for the RR being added */
+  unsigned ri_tp;		/* its type index, ri_ntp if new type */
+  unsigned short ri_rroff[RRIDX_MAXRR];	/* RR offsets from p_sans */
+  unsigned short ri_rrslot[RRIDX_MAXRR];	/* hash slot of every RR */
+  unsigned char ri_rrtp[RRIDX_MAXRR];	/* type index of every RR */
+  struct { unsigned tp_type, tp_ttl; } ri_tps[RRIDX_MAXRR];
+  unsigned char ri_tab[RRIDX_SIZE];	/* 1 + RR index, 0 = empty */
+};
+
+struct rridx *rridx_new(void) {
+  return (struct rridx *)ezalloc(sizeof(struct rridx));
+}
+
+static void rridx_reset(struct rridx *ri) {
+  unsigned i;
+  for(i = 0; i < ri->ri_nrr; ++i)
+    ri->ri_tab[ri->ri_rrslot[i]] = 0;
+  ri->ri_nrr = ri->ri_ntp = ri->ri_lowered = 0;
+}
+
+/* set TTLs of all indexed RRs to the (lowest) TTL of their type */
+static void rridx_finish(struct rridx *ri, unsigned char *sans) {
+  unsigned i;
+  unsigned char *c;
+  if (!ri->ri_lowered)
+    return;
+  for(i = 0; i < ri->ri_nrr; ++i) {
+    c = sans + ri->ri_rroff[i] + 6;
+    PACK32(c, ri->ri_tps[ri->ri_rrtp[i]].tp_ttl);
+  }
+}
+
+#ifndef NO_DSO
+# define hooked() (hook_query_access || hook_query_result)
+#else
+# define hooked() 0
+#endif
+
 #ifdef NO_STATS
 # define do_stats(x)
 #else
 # define do_stats(x) x
 #endif
+/* counters of the current thread, folded into gstats/z_stats by main */
+#define gs (pkt->p_stats[0])
+#define zs (pkt->p_stats[zone->z_idx])
 
 /* construct reply to a query. */
 int replypacket(struct dnspacket *pkt, unsigned qlen, struct zone *zone) {
@@ -281,29 +481,54 @@ int replypacket(struct dnspacket *pkt, unsigned qlen, struct zone *zone) {
   struct dnsqinfo qi;			/* query info structure */
   unsigned char *h = pkt->p_buf;	/* packet's header */
   const struct dslist *dsl;
+  const struct dataset *dsacl;
   int found;
   extern int lazy; /*XXX hack*/
+  unsigned rchash = 0, rcsize = 0, gacl, zacl = 0, crr = pkt->p_crr;
 
   pkt->p_substrr = 0;
   /* check global ACL */
-  if (g_dsacl && g_dsacl->ds_stamp) {
-    found = ds_acl_query(g_dsacl, pkt);
+  dsacl = rcu_deref(g_dsacl);
+  if (dsacl && dsacl->ds_stamp) {
+    found = ds_acl_query(dsacl, pkt);
     if (found & NSQUERY_IGNORE) {
-      do_stats(gstats.q_err += 1; gstats.b_in += qlen);
+      do_stats(gs.q_err += 1; gs.b_in += qlen);
       return 0;
     }
   }
   else
     found = 0;
+  gacl = (found & RC_ACL) >> 16;
 
   if (!parsequery(pkt, qlen, &qry)) {
-    do_stats(gstats.q_err += 1; gstats.b_in += qlen);
+    do_stats(gs.q_err += 1; gs.b_in += qlen);
     return 0;
   }
 
+  if (pkt->p_cache && !(h[p_f1] & (pf1_opcode | pf1_aa | pf1_tc | pf1_qr))) {
+    const struct rcentry *e;
+    pkt->p_cache->rc_gen = rcu_deref(reload_gen);
+    rcsize = pkt->p_endp - h;
+    rchash = rc_hash(&qry, rcsize, gacl);
+    e = rc_find(pkt->p_cache, &qry, rchash, rcsize, gacl);
+    if (e && rc_reply(pkt, e)) {
+      do_stats(pkt->p_cache->rc_hits += 1;
+               pkt->p_stats[e->re_zone->z_idx].b_in += qlen);
+      return pkt->p_cur - h;
+    }
+    do_stats(pkt->p_cache->rc_miss += 1);
+  }
+  if (pkt->p_rridx)
+    rridx_reset(pkt->p_rridx);
+
   /* from now on, we see (almost?) valid dns query, should reply */
 
 #define setnonauth(h) (h[p_f1] &= ~pf1_aa)
+/* an answer RR does not fit: over UDP, tell the client to retry over TCP
+ * if we answer there (otherwise the partial answer is better than none) */
+#define settrunc(pkt) \
+    do { if (tcp_serving && !(pkt)->p_tcpsz) (pkt)->p_buf[p_f1] |= pf1_tc; } \
+    while(0)
 #define _refuse(code,lab) \
     do { setnonauth(h); h[p_f2] = (code); goto lab; } while(0)
 #define refuse(code) _refuse(code, err_nz)
@@ -328,7 +553,7 @@ int replypacket(struct dnspacket *pkt, unsigned qlen, struct zone *zone) {
     h[p_f1] |= pf1_aa;
   else if (qry.q_class != DNS_C_ANY) {
     if (version_req(pkt, &qry)) {
-      do_stats(gstats.q_ok += 1; gstats.b_in += qlen; gstats.b_out += rlen());
+      do_stats(gs.q_ok += 1; gs.b_in += qlen; gs.b_out += rlen());
       return rlen();
     }
     else
@@ -358,17 +583,20 @@ int replypacket(struct dnspacket *pkt, unsigned qlen, struct zone *zone) {
   /* found matching zone */
 #undef refuse
 #define refuse(code)  _refuse(code, err_z)
-  do_stats(zone->z_stats.b_in += qlen);
+  do_stats(zs.b_in += qlen);
 
-  if (zone->z_dsacl && zone->z_dsacl->ds_stamp) {
-    qi.qi_tflag |= ds_acl_query(zone->z_dsacl, pkt);
+  dsacl = rcu_deref(zone->z_dsacl);
+  if (dsacl && dsacl->ds_stamp) {
+    zacl = ds_acl_query(dsacl, pkt);
+    qi.qi_tflag |= zacl;
+    zacl = (zacl & RC_ACL) >> 16;
     if (qi.qi_tflag & NSQUERY_IGNORE) {
-      do_stats(gstats.q_err += 1);
+      do_stats(gs.q_err += 1);
       return 0;
     }
   }
 
-  if (!zone->z_stamp)	/* do not answer if not loaded */
+  if (!rcu_deref(zone->z_stamp))	/* do not answer if not loaded */
     refuse(DNS_R_SERVFAIL);
 
   if (qi.qi_tflag & NSQUERY_REFUSE)
@@ -401,21 +629,18 @@ int replypacket(struct dnspacket *pkt, unsigned qlen, struct zone *zone) {
 
   /* search the datasets */
   for(dsl = zone->z_dsl; dsl; dsl = dsl->dsl_next)
-    found |= dsl->dsl_queryfn(dsl->dsl_ds, &qi, pkt);
+    found |= dsl->dsl_queryfn(rcu_deref(dsl->dsl_ds), &qi, pkt);
 
   if (found & NSQUERY_ADDPEER) {
-#ifdef NO_IPv6
-    addrr_a_txt(pkt, qi.qi_tflag, pkt->p_substrr,
-                inet_ntoa(((struct sockaddr_in*)pkt->p_peer)->sin_addr),
-                pkt->p_substds);
-#else
     char subst[IPSIZE];
-    if (getnameinfo(pkt->p_peer, pkt->p_peerlen,
-                    subst, NI_MAXHOST, NULL, 0, NI_NUMERICHOST) != 0)
+    if (!(qi.qi_tflag & NSQUERY_TXT) ||
+        !rrtxt_subst(pkt->p_substds, pkt->p_substrr) ||
+        !peerntop(pkt, subst))
       subst[0] = '\0';
     addrr_a_txt(pkt, qi.qi_tflag, pkt->p_substrr, subst, pkt->p_substds);
-#endif
   }
+  if (pkt->p_rridx)
+    rridx_finish(pkt->p_rridx, pkt->p_sans);
 
   /* now complete the reply: add AUTH etc sections */
   /* addrr_ns(auth=1) should be called last as it fills in
@@ -423,20 +648,19 @@ int replypacket(struct dnspacket *pkt, unsigned qlen, struct zone *zone) {
   if (!found) {			/* negative result */
     addrr_soa(pkt, zone, 1);	/* add SOA if any to AUTHORITY */
     h[p_f2] = DNS_R_NXDOMAIN;
-    do_stats(zone->z_stats.q_nxd += 1);
+    do_stats(zs.q_nxd += 1);
   }
   else {
     if (!h[p_ancnt2]) {	/* positive reply, no answers */
       addrr_soa(pkt, zone, 1);	/* add SOA if any to AUTHORITY */
     }
-    else if (zone->z_nns &&
-             /* (!(qi.qi_tflag & NSQUERY_NS) || qi.qi_dnlab) && */
-             !lazy)
+    else if (/* (!(qi.qi_tflag & NSQUERY_NS) || qi.qi_dnlab) && */ !lazy)
       addrr_ns(pkt, zone, 1); /* add nameserver records to positive reply */
-    do_stats(zone->z_stats.q_ok += 1);
+    do_stats(zs.q_ok += 1);
   }
   (void)call_hook(query_result, (pkt->p_peer, zone, &qi, found));
-  if (rlen() > DNS_MAXPACKET) {	/* add OPT record for long replies */
+  if (rlen() > DNS_MAXPACKET && !pkt->p_tcpsz) {
+    /* add OPT record for long replies */
     /* as per parsequery(), we always have 11 bytes for minimal OPT record at
      * the end of our reply packet, OR rlen() does not exceed DNS_MAXPACKET */
     h[p_arcnt2] += 1;		/* arcnt is limited to 254 records */
@@ -450,18 +674,25 @@ int replypacket(struct dnspacket *pkt, unsigned qlen, struct zone *zone) {
     pkt->p_cur = h;
     h = pkt->p_buf;		/* restore for rlen() to work */
   }
-  do_stats(zone->z_stats.b_out += rlen());
+  /* replies which depend on the requestor or rotate RRs aren't cached */
+  if (rcsize && rlen() <= DNS_MAXPACKET && !(found & NSQUERY_ADDPEER) &&
+      pkt->p_crr == crr && !hooked())
+    rc_add(pkt, &qry, rchash, rcsize, gacl, zacl, zone, !found);
+  do_stats(zs.b_out += rlen());
   return rlen();
 
 err_nz:
-  do_stats(gstats.q_err += 1; gstats.b_in += qlen; gstats.b_out += rlen());
+  do_stats(gs.q_err += 1; gs.b_in += qlen; gs.b_out += rlen());
   return rlen();
 
 err_z:
-  do_stats(zone->z_stats.q_err += 1; zone->z_stats.b_out += rlen());
+  do_stats(zs.q_err += 1; zs.b_out += rlen());
   return rlen();
 }
 
+#undef gs
+#undef zs
+
 #define fit(pkt, c, bytes) ((c) + (bytes) <= (pkt)->p_endp)
 
 
@@ -587,15 +818,19 @@ dnc_final(struct dnspacket *pkt,
   unsigned pos;
   if (!fit(pkt, pkt->p_cur, dsize))
     return 0;
-  /* first, adjust offsets - in cached data anyway */
+  /* compression pointers can only reach first 16Kb of a (TCP) packet */
+  if (pkt->p_cur + dsize - pkt->p_buf > 0x3fff)
+    return 0;
+  /* copy the RRs into answer packet */
+  memcpy(pkt->p_cur, data, dsize);
+  /* and adjust offsets in the copy: cached data is shared between
+   * threads, so it must not be modified here */
   while(jump < jend) {
     /* jump to either query section or this very RRs */
     pos = jump->off + (jump->off < 0 ? qoff : coff);
-    PACK16(jump->pos, pos);
+    PACK16(pkt->p_cur + (jump->pos - data), pos);
     ++jump;
   }
-  /* and finally, copy the RRs into answer packet */
-  memcpy(pkt->p_cur, data, dsize);
   pkt->p_cur += dsize;
   return 1;
 }
@@ -610,7 +845,7 @@ struct zonesoa {	/* cached SOA RR */
   unsigned char data[CACHEBUF_SIZE];
 };
 
-struct zonens {		/* cached NS RRs */
+struct zonensv {	/* one variant of NS RRs ordering */
   unsigned nssize;			/* size of all NS RRs */
   unsigned tsize;			/* size of NS+glue recs */
   struct dnjump jump[MAX_NS*2+MAX_GLUE];/* jumps: for qDNs and for NSes */
@@ -619,6 +854,19 @@ struct zonens {		/* cached NS RRs */
   unsigned char data[CACHEBUF_SIZE];
 };
 
+struct zonens {		/* cached NS RRs */
+  unsigned nns;				/* number of NSes, 0 if none */
+  unsigned nglue;			/* number of glue records */
+  /* for NS RRs, we keep MAX_NS caches:
+   * each stores one variant of NS rotation */
+  struct zonensv v[MAX_NS];
+};
+
+/* SOA and NS caches are rebuilt on every reload while queries may use
+ * them, so there are two of each: the new one is built in the spare
+ * and then swapped with the current one.  The old one is not reused
+ * before the next reload, when no query can refer to it anymore. */
+
 void init_zones_caches(struct zone *zonelist) {
   while(zonelist) {
     if (!zonelist->z_dsl) {
@@ -626,27 +874,22 @@ void init_zones_caches(struct zone *zonelist) {
       dns_dntop(zonelist->z_dn, name, sizeof(name));
       error(0, "missing data for zone `%s'", name);
     }
-    zonelist->z_zsoa = tmalloc(struct zonesoa);
-    /* for NS RRs, we allocate MAX_NS caches:
-     * each stores one variant of NS rotation */
-    zonelist->z_zns = (struct zonens *)emalloc(sizeof(struct zonens) * MAX_NS);
+    zonelist->z_zsoa = tzalloc(struct zonesoa);
+    zonelist->z_zsoa_spare = tzalloc(struct zonesoa);
+    zonelist->z_zns = tzalloc(struct zonens);
+    zonelist->z_zns_spare = tzalloc(struct zonens);
     zonelist = zonelist->z_next;
   }
 }
 
-/* update SOA RR cache */
-
-int update_zone_soa(struct zone *zone, const struct dssoa *dssoa) {
-   struct zonesoa *zsoa;
+static int
+fill_zone_soa(struct zonesoa *zsoa, const struct zone *zone,
+              const struct dssoa *dssoa) {
    unsigned char *cpos;
    struct dncompr compr;
    unsigned t;
    unsigned char *sizep;
 
-   zsoa = zone->z_zsoa;
-   zsoa->size = 0;
-   if (!(zone->z_dssoa = dssoa)) return 1;
-
    cpos = dnc_init(&compr, zsoa->data, sizeof(zsoa->data),
                    zsoa->jump, zone->z_dn);
 
@@ -672,17 +915,35 @@ int update_zone_soa(struct zone *zone, const struct dssoa *dssoa) {
    return 1;
 }
 
+/* update SOA RR cache */
+
+int update_zone_soa(struct zone *zone, const struct dssoa *dssoa) {
+  struct zonesoa *zsoa = zone->z_zsoa_spare;
+  int r = 1;
+
+  zsoa->size = 0;
+  if (dssoa)
+    r = fill_zone_soa(zsoa, zone, dssoa);
+  zone->z_dssoa = dssoa;
+  zone->z_zsoa_spare = zone->z_zsoa;
+  rcu_assign(zone->z_zsoa, zsoa);
+
+  return r;
+}
+
 static int addrr_soa(struct dnspacket *pkt, const struct zone *zone, int auth) {
-  const struct zonesoa *zsoa = zone->z_zsoa;
+  const struct zonesoa *zsoa = rcu_deref(zone->z_zsoa);
   unsigned char *c = pkt->p_cur;
-  if (!zone->z_dssoa || !zsoa->size) {
+  if (!zsoa->size) {
     if (!auth)
       setnonauth(pkt->p_buf);
     return 0;
   }
   if (!dnc_final(pkt, zsoa->data, zsoa->size, zsoa->jump, zsoa->jend)) {
-    if (!auth)
+    if (!auth) {
       setnonauth(pkt->p_buf); /* non-auth answer as we can't fit the record */
+      settrunc(pkt);
+    }
     return 0;
   }
   /* for AUTHORITY section for NXDOMAIN etc replies, use minttl as TTL */
@@ -733,6 +994,7 @@ find_glue(struct zone *zone, const unsigned char *nsdn,
 int update_zone_ns(struct zone *zone, const struct dsns *dsns, unsigned ttl,
                    const struct zone *zonelist) {
   struct zonens *zns;
+  struct zonensv *znsv;
   unsigned char *cpos, *sizep;
   struct dncompr compr;
   unsigned size, i, ns, nns;
@@ -740,9 +1002,13 @@ int update_zone_ns(struct zone *zone, const struct dsns *dsns, unsigned ttl,
   const unsigned char *dn;
   unsigned char *nsrrs[MAX_NS], *nsrre[MAX_NS];
   unsigned nglue;
+  int r = 0;
   struct dnspacket pkt;
+  unsigned char pbuf[DNS_EDNS0_MAXPACKET];
 
   memset(&pkt, 0, sizeof(pkt));
+  memset(pbuf, 0, p_hdrsize);	/* find_glue() counts glue RRs there */
+  pkt.p_buf = pbuf;
   pkt.p_sans = pkt.p_cur = pkt.p_buf + p_hdrsize;
   pkt.p_endp = pkt.p_buf + CACHEBUF_SIZE + p_hdrsize;
 
@@ -767,35 +1033,36 @@ int update_zone_ns(struct zone *zone, const struct dsns *dsns, unsigned ttl,
   if (pkt.p_buf[p_ancnt1] || nglue > 254)	/* too many glue recs */
     return 0;
   /* check if we have enouth dnjump slots */
-  if (nns * 2 + nglue > sizeof(zns->jump)/sizeof(zns->jump[0]))
+  if (nns * 2 + nglue > sizeof(znsv->jump)/sizeof(znsv->jump[0]))
     return 0;
 
   memcpy(zone->z_nsdna, nsdna, nns * sizeof(nsdna[0]));
   memset(nsdna + nns, 0, (MAX_NS - nns) * sizeof(nsdna[0]));
   zone->z_nns = 0;	/* for now, in case of error return */
   zone->z_nsttl = ttl;
+  zns = zone->z_zns_spare;
+  zns->nns = 0;
 
-  /* fill up nns variants of NS RRs ordering:
-   * zns is actually an array, not single structure */
+  /* fill up nns variants of NS RRs ordering */
   ns = 0;
-  zns = zone->z_zns;
+  znsv = zns->v;
   for(;;) {
-    cpos = dnc_init(&compr, zns->data, sizeof(zns->data),
-                    zns->jump, zone->z_dn);
+    cpos = dnc_init(&compr, znsv->data, sizeof(znsv->data),
+                    znsv->jump, zone->z_dn);
 
     for(i = 0; i < nns; ++i) {
       cpos = dnc_add(&compr, cpos, zone->z_dn);
-      if (!cpos || cpos + 10 > compr.bend) return 0;
+      if (!cpos || cpos + 10 > compr.bend) goto publish;
       PACK16S(cpos, DNS_T_NS);
       PACK16S(cpos, DNS_C_IN);
       PACK32S(cpos, ttl);
       sizep = cpos; cpos += 2;
       cpos = dnc_add(&compr, cpos, nsdna[i]);
-      if (!cpos) return 0;
+      if (!cpos) goto publish;
       size = cpos - sizep - 2;
       PACK16(sizep, size);
     }
-    dnc_finish(&compr, cpos, &zns->nssize, &zns->nsjend);
+    dnc_finish(&compr, cpos, &znsv->nssize, &znsv->nsjend);
 
     if (nglue)
       for(i = 0; i < nns; ++i)
@@ -804,11 +1071,11 @@ int update_zone_ns(struct zone *zone, const struct dsns *dsns, unsigned ttl,
           dn += 2;
           size = 10 + dn[2+2+4+1];
           cpos = dnc_add(&compr, cpos, zone->z_nsdna[i]);
-          if (!cpos || cpos + size > compr.bend) return 0;
+          if (!cpos || cpos + size > compr.bend) goto publish;
           memcpy(cpos, dn, size);
           dn += size; cpos += size;
         }
-    dnc_finish(&compr, cpos, &zns->tsize, &zns->tjend);
+    dnc_finish(&compr, cpos, &znsv->tsize, &znsv->tjend);
 
     if (++ns >= nns) break;
 
@@ -816,40 +1083,45 @@ int update_zone_ns(struct zone *zone, const struct dsns *dsns, unsigned ttl,
     dn = nsdna[0];
     memmove(nsdna, nsdna + 1, (nns - 1) * sizeof(nsdna[0]));
     nsdna[nns - 1] = dn;
-    ++zns;
+    ++znsv;
 
   }
-  zone->z_nns = nns;
-  zone->z_nglue = nglue;
-
-  return 1;
+  zns->nns = zone->z_nns = nns;
+  zns->nglue = nglue;
+  r = 1;
+
+publish:
+  zone->z_zns_spare = zone->z_zns;
+  rcu_assign(zone->z_zns, zns);
+  return r;
 }
 
 static int addrr_ns(struct dnspacket *pkt, const struct zone *zone, int auth) {
-  unsigned cns = zone->z_cns;
-  const struct zonens *zns = zone->z_zns + cns;
-  if (!zone->z_nns)
+  const struct zonens *zns = rcu_deref(zone->z_zns);
+  const struct zonensv *znsv;
+  if (!zns->nns)
     return 0;
+  /* pick up next variation of NS ordering */
+  znsv = zns->v + pkt->p_cns++ % zns->nns;
   /* if auth=1, we're adding last records (except maybe EDNS0 OPT),
    * so it's ok to fill in both AUTH and ADDITIONAL sections. */
   /* If we can't fit both NS and glue recs, try NS only, omitting glue.
    * For auth=0, don't add glue records at all.  */
-  if (auth && dnc_final(pkt, zns->data, zns->tsize, zns->jump, zns->tjend)) {
-    pkt->p_buf[p_nscnt2] += zone->z_nns;
-    pkt->p_buf[p_arcnt2] += zone->z_nglue;
+  if (auth &&
+      dnc_final(pkt, znsv->data, znsv->tsize, znsv->jump, znsv->tjend)) {
+    pkt->p_buf[p_nscnt2] += zns->nns;
+    pkt->p_buf[p_arcnt2] += zns->nglue;
   }
-  else if (!dnc_final(pkt, zns->data, zns->nssize, zns->jump, zns->nsjend))
+  else if (!dnc_final(pkt, znsv->data, znsv->nssize, znsv->jump, znsv->nsjend)) {
+    if (!auth)
+      settrunc(pkt);
     return 0;
+  }
   else
     /* we can't overflow p_ancnt2 (255 max) because addrr_ns(auth=0)
      * is called before all other answers will be collected,
-     * and MAX_NS (zone->z_nns) is definitely less than 255 */
-    pkt->p_buf[auth ? p_nscnt2 : p_ancnt2] += zone->z_nns;
-  /* pick up next variation of NS ordering */
-  ++cns;
-  if (cns >= zone->z_nns)
-    cns = 0;
-  ((struct zone *)zone)->z_cns = cns;
+     * and MAX_NS (zns->nns) is definitely less than 255 */
+    pkt->p_buf[auth ? p_nscnt2 : p_ancnt2] += zns->nns;
   return 1;
 }
 
@@ -910,19 +1182,79 @@ checkrr_present(register unsigned char *c, register unsigned char *e,
 #undef rrTTL
 }
 
+/* the same as checkrr_present() but using the index, in O(1).
+ * Remembers where the new RR should go for rridx_add() */
+static unsigned
+rridx_check(struct rridx *ri, const unsigned char *sans,
+            unsigned dtp, const void *data, unsigned dsz, unsigned ttl) {
+  unsigned s = bloom_hash(data, dsz, dtp) & (RRIDX_SIZE - 1);
+  unsigned t, i;
+  const unsigned char *c;
+
+  for(t = 0; t < ri->ri_ntp && ri->ri_tps[t].tp_type != dtp; ++t)
+    ;
+  ri->ri_tp = t;
+
+  if (t < ri->ri_ntp) {
+    if (ttl < ri->ri_tps[t].tp_ttl) {
+      /* change TTLs of existing RRs to new, smaller one, at the end */
+      ri->ri_tps[t].tp_ttl = ttl;
+      ri->ri_lowered = 1;
+    }
+    else /* use existing, smaller TTL for new RR */
+      ttl = ri->ri_tps[t].tp_ttl;
+  }
+
+  /* if we already have the same record, do nothing */
+  while((i = ri->ri_tab[s]) != 0) {
+    c = sans + ri->ri_rroff[i - 1];
+    if (c[2] == (dtp >> 8) && c[3] == (dtp & 255) &&
+        c[10] == (dsz >> 8) && c[11] == (dsz & 255) &&
+        memcmp(c + 12, data, dsz) == 0)
+      return 0;
+    s = (s + 1) & (RRIDX_SIZE - 1);
+  }
+  ri->ri_slot = s;
+
+  return ttl;
+}
+
+/* index the RR about to be added at offset off, after rridx_check() */
+static void
+rridx_add(struct rridx *ri, unsigned off, unsigned dtp, unsigned ttl) {
+  unsigned n = ri->ri_nrr++, t = ri->ri_tp;
+  ri->ri_rroff[n] = off;
+  ri->ri_rrslot[n] = ri->ri_slot;
+  ri->ri_rrtp[n] = t;
+  ri->ri_tab[ri->ri_slot] = n + 1;
+  if (t == ri->ri_ntp) {
+    ri->ri_tps[t].tp_type = dtp;
+    ri->ri_tps[t].tp_ttl = ttl;
+    ++ri->ri_ntp;
+  }
+}
+
 /* add a new record into answer, check for dups.
- * We just ignore any data that exceeds packet size */
+ * Data that exceeds packet size is ignored, with TC set for UDP */
 void addrr_any(struct dnspacket *pkt, unsigned dtp,
                const void *data, unsigned dsz,
                unsigned ttl) {
   register unsigned char *c = pkt->p_cur;
-  ttl = checkrr_present(pkt->p_sans, c, dtp, data, dsz, ttl);
+  struct rridx *ri = pkt->p_rridx;
+  if (ri)
+    ttl = rridx_check(ri, pkt->p_sans, dtp, data, dsz, ttl);
+  else
+    ttl = checkrr_present(pkt->p_sans, c, dtp, data, dsz, ttl);
   if (!ttl) return; /* if RR is already present, do nothing */
 
   if (!fit(pkt, c, 12 + dsz) || pkt->p_buf[p_ancnt2] == 255) {
     setnonauth(pkt->p_buf); /* non-auth answer as we can't fit the record */
+    if (pkt->p_buf[p_ancnt2] != 255)
+      settrunc(pkt);
     return;
   }
+  if (ri)
+    rridx_add(ri, c - pkt->p_sans, dtp, ttl);
   *c++ = 192; *c++ = p_hdrsize;	/* jump after header: query DN */
   PACK16S(c, dtp);
   PACK16S(c, DNS_C_IN);
@@ -940,12 +1272,10 @@ addrr_a_txt(struct dnspacket *pkt, unsigned qtflag,
   if (qtflag & NSQUERY_A)
     addrr_any(pkt, DNS_T_A, rr, 4, ds->ds_ttl);
   if (qtflag & NSQUERY_TXT) {
-    char sb[TXTBUFSIZ+1];
-    unsigned sl = txtsubst(sb + 1, rr + 4, subst, ds);
-    if (sl) {
-      sb[0] = sl;
-      addrr_any(pkt, DNS_T_TXT, sb, sl + 1, ds->ds_ttl);
-    }
+    unsigned char sb[TXTBUFSIZ+1];
+    const unsigned char *t = rrtxt_rdata(sb, rr, subst, ds);
+    if (t)
+      addrr_any(pkt, DNS_T_TXT, t, t[0] + 1, ds->ds_ttl);
   }
 }
 
@@ -981,17 +1311,10 @@ void logreply(const struct dnspacket *pkt, FILE *flog, int flushlog) {
   const unsigned char *const q = pkt->p_sans - 4;
 
   cp += sprintf(cp, "%lu ", (unsigned long)time(NULL));
-#ifndef NO_IPv6
-  if (getnameinfo(pkt->p_peer, pkt->p_peerlen,
-                  cp, NI_MAXHOST, NULL, 0,
-                  NI_NUMERICHOST) == 0)
+  if (peerntop(pkt, cp))
     cp += strlen(cp);
   else
     *cp++ = '?';
-#else
-  strcpy(cp, inet_ntoa(((struct sockaddr_in*)pkt->p_peer)->sin_addr));
-  cp += strlen(cp);
-#endif
   *cp++ = ' ';
   cp += dns_dntop(pkt->p_buf + p_hdrsize, cp, DNS_MAXDOMAIN);
   cp += sprintf(cp, " %s %s: %s/%u/%d\n",
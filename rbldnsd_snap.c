@@ -0,0 +1,446 @@
+/* Dataset snapshots (-Z option).
+ * After a dataset is loaded from its files, its finished data is written
+ * into a snapshot file in the snapshot directory.  When a dataset has no
+ * data loaded yet (on startup), it is read from its snapshot instead of
+ * the files if they did not change since, which needs no parsing and no
+ * sorting.
+ * A snapshot starts with a text line identifying the format, followed
+ * by lines with the build, the dataset and the settings it was made
+ * with (a snapshot is only used if they're all the same), the state of
+ * the data and delta files it was made from, the common dataset data
+ * (SOA, NS, TTL, substitution variables), and the type-specific data,
+ * written by the type's dssnap routines.  Values are stored in native
+ * byte order.  Strings (A+TXT RRs, domain names) are stored in a pool
+ * which comes before the data, and referred to by offsets in it.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include "rbldnsd.h"
+
+const char *snapdir;		/* directory for snapshots, NULL if none */
+
+#define SNAP_VERSION	2
+#define SNAP_ORDER	0x01020304u
+#define SNAP_END	0x70616e73u
+#define SNAP_IDENTSZ	1024
+#define SNAP_PATHSZ	1024
+
+struct snapstr {	/* string in the pool, when saving */
+  const void *s_p;
+  unsigned s_len;
+  unsigned s_off;
+};
+
+struct snap {	/* sn */
+  FILE *sn_f;
+  int sn_err;			/* i/o error or invalid data */
+  off_t sn_size;		/* size of the file, when loading */
+  struct snapstr *sn_str;	/* saving: strings, in pool order */
+  unsigned sn_nstr, sn_astr;
+  unsigned *sn_hash;		/* saving: index in sn_str + 1, by pointer */
+  unsigned sn_hmask;
+  const char *sn_pool;		/* loading: the pool */
+  unsigned sn_poolsz;
+};
+
+/* per-file state the snapshot was made from */
+struct snapfile {
+  time_t f_stamp, f_dstamp;
+  off_t f_size, f_dsize, f_doff, f_dfull;
+  unsigned long f_dseq;
+};
+
+static const struct dssnap *dssnap(const struct dataset *ds) {
+  if (isdstype(ds->ds_type, ip4set))
+    return &ds_ip4set_snap;
+  if (isdstype(ds->ds_type, dnset))
+    return &ds_dnset_snap;
+  return NULL;
+}
+
+static int snap_path(char *buf, const struct dataset *ds) {
+  unsigned h = bloom_hash((const unsigned char *)ds->ds_spec,
+                          strlen(ds->ds_spec), 0);
+  /* leave room for ".tmp" */
+  return ssprintf(buf, SNAP_PATHSZ, "%s/%s-%08x.snap", snapdir,
+                  ds->ds_type->dst_name, h) < SNAP_PATHSZ - 5;
+}
+
+static unsigned snap_ident(char *buf, const struct dataset *ds) {
+  return ssprintf(buf, SNAP_IDENTSZ,
+                  "rbldnsd snapshot %d\n"
+                  "%s\n"
+                  "%s:%.900s\n"
+                  "%u %u %u %u %u %u %d\n",
+                  SNAP_VERSION, version,
+                  ds->ds_type->dst_name, ds->ds_spec,
+                  (unsigned)sizeof(time_t), (unsigned)sizeof(off_t),
+                  (unsigned)sizeof(long),
+                  def_ttl, min_ttl, max_ttl, accept_in_cidr);
+}
+
+void snap_put(struct snap *sn, const void *p, unsigned len) {
+  if (len && fwrite(p, len, 1, sn->sn_f) != 1)
+    sn->sn_err = 1;
+}
+
+int snap_get(struct snap *sn, void *p, unsigned len) {
+  if (sn->sn_err || (len && fread(p, len, 1, sn->sn_f) != 1)) {
+    sn->sn_err = 1;
+    return 0;
+  }
+  return 1;
+}
+
+/* true if n elements of size sz may be in the file, to catch garbage
+ * counts before allocating memory for them */
+int snap_fits(struct snap *sn, unsigned n, unsigned sz) {
+  if ((off_t)n * sz > sn->sn_size)
+    sn->sn_err = 1;
+  return !sn->sn_err;
+}
+
+static void snap_putbuf(struct snap *sn, const void *p, unsigned len) {
+  snap_put(sn, &len, sizeof(len));
+  snap_put(sn, p, len);
+}
+
+/* read a buffer written by snap_putbuf() into mp, NULL if empty */
+static void *
+snap_getbuf(struct snap *sn, struct mempool *mp, unsigned *lenp,
+            unsigned maxlen) {
+  unsigned len;
+  void *p;
+  if (!snap_get(sn, &len, sizeof(len)) || len > maxlen) {
+    sn->sn_err = 1;
+    return NULL;
+  }
+  *lenp = len;
+  if (!len)
+    return NULL;
+  if (!(p = mp_alloc(mp, len, 0))) {
+    sn->sn_err = 1;
+    return NULL;
+  }
+  snap_get(sn, p, len);
+  return p;
+}
+
+/* read a domain name written by snap_putbuf() into mp */
+static const unsigned char *
+snap_getdn(struct snap *sn, struct mempool *mp, unsigned *lenp) {
+  const unsigned char *dn = snap_getbuf(sn, mp, lenp, DNS_MAXDN);
+  if (!dn || dn[*lenp - 1] != 0)
+    sn->sn_err = 1;
+  return dn;
+}
+
+static unsigned snap_phash(const void *p) {
+  unsigned long v = (unsigned long)p;
+  return bloom_hash32((unsigned)v ^ (unsigned)(v >> 16 >> 16));
+}
+
+/* add string p of len bytes to the pool, unless it's there already */
+int snap_pooladd(struct snap *sn, const void *p, unsigned len) {
+  unsigned h, i;
+  struct snapstr *s;
+
+  if (!p || sn->sn_err)
+    return !sn->sn_err;
+  if (sn->sn_nstr * 2 >= sn->sn_hmask) {	/* grow the hash */
+    unsigned hmask = sn->sn_hmask ? sn->sn_hmask * 2 + 1 : 1023;
+    unsigned *hash = (unsigned *)calloc(hmask + 1, sizeof(unsigned));
+    if (!hash) {
+      sn->sn_err = 1;
+      return 0;
+    }
+    for(i = 0; i < sn->sn_nstr; ++i) {
+      h = snap_phash(sn->sn_str[i].s_p) & hmask;
+      while(hash[h])
+        h = (h + 1) & hmask;
+      hash[h] = i + 1;
+    }
+    free(sn->sn_hash);
+    sn->sn_hash = hash;
+    sn->sn_hmask = hmask;
+  }
+  for(h = snap_phash(p) & sn->sn_hmask; (i = sn->sn_hash[h]) != 0;
+      h = (h + 1) & sn->sn_hmask)
+    if (sn->sn_str[i-1].s_p == p)
+      return 1;
+  if (sn->sn_nstr >= sn->sn_astr) {
+    unsigned a = sn->sn_astr ? sn->sn_astr * 2 : 1024;
+    s = (struct snapstr *)realloc(sn->sn_str, a * sizeof(*s));
+    if (!s) {
+      sn->sn_err = 1;
+      return 0;
+    }
+    sn->sn_str = s;
+    sn->sn_astr = a;
+  }
+  if (sn->sn_poolsz + len < sn->sn_poolsz) {	/* 4Gb of strings */
+    sn->sn_err = 1;
+    return 0;
+  }
+  s = &sn->sn_str[sn->sn_nstr++];
+  s->s_p = p;
+  s->s_len = len;
+  s->s_off = sn->sn_poolsz;
+  sn->sn_poolsz += len;
+  sn->sn_hash[h] = sn->sn_nstr;
+  return 1;
+}
+
+/* write out the pool, after all strings are added */
+void snap_putpool(struct snap *sn) {
+  unsigned i;
+  snap_put(sn, &sn->sn_poolsz, sizeof(sn->sn_poolsz));
+  for(i = 0; i < sn->sn_nstr; ++i)
+    snap_put(sn, sn->sn_str[i].s_p, sn->sn_str[i].s_len);
+}
+
+/* reference to a string in the pool: its offset + 1, or 0 for NULL */
+unsigned snap_ref(struct snap *sn, const void *p) {
+  unsigned h, i;
+  if (!p)
+    return 0;
+  for(h = snap_phash(p) & sn->sn_hmask; (i = sn->sn_hash[h]) != 0;
+      h = (h + 1) & sn->sn_hmask)
+    if (sn->sn_str[i-1].s_p == p)
+      return sn->sn_str[i-1].s_off + 1;
+  sn->sn_err = 1;		/* not added */
+  return 0;
+}
+
+/* read the pool into mp.  Every string in it ends with a null byte
+ * (TXT RRs and domain names alike), and so does the pool */
+int snap_getpool(struct snap *sn, struct mempool *mp) {
+  char *pool;
+  if (!snap_get(sn, &sn->sn_poolsz, sizeof(sn->sn_poolsz)) ||
+      !snap_fits(sn, sn->sn_poolsz, 1))
+    return 0;
+  if (!sn->sn_poolsz)
+    return 1;
+  if (!(pool = (char *)mp_alloc(mp, sn->sn_poolsz, 0))) {
+    sn->sn_err = 1;
+    return 0;
+  }
+  if (!snap_get(sn, pool, sn->sn_poolsz))
+    return 0;
+  if (pool[sn->sn_poolsz - 1] != '\0')
+    sn->sn_err = 1;
+  sn->sn_pool = pool;
+  return !sn->sn_err;
+}
+
+/* pointer to a string in the pool, which should have at least len
+ * bytes left after it.  NULL if ref is 0, or invalid */
+const void *snap_ptr(struct snap *sn, unsigned ref, unsigned len) {
+  if (!ref)
+    return NULL;
+  if (ref - 1 >= sn->sn_poolsz || sn->sn_poolsz - (ref - 1) < len) {
+    sn->sn_err = 1;
+    return NULL;
+  }
+  return sn->sn_pool + ref - 1;
+}
+
+static void snap_free(struct snap *sn) {
+  free(sn->sn_str);
+  free(sn->sn_hash);
+}
+
+/* write the dataset after it has been loaded from its files */
+void snap_save(const struct dataset *ds, struct dsctx *dsc) {
+  const struct dssnap *ss = dssnap(ds);
+  char path[SNAP_PATHSZ], tmp[SNAP_PATHSZ], ident[SNAP_IDENTSZ];
+  struct snapfile sf;
+  const struct dsfile *dsf;
+  const struct dsns *dsns;
+  struct snap sn;
+  unsigned v, i;
+
+  if (!snapdir || !ss || !ds->ds_stamp)
+    return;
+  if (!snap_path(path, ds)) {
+    dslog(LOG_WARNING, dsc, "snapshot file name is too long");
+    return;
+  }
+  strcat(strcpy(tmp, path), ".tmp");
+  memset(&sn, 0, sizeof(sn));
+  if (!(sn.sn_f = fopen(tmp, "w"))) {
+    dslog(LOG_WARNING, dsc, "unable to write snapshot %s: %s",
+          tmp, strerror(errno));
+    return;
+  }
+
+  snap_put(&sn, ident, snap_ident(ident, ds));
+  v = SNAP_ORDER;
+  snap_put(&sn, &v, sizeof(v));
+  for(v = 0, dsf = ds->ds_dsf; dsf; dsf = dsf->dsf_next)
+    ++v;
+  snap_put(&sn, &v, sizeof(v));
+  for(dsf = ds->ds_dsf; dsf; dsf = dsf->dsf_next) {
+    memset(&sf, 0, sizeof(sf));
+    sf.f_stamp = dsf->dsf_stamp;
+    sf.f_size = dsf->dsf_size;
+    sf.f_dstamp = dsf->dsf_dstamp;
+    sf.f_dsize = dsf->dsf_dsize;
+    sf.f_doff = dsf->dsf_doff;
+    sf.f_dfull = dsf->dsf_dfull;
+    sf.f_dseq = dsf->dsf_dseq;
+    snap_put(&sn, &sf, sizeof(sf));
+  }
+
+  snap_put(&sn, &ds->ds_expires, sizeof(ds->ds_expires));
+  snap_put(&sn, &ds->ds_ttl, sizeof(ds->ds_ttl));
+  snap_put(&sn, &ds->ds_nsttl, sizeof(ds->ds_nsttl));
+  v = ds->ds_dssoa != NULL;
+  snap_put(&sn, &v, sizeof(v));
+  if (ds->ds_dssoa) {
+    const struct dssoa *dssoa = ds->ds_dssoa;
+    snap_put(&sn, &dssoa->dssoa_ttl, sizeof(dssoa->dssoa_ttl));
+    snap_put(&sn, &dssoa->dssoa_serial, sizeof(dssoa->dssoa_serial));
+    snap_put(&sn, dssoa->dssoa_n, sizeof(dssoa->dssoa_n));
+    snap_putbuf(&sn, dssoa->dssoa_odn, dns_dnlen(dssoa->dssoa_odn));
+    snap_putbuf(&sn, dssoa->dssoa_pdn, dns_dnlen(dssoa->dssoa_pdn));
+  }
+  for(v = 0, dsns = ds->ds_dsns; dsns; dsns = dsns->dsns_next)
+    ++v;
+  snap_put(&sn, &v, sizeof(v));
+  for(dsns = ds->ds_dsns; dsns; dsns = dsns->dsns_next)
+    snap_putbuf(&sn, dsns->dsns_dn, dns_dnlen(dsns->dsns_dn));
+  for(i = 0; i < sizeof(ds->ds_subst) / sizeof(ds->ds_subst[0]); ++i)
+    snap_putbuf(&sn, ds->ds_subst[i],
+                ds->ds_subst[i] ? strlen(ds->ds_subst[i]) + 1 : 0);
+
+  if (ss->ss_savefn(ds, &sn)) {
+    v = SNAP_END;
+    snap_put(&sn, &v, sizeof(v));
+  }
+  else if (!sn.sn_err)
+    errno = ENOMEM, sn.sn_err = 1;
+  snap_free(&sn);
+  if (fclose(sn.sn_f) != 0)
+    sn.sn_err = 1;
+  if (sn.sn_err || rename(tmp, path) < 0) {
+    dslog(LOG_WARNING, dsc, "unable to write snapshot %s: %s",
+          tmp, strerror(errno));
+    unlink(tmp);
+  }
+}
+
+/* read the dataset from its snapshot, if there's no data loaded for it
+ * yet and its files did not change since.  The state of its delta
+ * files is restored as it was when the snapshot was made, it's up to
+ * the caller to check them.  Returns 1 if loaded, 0 if there's no
+ * usable snapshot, or -1 if it failed and ds should be freed. */
+int snap_load(struct dataset *ds, struct dsctx *dsc) {
+  const struct dssnap *ss = dssnap(ds);
+  char path[SNAP_PATHSZ], ident[SNAP_IDENTSZ], buf[SNAP_IDENTSZ];
+  struct snapfile *sfv = NULL, *sf;
+  struct dsfile *dsf;
+  struct dsns **dsnsp;
+  struct stat st;
+  struct snap sn;
+  unsigned v, n, i, len;
+  int r = 0;
+
+  if (!snapdir || !ss || (ds->ds_prev && ds->ds_prev->ds_stamp) ||
+      !snap_path(path, ds))
+    return 0;
+  memset(&sn, 0, sizeof(sn));
+  if (!(sn.sn_f = fopen(path, "r"))) {
+    if (errno != ENOENT)
+      dslog(LOG_WARNING, dsc, "unable to read snapshot %s: %s",
+            path, strerror(errno));
+    return 0;
+  }
+  if (fstat(fileno(sn.sn_f), &st) < 0)
+    goto done;
+  sn.sn_size = st.st_size;
+
+  /* is it for this dataset, and up to date with its files */
+  n = snap_ident(ident, ds);
+  if (!snap_get(&sn, buf, n) || memcmp(buf, ident, n) != 0 ||
+      !snap_get(&sn, &v, sizeof(v)) || v != SNAP_ORDER ||
+      !snap_get(&sn, &n, sizeof(n)) || !snap_fits(&sn, n, sizeof(*sf)) ||
+      !(sfv = (struct snapfile *)malloc((n + 1) * sizeof(*sf))) ||
+      !snap_get(&sn, sfv, n * sizeof(*sf))) {
+    dslog(LOG_INFO, dsc, "snapshot %s is for different settings", path);
+    goto done;
+  }
+  for(dsf = ds->ds_dsf, sf = sfv; dsf && n; dsf = dsf->dsf_next, ++sf, --n)
+    if (stat(dsf->dsf_name, &st) < 0 ||
+        st.st_mtime != sf->f_stamp || st.st_size != sf->f_size)
+      break;
+  if (dsf || n) {
+    dslog(LOG_INFO, dsc, "snapshot %s is out of date", path);
+    goto done;
+  }
+
+  r = -1;
+  if (!snap_get(&sn, &ds->ds_expires, sizeof(ds->ds_expires)) ||
+      !snap_get(&sn, &ds->ds_ttl, sizeof(ds->ds_ttl)) ||
+      !snap_get(&sn, &ds->ds_nsttl, sizeof(ds->ds_nsttl)) ||
+      !snap_get(&sn, &v, sizeof(v)))
+    goto done;
+  if (v) {
+    struct dssoa *dssoa = mp_talloc(ds->ds_mp, struct dssoa);
+    if (!dssoa ||
+        !snap_get(&sn, &dssoa->dssoa_ttl, sizeof(dssoa->dssoa_ttl)) ||
+        !snap_get(&sn, &dssoa->dssoa_serial, sizeof(dssoa->dssoa_serial)) ||
+        !snap_get(&sn, dssoa->dssoa_n, sizeof(dssoa->dssoa_n)))
+      goto done;
+    dssoa->dssoa_odn = snap_getdn(&sn, ds->ds_mp, &len);
+    dssoa->dssoa_pdn = snap_getdn(&sn, ds->ds_mp, &len);
+    ds->ds_dssoa = dssoa;
+  }
+  if (!snap_get(&sn, &n, sizeof(n)) || n > DNS_MAXDN)
+    goto done;
+  for(dsnsp = &ds->ds_dsns; n--; dsnsp = &(*dsnsp)->dsns_next) {
+    unsigned char dn[DNS_MAXDN];
+    if (!snap_get(&sn, &len, sizeof(len)) || !len || len > DNS_MAXDN ||
+        !snap_get(&sn, dn, len) || dn[len - 1] != 0 ||
+        !(*dsnsp = (struct dsns *)
+            mp_alloc(ds->ds_mp, sizeof(struct dsns) + len - 1, 1)))
+      goto done;
+    memcpy((*dsnsp)->dsns_dn, dn, len);
+    (*dsnsp)->dsns_next = NULL;
+  }
+  for(i = 0; i < sizeof(ds->ds_subst) / sizeof(ds->ds_subst[0]); ++i) {
+    ds->ds_subst[i] = snap_getbuf(&sn, ds->ds_mp, &len, 65536);
+    if (ds->ds_subst[i] && ds->ds_subst[i][len - 1] != '\0')
+      sn.sn_err = 1;
+  }
+  if (sn.sn_err || !ss->ss_loadfn(ds, &sn) ||
+      !snap_get(&sn, &v, sizeof(v)) || v != SNAP_END ||
+      fread(&v, 1, 1, sn.sn_f) != 0) {
+    dslog(LOG_WARNING, dsc, "invalid snapshot %s", path);
+    goto done;
+  }
+
+  for(dsf = ds->ds_dsf, sf = sfv; dsf; dsf = dsf->dsf_next, ++sf) {
+    dsf->dsf_stamp = sf->f_stamp;
+    dsf->dsf_size = sf->f_size;
+    dsf->dsf_dstamp = sf->f_dstamp;
+    dsf->dsf_dsize = sf->f_dsize;
+    dsf->dsf_doff = sf->f_doff;
+    dsf->dsf_dfull = sf->f_dfull;
+    dsf->dsf_dseq = sf->f_dseq;
+  }
+  dslog(LOG_INFO, dsc, "loaded from snapshot %s", path);
+  r = 1;
+
+done:
+  snap_free(&sn);
+  free(sfv);
+  fclose(sn.sn_f);
+  return r;
+}
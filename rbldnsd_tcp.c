@@ -0,0 +1,315 @@
+/* DNS-over-TCP for rbldnsd (RFC 7766).
+ * A single thread serves all TCP connections using epoll.  Queries
+ * may be pipelined: every complete length-prefixed query in the input
+ * buffer of a connection is answered in order.  Replies are built in
+ * one large packet buffer and sent from there; whatever the socket does
+ * not accept right away is queued per connection, and no more queries
+ * are read from a connection until its queue is flushed.  Connections
+ * which are idle for too long are closed, and new connections above the
+ * limit are refused (closed right after accept).
+ */
+
+#include "rbldnsd.h"
+
+#ifndef NO_TCP
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define TCP_MAXQUERY	DNS_EDNS0_MAXPACKET	/* max query size we accept */
+#define TCP_MAXREPLY	65535		/* max reply size */
+#define TCP_NEVENTS	64		/* epoll events per wait */
+
+struct tconn {
+  int c_fd;
+  int c_listen;			/* this is a listening socket */
+  unsigned c_events;		/* epoll events we're waiting for */
+  int c_eof;			/* peer closed its side */
+  time_t c_atime;		/* time of last activity */
+  struct tconn *c_prev, *c_next;	/* list of connections, oldest first */
+  unsigned char *c_obuf;	/* queued reply data */
+  unsigned c_ooff, c_olen, c_osize;
+  unsigned c_ilen;		/* # of bytes in c_ibuf */
+  unsigned char c_ibuf[2 + TCP_MAXQUERY];
+  socklen_t c_peerlen;
+#ifndef NO_IPv6
+  struct sockaddr_storage c_peer;
+#else
+  struct sockaddr_in c_peer;
+#endif
+};
+
+struct tcpsrv {
+  int t_epfd;
+  unsigned t_maxconn;		/* max # of connections */
+  unsigned t_idle;		/* idle timeout, secs */
+  unsigned t_nconn;		/* current # of connections */
+  struct tconn *t_head, *t_tail;	/* connections, oldest first */
+  int t_nev;			/* # of events in t_ev */
+  struct epoll_event t_ev[TCP_NEVENTS];
+  struct dnspacket t_pkt;
+  unsigned char t_buf[2 + TCP_MAXREPLY];	/* length + t_pkt.p_buf */
+};
+
+static void unlink_conn(struct tcpsrv *t, struct tconn *c) {
+  if (c->c_prev) c->c_prev->c_next = c->c_next;
+  else t->t_head = c->c_next;
+  if (c->c_next) c->c_next->c_prev = c->c_prev;
+  else t->t_tail = c->c_prev;
+}
+
+static void link_conn(struct tcpsrv *t, struct tconn *c) {
+  c->c_next = NULL;
+  c->c_prev = t->t_tail;
+  if (t->t_tail) t->t_tail->c_next = c;
+  else t->t_head = c;
+  t->t_tail = c;
+}
+
+static void close_conn(struct tcpsrv *t, struct tconn *c) {
+  unlink_conn(t, c);
+  close(c->c_fd);		/* this removes it from epoll set too */
+  free(c->c_obuf);
+  free(c);
+  --t->t_nconn;
+}
+
+static int setevents(struct tcpsrv *t, struct tconn *c, unsigned events) {
+  struct epoll_event ev;
+  if (c->c_events == events)
+    return 1;
+  ev.events = events;
+  ev.data.ptr = c;
+  if (epoll_ctl(t->t_epfd, c->c_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                c->c_fd, &ev) < 0)
+    return 0;
+  c->c_events = events;
+  return 1;
+}
+
+static int nonblock(int fd) {
+  int fl = fcntl(fd, F_GETFL);
+  return fl < 0 ? fl : fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
+
+struct tcpsrv *tcp_new(const int *sock, int nsock,
+                       unsigned maxconn, unsigned idle) {
+  struct tcpsrv *t;
+  struct tconn *c;
+#ifndef NO_IPv6
+  struct sockaddr_storage sa;
+#else
+  struct sockaddr_in sa;
+#endif
+  socklen_t salen;
+  int i, fd, on = 1;
+
+  t = (struct tcpsrv *)calloc(1, sizeof(*t));
+  if (!t)
+    return errno = ENOMEM, NULL;
+  t->t_maxconn = maxconn;
+  t->t_idle = idle;
+  t->t_pkt.p_buf = t->t_buf + 2;
+  t->t_pkt.p_tcpsz = TCP_MAXREPLY;
+  if ((t->t_epfd = epoll_create(TCP_NEVENTS)) < 0) {
+    free(t);
+    return NULL;
+  }
+
+  /* listen on the same addresses as the UDP sockets */
+  for(i = 0; i < nsock; ++i) {
+    salen = sizeof(sa);
+    if (getsockname(sock[i], (struct sockaddr *)&sa, &salen) < 0)
+      return NULL;
+    fd = socket(((struct sockaddr *)&sa)->sa_family, SOCK_STREAM, 0);
+    if (fd < 0)
+      return NULL;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void*)&on, sizeof(on));
+    if (bind(fd, (struct sockaddr *)&sa, salen) < 0 ||
+        listen(fd, SOMAXCONN) < 0 || nonblock(fd) < 0 ||
+        !(c = (struct tconn *)calloc(1, sizeof(*c))))
+      return NULL;
+    c->c_fd = fd;
+    c->c_listen = 1;
+    if (!setevents(t, c, EPOLLIN))
+      return NULL;
+  }
+  /* this happens at startup only, so there's no cleanup on errors */
+
+  return t;
+}
+
+/* wait for network events, no longer than until the oldest connection
+ * expires.  Returns <0 if interrupted. */
+int tcp_wait(struct tcpsrv *t) {
+  int timeout = -1;
+  if (t->t_head) {
+    long left = (long)(t->t_head->c_atime + t->t_idle - time(NULL));
+    timeout = left > 0 ? (int)left * 1000 : 0;
+  }
+  t->t_nev = epoll_wait(t->t_epfd, t->t_ev, TCP_NEVENTS, timeout);
+  return t->t_nev;
+}
+
+static void accept_conns(struct tcpsrv *t, int lfd, time_t now) {
+  struct tconn *c;
+  int fd;
+  for(;;) {
+    fd = accept(lfd, NULL, NULL);
+    if (fd < 0)
+      return;			/* EAGAIN or an error - nothing to do */
+    if (t->t_nconn >= t->t_maxconn || nonblock(fd) < 0 ||
+        !(c = (struct tconn *)calloc(1, sizeof(*c)))) {
+      close(fd);
+      continue;
+    }
+    c->c_fd = fd;
+    c->c_peerlen = sizeof(c->c_peer);
+    if (getpeername(fd, (struct sockaddr *)&c->c_peer, &c->c_peerlen) < 0 ||
+        !setevents(t, c, EPOLLIN)) {
+      close(fd);
+      free(c);
+      continue;
+    }
+    c->c_atime = now;
+    link_conn(t, c);
+    ++t->t_nconn;
+  }
+}
+
+/* send reply data, queueing whatever can't be sent right now */
+static int sendreply(struct tconn *c, const unsigned char *buf, unsigned len) {
+  int n;
+  if (!c->c_olen) {
+    n = send(c->c_fd, buf, len, MSG_NOSIGNAL|MSG_DONTWAIT);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        return 0;
+      n = 0;
+    }
+    if ((unsigned)n == len)
+      return 1;
+    buf += n; len -= n;
+    c->c_ooff = 0;
+  }
+  else if (c->c_ooff) {
+    memmove(c->c_obuf, c->c_obuf + c->c_ooff, c->c_olen);
+    c->c_ooff = 0;
+  }
+  if (c->c_olen + len > c->c_osize) {
+    unsigned char *b = (unsigned char *)realloc(c->c_obuf, c->c_olen + len);
+    if (!b)
+      return 0;
+    c->c_obuf = b;
+    c->c_osize = c->c_olen + len;
+  }
+  memcpy(c->c_obuf + c->c_olen, buf, len);
+  c->c_olen += len;
+  return 1;
+}
+
+static int flush_conn(struct tconn *c) {
+  int n = send(c->c_fd, c->c_obuf + c->c_ooff, c->c_olen,
+               MSG_NOSIGNAL|MSG_DONTWAIT);
+  if (n < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  c->c_ooff += n;
+  c->c_olen -= n;
+  return 1;
+}
+
+/* handle an event on a connection.  Returns 0 if it should be closed */
+static int
+serve_conn(struct tcpsrv *t, struct tconn *c,
+           unsigned (*query)(void *arg, struct dnspacket *pkt, unsigned qlen),
+           void *arg) {
+  unsigned char *q;
+  unsigned qlen, r;
+  int n;
+
+  if (c->c_olen && !flush_conn(c))
+    return 0;
+
+  /* the buffer may be full of queries left from the last time, and a
+   * read of 0 bytes would look like EOF then */
+  if (!c->c_olen && !c->c_eof && c->c_ilen < sizeof(c->c_ibuf)) {
+    n = read(c->c_fd, c->c_ibuf + c->c_ilen, sizeof(c->c_ibuf) - c->c_ilen);
+    if (n > 0)
+      c->c_ilen += n;
+    else if (n == 0)
+      c->c_eof = 1;
+    else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      return 0;
+  }
+
+  /* answer all complete queries, in order */
+  q = c->c_ibuf;
+  while(!c->c_olen && c->c_ibuf + c->c_ilen - q >= 2) {
+    qlen = ((unsigned)q[0] << 8) | q[1];
+    if (!qlen || qlen > TCP_MAXQUERY)
+      return 0;
+    if (c->c_ibuf + c->c_ilen - q < 2 + (int)qlen)
+      break;
+    memcpy(t->t_pkt.p_buf, q + 2, qlen);
+    q += 2 + qlen;
+    t->t_pkt.p_peer = (struct sockaddr *)&c->c_peer;
+    t->t_pkt.p_peerlen = c->c_peerlen;
+    r = query(arg, &t->t_pkt, qlen);
+    if (!r)
+      continue;
+    t->t_buf[0] = r >> 8;
+    t->t_buf[1] = r;
+    if (!sendreply(c, t->t_buf, r + 2))
+      return 0;
+  }
+  if (q != c->c_ibuf) {
+    c->c_ilen -= q - c->c_ibuf;
+    memmove(c->c_ibuf, q, c->c_ilen);
+  }
+
+  if (c->c_olen)
+    return setevents(t, c, EPOLLOUT);
+  if (c->c_eof)
+    return 0;			/* all answered */
+  return setevents(t, c, EPOLLIN);
+}
+
+/* process events returned by tcp_wait(), calling query() for every
+ * complete query received and sending its reply if query() returns
+ * non-zero, and close idle connections */
+void
+tcp_process(struct tcpsrv *t,
+            unsigned (*query)(void *arg, struct dnspacket *pkt,
+                              unsigned qlen),
+            void *arg) {
+  time_t now = time(NULL);
+  struct tconn *c;
+  int i;
+
+  for(i = 0; i < t->t_nev; ++i) {
+    c = (struct tconn *)t->t_ev[i].data.ptr;
+    if (c->c_listen)
+      accept_conns(t, c->c_fd, now);
+    else if (!serve_conn(t, c, query, arg))
+      close_conn(t, c);
+    else {			/* move to the end of the list */
+      c->c_atime = now;
+      unlink_conn(t, c);
+      link_conn(t, c);
+    }
+  }
+  t->t_nev = 0;
+
+  while((c = t->t_head) != NULL && c->c_atime + (time_t)t->t_idle <= now)
+    close_conn(t, c);
+}
+
+#endif /* NO_TCP */
@@ -0,0 +1,300 @@
+/* io_uring-based network I/O for rbldnsd, using raw system calls.
+ * Every socket has a multishot recvmsg request posted, which receives
+ * packets into buffers from a provided buffer ring.  In each buffer the
+ * packet data follows the recvmsg header and peer address and serves as
+ * p_buf of the slot's struct dnspacket, so queries are answered in place
+ * and sent back from the same buffer.  The buffer is returned to the ring
+ * when the send completes.
+ */
+
+#include "rbldnsd.h"
+
+#ifndef NO_IO_URING
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+
+#define URING_NBUFS	256	/* # of packet buffers, power of 2 */
+#define URING_BGID	0	/* buffer group id */
+
+/* user_data of SQEs: operation and socket index or buffer id */
+#define UD_RECV	0x10000u
+#define UD_SEND	0x20000u
+#define UD_MASK	0x0ffffu
+
+struct uslot {
+  /* struct io_uring_recvmsg_out and the peer address, filled by kernel */
+  unsigned char us_hdr[sizeof(struct io_uring_recvmsg_out) +
+                       sizeof(struct sockaddr_storage)];
+  unsigned char us_buf[DNS_EDNS0_MAXPACKET];	/* payload, us_pkt.p_buf */
+  struct dnspacket us_pkt;
+  struct msghdr us_msg;		/* for sending the reply */
+  struct iovec us_iov;
+};
+
+struct uring {
+  int u_fd;
+  /* submission queue */
+  unsigned *u_sqhead, *u_sqtail, *u_sqarray, u_sqmask, u_sqlocal;
+  struct io_uring_sqe *u_sqes;
+  /* completion queue */
+  unsigned *u_cqhead, *u_cqtail, u_cqmask;
+  struct io_uring_cqe *u_cqes;
+  /* provided buffers */
+  struct io_uring_buf_ring *u_br;
+  unsigned short u_brtail;
+  struct uslot *u_slots;
+  /* sockets */
+  int u_nsock;
+  const int *u_sock;
+  unsigned char *u_rearm;	/* sockets whose recvmsg needs reposting */
+  struct msghdr u_rmsg;		/* recvmsg template */
+};
+
+#define load_acquire(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p,v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int sys_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                           unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                      flags, NULL, 0);
+}
+
+static int sys_uring_register(int fd, unsigned op, void *arg, unsigned n) {
+  return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+static struct io_uring_sqe *getsqe(struct uring *u) {
+  /* the SQ is large enough to hold all requests we can ever have in
+   * flight (one per buffer plus one per socket), so it never overflows */
+  struct io_uring_sqe *sqe = &u->u_sqes[u->u_sqlocal & u->u_sqmask];
+  memset(sqe, 0, sizeof(*sqe));
+  ++u->u_sqlocal;
+  return sqe;
+}
+
+static void post_recv(struct uring *u, int i) {
+  struct io_uring_sqe *sqe = getsqe(u);
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = u->u_sock[i];
+  sqe->addr = (unsigned long)&u->u_rmsg;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  sqe->user_data = UD_RECV | i;
+  u->u_rearm[i] = 0;
+}
+
+static void post_send(struct uring *u, int i, unsigned bid, unsigned len) {
+  struct uslot *us = &u->u_slots[bid];
+  const struct io_uring_recvmsg_out *o =
+    (const struct io_uring_recvmsg_out *)us->us_hdr;
+  struct io_uring_sqe *sqe = getsqe(u);
+  us->us_iov.iov_base = us->us_pkt.p_buf;
+  us->us_iov.iov_len = len;
+  memset(&us->us_msg, 0, sizeof(us->us_msg));
+  us->us_msg.msg_name = (void *)(o + 1);
+  us->us_msg.msg_namelen = o->namelen;
+  us->us_msg.msg_iov = &us->us_iov;
+  us->us_msg.msg_iovlen = 1;
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = u->u_sock[i];
+  sqe->addr = (unsigned long)&us->us_msg;
+  sqe->len = 1;
+  sqe->user_data = UD_SEND | bid;
+}
+
+/* give a buffer back to the kernel; made visible by publish_bufs() */
+static void recycle(struct uring *u, unsigned bid) {
+  struct io_uring_buf *b = &u->u_br->bufs[u->u_brtail & (URING_NBUFS - 1)];
+  b->addr = (unsigned long)u->u_slots[bid].us_hdr;
+  b->len = sizeof(u->u_slots[bid].us_hdr) + DNS_EDNS0_MAXPACKET;
+  b->bid = bid;
+  ++u->u_brtail;
+}
+
+static void publish_bufs(struct uring *u) {
+  store_release(&u->u_br->tail, u->u_brtail);
+}
+
+struct uring *uring_new(const int *sock, int nsock) {
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  struct uring *u;
+  size_t sqsz, cqsz;
+  char *sq;
+  unsigned entries, i;
+  int fd;
+
+  /* packet payload must start exactly at the end of us_hdr */
+  if (offsetof(struct uslot, us_buf) != sizeof(((struct uslot *)0)->us_hdr))
+    return errno = EINVAL, NULL;
+
+  for(entries = 1; entries < URING_NBUFS + (unsigned)nsock; entries <<= 1)
+    ;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+  fd = sys_uring_setup(entries, &p);
+  if (fd < 0 && errno == EINVAL) {	/* older kernel */
+    memset(&p, 0, sizeof(p));
+    fd = sys_uring_setup(entries, &p);
+  }
+  if (fd < 0)
+    return NULL;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_NODROP)) {
+    close(fd);
+    return errno = ENOSYS, NULL;
+  }
+
+  u = (struct uring *)calloc(1, sizeof(*u));
+  if (!u) {
+    close(fd);
+    return errno = ENOMEM, NULL;
+  }
+  u->u_fd = fd;
+
+  sqsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  sq = mmap(NULL, sqsz > cqsz ? sqsz : cqsz, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED)
+    goto fail;
+  u->u_sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                   fd, IORING_OFF_SQES);
+  if (u->u_sqes == MAP_FAILED)
+    goto fail;
+  u->u_sqhead = (unsigned *)(sq + p.sq_off.head);
+  u->u_sqtail = (unsigned *)(sq + p.sq_off.tail);
+  u->u_sqarray = (unsigned *)(sq + p.sq_off.array);
+  u->u_sqmask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  u->u_sqlocal = *u->u_sqtail;
+  for(i = 0; i < p.sq_entries; ++i)
+    u->u_sqarray[i] = i;
+  u->u_cqhead = (unsigned *)(sq + p.cq_off.head);
+  u->u_cqtail = (unsigned *)(sq + p.cq_off.tail);
+  u->u_cqmask = *(unsigned *)(sq + p.cq_off.ring_mask);
+  u->u_cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+
+  /* buffer ring must be page-aligned */
+  u->u_br = mmap(NULL, URING_NBUFS * sizeof(struct io_uring_buf),
+                 PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (u->u_br == MAP_FAILED)
+    goto fail;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)u->u_br;
+  reg.ring_entries = URING_NBUFS;
+  reg.bgid = URING_BGID;
+  if (sys_uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    goto fail;
+
+  u->u_slots = (struct uslot *)calloc(URING_NBUFS, sizeof(struct uslot));
+  u->u_rearm = (unsigned char *)calloc(nsock, 1);
+  if (!u->u_slots || !u->u_rearm)
+    goto fail;
+  for(i = 0; i < URING_NBUFS; ++i) {
+    struct uslot *us = &u->u_slots[i];
+    us->us_pkt.p_buf = us->us_buf;
+    us->us_pkt.p_peer = (struct sockaddr *)
+      (us->us_hdr + sizeof(struct io_uring_recvmsg_out));
+    recycle(u, i);
+  }
+  publish_bufs(u);
+
+  /* kernel reserves msg_namelen bytes for the address in each buffer */
+  u->u_rmsg.msg_namelen = sizeof(struct sockaddr_storage);
+  u->u_sock = sock;
+  u->u_nsock = nsock;
+  for(i = 0; i < (unsigned)nsock; ++i)
+    post_recv(u, i);
+  store_release(u->u_sqtail, u->u_sqlocal);
+  return u;
+
+fail:
+  i = errno;
+  close(fd);	/* ring mappings are leaked, this happens once at most */
+  free(u->u_slots);
+  free(u->u_rearm);
+  free(u);
+  errno = i;
+  return NULL;
+}
+
+/* submit pending requests (replies) and wait for at least one completion.
+ * Returns <0 if interrupted by a signal. */
+int uring_wait(struct uring *u) {
+  unsigned pending = u->u_sqlocal - load_acquire(u->u_sqhead);
+  if (load_acquire(u->u_cqtail) != *u->u_cqhead)
+    return pending ? sys_uring_enter(u->u_fd, pending, 0, 0) : 0;
+  return sys_uring_enter(u->u_fd, pending, 1, IORING_ENTER_GETEVENTS);
+}
+
+/* process all completions, calling query() for every received packet
+ * and queueing a reply when it returns non-zero.  Returns the number of
+ * queries received. */
+unsigned
+uring_process(struct uring *u,
+              unsigned (*query)(void *arg, struct dnspacket *pkt,
+                                unsigned qlen),
+              void *arg) {
+  unsigned head = *u->u_cqhead, tail = load_acquire(u->u_cqtail);
+  unsigned nq = 0, bid, ud, r;
+  int i;
+
+  for(; head != tail; ++head) {
+    const struct io_uring_cqe *cqe = &u->u_cqes[head & u->u_cqmask];
+    ud = (unsigned)cqe->user_data;
+
+    if (ud & UD_SEND) {		/* reply sent (or not), reuse the buffer */
+      recycle(u, ud & UD_MASK);
+      continue;
+    }
+
+    i = ud & UD_MASK;
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+      u->u_rearm[i] = 1;	/* multishot request terminated */
+    if (!(cqe->flags & IORING_CQE_F_BUFFER))
+      continue;			/* error, e.g. ENOBUFS */
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (cqe->res >= 0) {
+      struct uslot *us = &u->u_slots[bid];
+      const struct io_uring_recvmsg_out *o =
+        (const struct io_uring_recvmsg_out *)us->us_hdr;
+      if (!(o->flags & MSG_TRUNC) && o->payloadlen <= DNS_EDNS0_MAXPACKET) {
+        ++nq;
+        us->us_pkt.p_peerlen = o->namelen;
+        r = query(arg, &us->us_pkt, o->payloadlen);
+        if (r) {
+          post_send(u, i, bid, r);
+          continue;
+        }
+      }
+    }
+    recycle(u, bid);
+  }
+  store_release(u->u_cqhead, head);
+  publish_bufs(u);
+
+  for(i = 0; i < u->u_nsock; ++i)
+    if (u->u_rearm[i])
+      post_recv(u, i);
+  store_release(u->u_sqtail, u->u_sqlocal);
+
+  return nq;
+}
+
+#endif /* NO_IO_URING */
@@ -162,7 +162,7 @@ char *parse_dn(char *s, unsigned char *dn, unsigned *dnlenp) {
 int parse_a_txt(char *str, const char **rrp, const char *def_rr,
                 struct dsctx *dsc) {
   char *rr;
-  static char rrbuf[4+256];	/*XXX static buffer */
+  static THREAD_LOCAL char rrbuf[4+256];	/*XXX static buffer */
   if (*str == ':') {
     ip4addr_t a;
     int bits = ip4addr(str + 1, &a, &str);
@@ -290,6 +290,214 @@ int txtsubst(char sb[TXTBUFSIZ], const char *txt,
   return sl;
 }
 
+/* Compiled TXT templates.  Everything which does not depend on the
+ * query ($n variables, base template, $=) is expanded once when the
+ * dataset is loaded, following txtsubst() logic, leaving a literal
+ * string and positions in it where the query subject should go:
+ *  t[0]        number of positions, 0 if TXT is the same for every query
+ *  t[1]        length of the literal (so t+1 is TXT RDATA if t[0] == 0)
+ *  t[2]...     t[0] positions, in ascending order
+ *  ...         the literal itself
+ */
+
+#define TXTMAXPOS 32	/* if there's more, use txtsubst() */
+
+static int
+txtcompile(unsigned char *lit, unsigned char *pos,
+           const char *txt, const struct dataset *ds) {
+  char *const *sn = ds->ds_subst;
+  unsigned char *lp = lit, *const e = lit + 254;
+  const char *s, *si, *sx = NULL;
+  unsigned sl, n = 0;
+
+  if (txt[0] == '=')
+    sx = ++txt;
+  else if (sn[SUBST_BASE_TEMPLATE] && *sn[SUBST_BASE_TEMPLATE]) {
+    if (*txt) sx = txt;		/* else $= is the query subject */
+    txt = sn[SUBST_BASE_TEMPLATE];
+  }
+  else
+    sx = txt;
+  while(lp < e) {
+    if ((s = strchr(txt, '$')) == NULL)
+      s = txt + strlen(txt);
+    sl = s - txt;
+    if (lp + sl > e)
+      sl = e - lp;
+    memcpy(lp, txt, sl);
+    lp += sl;
+    if (!*s++) break;
+    if (*s == '$') { si = s++; sl = 1; }
+    else if (*s >= '0' && *s <= '9') { /* $n var */
+      si = sn[*s - '0'];
+      if (!si) { si = s - 1; sl = 2; }
+      else sl = strlen(si);
+      ++s;
+    }
+    else if (*s == '=' && sx) {
+      si = sx;
+      sl = strlen(si);
+      ++s;
+    }
+    else {			/* query subject */
+      if (*s == '=') ++s;
+      if (n >= TXTMAXPOS)
+        return -1;
+      pos[n++] = lp - lit;
+      txt = s;
+      continue;
+    }
+    if (lp + sl > e)
+      sl = e - lp;
+    memcpy(lp, si, sl);
+    lp += sl;
+    txt = s;
+  }
+  pos[n] = lp - lit;		/* literal length */
+  return n;
+}
+
+/* expand compiled template t with query subject subst into sb,
+ * the same way as txtsubst() does */
+static unsigned txtexpand(char *sb, const unsigned char *t, const char *subst) {
+  unsigned n = t[0], i, p, c, sl = strlen(subst);
+  const unsigned char *pos = t + 2, *lit = pos + n;
+  char *lp = sb, *const e = sb + 254;
+
+  for(i = 0, p = 0; ; ++i) {
+    c = (i < n ? pos[i] : t[1]) - p;
+    if (lp + c > e)
+      c = e - lp;
+    memcpy(lp, lit + p, c);
+    lp += c;
+    if (i == n || lp == e)
+      break;
+    p = pos[i];
+    c = lp + sl > e ? e - lp : sl;
+    memcpy(lp, subst, c);
+    lp += c;
+  }
+  return lp - sb;
+}
+
+struct rrtxtent {
+  const char *rr;
+  const unsigned char *tpl;	/* compiled template */
+};
+
+struct rrtxt {
+  unsigned n, mask;
+  struct rrtxtent *e;
+};
+
+#define rrtxthash(rr) bloom_hash32((unsigned)((unsigned long)(rr) >> 2))
+
+static struct rrtxtent *
+rrtxt_slot(const struct rrtxt *rt, const char *rr) {
+  struct rrtxtent *e = rt->e + (rrtxthash(rr) & rt->mask);
+  while(e->rr && e->rr != rr)
+    e = rt->e + ((e - rt->e + 1) & rt->mask);
+  return e;
+}
+
+/* on errors, the RR just stays with txtsubst() */
+void rrtxt_add(struct dataset *ds, const char *rr) {
+  struct rrtxt *rt = ds->ds_rrtxt;
+  struct rrtxtent *e;
+  unsigned char lit[254], pos[TXTMAXPOS+1], *t;
+  unsigned i;
+  int n;
+
+  if (!rr)
+    return;
+  if (!rt) {
+    if (!(rt = (struct rrtxt *)calloc(1, sizeof(*rt))))
+      return;
+    ds->ds_rrtxt = rt;
+  }
+  if ((rt->n + 1) * 2 > rt->mask) {	/* grow and rehash */
+    struct rrtxt nrt;
+    nrt.n = rt->n;
+    nrt.mask = rt->mask ? rt->mask * 2 + 1 : 63;
+    nrt.e = (struct rrtxtent *)calloc(nrt.mask + 1, sizeof(*nrt.e));
+    if (!nrt.e)
+      return;
+    for(i = 0; rt->mask && i <= rt->mask; ++i)
+      if (rt->e[i].rr)
+        *rrtxt_slot(&nrt, rt->e[i].rr) = rt->e[i];
+    free(rt->e);
+    *rt = nrt;
+  }
+  e = rrtxt_slot(rt, rr);
+  if (e->rr || (n = txtcompile(lit, pos, rr + 4, ds)) < 0)
+    return;
+  t = (unsigned char *)mp_alloc(ds->ds_mp, 2 + n + pos[n], 0);
+  if (!t)
+    return;
+  t[0] = n;
+  t[1] = pos[n];
+  memcpy(t + 2, pos, n);
+  memcpy(t + 2 + n, lit, pos[n]);
+  e->rr = rr;
+  e->tpl = t;
+  ++rt->n;
+}
+
+static const unsigned char *
+rrtxt_find(const struct dataset *ds, const char *rr) {
+  return ds->ds_rrtxt && ds->ds_rrtxt->n ?
+    rrtxt_slot(ds->ds_rrtxt, rr)->tpl : NULL;
+}
+
+int rrtxt_subst(const struct dataset *ds, const char *rr) {
+  const unsigned char *t = rrtxt_find(ds, rr);
+  return !t || t[0];
+}
+
+/* build TXT RDATA for rr into sb, return pointer to it or NULL if
+ * there's no TXT */
+const unsigned char *
+rrtxt_rdata(unsigned char sb[TXTBUFSIZ+1], const char *rr,
+            const char *subst, const struct dataset *ds) {
+  const unsigned char *t = rrtxt_find(ds, rr);
+  if (t && !t[0])
+    sb = (unsigned char *)t + 1;	/* the same for every query */
+  else if (t)
+    sb[0] = txtexpand((char *)sb + 1, t, subst ? subst : "");
+  else
+    sb[0] = txtsubst((char *)sb + 1, rr + 4, subst, ds);
+  return sb[0] ? sb : NULL;
+}
+
+/* start ds with the templates of ods, which is still in use.  Templates
+ * live in the mempool the new version of a dataset takes over on
+ * incremental reloads, so only RRs not seen before are compiled again */
+int rrtxt_copy(struct dataset *ds, const struct dataset *ods) {
+  const struct rrtxt *ort = ods->ds_rrtxt;
+  struct rrtxt *rt;
+  if (!ort || !ort->n)
+    return 1;
+  if (!(rt = (struct rrtxt *)malloc(sizeof(*rt))))
+    return 0;
+  *rt = *ort;
+  rt->e = (struct rrtxtent *)malloc((rt->mask + 1) * sizeof(*rt->e));
+  if (!rt->e) {
+    free(rt);
+    return 0;
+  }
+  memcpy(rt->e, ort->e, (rt->mask + 1) * sizeof(*rt->e));
+  ds->ds_rrtxt = rt;
+  return 1;
+}
+
+void rrtxt_free(struct dataset *ds) {
+  if (ds->ds_rrtxt) {
+    free(ds->ds_rrtxt->e);
+    free(ds->ds_rrtxt);
+    ds->ds_rrtxt = NULL;
+  }
+}
+
 #ifndef NO_MASTER_DUMP
 
 void dump_ip4(ip4addr_t a, const char *rr, const struct dataset *ds, FILE *f) {
@@ -521,6 +729,83 @@ int ssprintf(char *buf, int bufsz, const char *fmt, ...) {
 
 /* logging */
 
+/* write out a log line of length l in buf (which has room for one more
+ * char), with pl chars of program name prefix not going to syslog */
+static void putlog(int level, char *buf, int pl, int l) {
+  if (logto & LOGTO_SYSLOG) {
+    const char *m = buf + pl;
+    syslog(level, strchr(m, '%') ? "%s" : m, m);
+  }
+  buf[l++] = '\n';
+  if (level <= LOG_WARNING) {
+    if (logto & (LOGTO_STDERR|LOGTO_STDOUT))
+      write(2, buf, l);
+  }
+  else if (logto & LOGTO_STDOUT)
+    write(1, buf, l);
+}
+
+/* save a log line in lb as level, prefix length and the line itself
+ * with terminating zero.  Returns 0 if out of memory. */
+static int savelog(struct dslogbuf *lb, int level, const char *buf,
+                   int pl, int l) {
+  if (lb->lb_len + l + 3 > lb->lb_size) {
+    unsigned size = lb->lb_size ? lb->lb_size : 1024;
+    char *b;
+    while(lb->lb_len + l + 3 > size)
+      size <<= 1;
+    if (!(b = (char *)realloc(lb->lb_buf, size)))
+      return 0;
+    lb->lb_buf = b;
+    lb->lb_size = size;
+  }
+  lb->lb_buf[lb->lb_len++] = (char)level;
+  lb->lb_buf[lb->lb_len++] = (char)pl;
+  memcpy(lb->lb_buf + lb->lb_len, buf, l);
+  lb->lb_len += l;
+  lb->lb_buf[lb->lb_len++] = '\0';
+  return 1;
+}
+
+void dslogflush(struct dslogbuf *lb) {
+  char buf[1024];
+  unsigned i = 0;
+  int l;
+  while(i < lb->lb_len) {
+    l = strlen(lb->lb_buf + i + 2);
+    memcpy(buf, lb->lb_buf + i + 2, l + 1);
+    putlog(lb->lb_buf[i], buf, lb->lb_buf[i+1], l);
+    i += l + 3;
+  }
+  free(lb->lb_buf);
+  memset(lb, 0, sizeof(*lb));
+}
+
+#define MAXWARN 5
+
+/* log lines saved in lb by another dsctx which had warns warnings, as
+ * if they were logged by dsc after whatever it logged so far */
+void dslogjoin(struct dsctx *dsc, struct dslogbuf *lb, int warns) {
+  char buf[1024];
+  unsigned i = 0;
+  int l, w = 0;
+  while(i < lb->lb_len) {
+    l = strlen(lb->lb_buf + i + 2);
+    /* the first warnings are from dswarn(), limited by MAXWARN in total */
+    if (lb->lb_buf[i] != LOG_WARNING || ++w > warns || w > MAXWARN ||
+        dsc->dsc_warns + w <= MAXWARN) {
+      memcpy(buf, lb->lb_buf + i + 2, l + 1);
+      if (!dsc->dsc_logbuf ||
+          !savelog(dsc->dsc_logbuf, lb->lb_buf[i], buf, lb->lb_buf[i+1], l))
+        putlog(lb->lb_buf[i], buf, lb->lb_buf[i+1], l);
+    }
+    i += l + 3;
+  }
+  dsc->dsc_warns += warns;
+  free(lb->lb_buf);
+  memset(lb, 0, sizeof(*lb));
+}
+
 static void
 vdslog(int level, struct dsctx *dsc, const char *fmt, va_list ap) {
   char buf[1024];
@@ -552,17 +837,8 @@ vdslog(int level, struct dsctx *dsc, const char *fmt, va_list ap) {
     }
   }
   l += vssprintf(buf + l, sizeof(buf) - l, fmt, ap);
-  if (logto & LOGTO_SYSLOG) {
-    fmt = buf + pl;
-    syslog(level, strchr(fmt, '%') ? "%s" : fmt, fmt);
-  }
-  buf[l++] = '\n';
-  if (level <= LOG_WARNING) {
-    if (logto & (LOGTO_STDERR|LOGTO_STDOUT))
-      write(2, buf, l);
-  }
-  else if (logto & LOGTO_STDOUT)
-    write(1, buf, l);
+  if (!dsc || !dsc->dsc_logbuf || !savelog(dsc->dsc_logbuf, level, buf, pl, l))
+    putlog(level, buf, pl, l);
 }
 
 void dslog(int level, struct dsctx *dsc, const char *fmt, ...) {
@@ -572,8 +848,6 @@ void dslog(int level, struct dsctx *dsc, const char *fmt, ...) {
   va_end(ap);
 }
 
-#define MAXWARN 5
-
 void dswarn(struct dsctx *dsc, const char *fmt, ...) {
   if (++dsc->dsc_warns <= MAXWARN) { /* prevent syslog flood */
     va_list ap;
@@ -592,12 +866,13 @@ void dsloaded(struct dsctx *dsc, const char *fmt, ...) {
   if (dsc->dsc_subset)
      vdslog(LOG_INFO, dsc, fmt, ap);
   else {
-    struct tm *tm = gmtime(&dsc->dsc_ds->ds_stamp);
+    struct tm tm;
     char buf[128];
+    gmtime_r(&dsc->dsc_ds->ds_stamp, &tm);
     vssprintf(buf, sizeof(buf), fmt, ap);
     dslog(LOG_INFO, dsc, "%04d%02d%02d %02d%02d%02d: %s",
-          tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
-          tm->tm_hour, tm->tm_min, tm->tm_sec,
+          tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+          tm.tm_hour, tm.tm_min, tm.tm_sec,
           buf);
   }
   va_end(ap);
@@ -614,3 +889,253 @@ void zlog(int level, const struct zone *zone, const char *fmt, ...) {
   dns_dntop(zone->z_dn, name, sizeof(name));
   dslog(level, 0, "zone %.70s: %s", name, buf);
 }
+
+/* Bloom filters.  About 16..32 bits per key (number of blocks is a power
+ * of 2), which gives false positive rate well below 1% */
+
+const unsigned bloom_salt[BLOOM_K] = {
+  0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+  0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u
+};
+
+int bloom_init(struct bloom *bf, unsigned nkeys) {
+  unsigned nblk = 1;
+  bloom_free(bf);
+  if (!nkeys)
+    return 1;
+  while(nblk * (BLOOM_K * 32 / 16) < nkeys)
+    nblk <<= 1;
+  bf->bf_bits = (unsigned *)calloc(nblk * BLOOM_K, sizeof(unsigned));
+  if (!bf->bf_bits)
+    return 0;
+  bf->bf_mask = nblk - 1;
+  return 1;
+}
+
+void bloom_free(struct bloom *bf) {
+  free(bf->bf_bits);
+  bf->bf_bits = NULL;
+  bf->bf_mask = 0;
+}
+
+void bloom_add(struct bloom *bf, unsigned hash) {
+  unsigned *w, i, h2;
+  if (!bf->bf_bits)
+    return;
+  w = bf->bf_bits + (hash & bf->bf_mask) * BLOOM_K;
+  h2 = bloom_hash32(hash ^ 0x9e3779b9u);
+  for(i = 0; i < BLOOM_K; ++i)
+    w[i] |= 1u << ((h2 * bloom_salt[i]) >> 27);
+}
+
+unsigned bloom_hash(const unsigned char *p, unsigned len, unsigned seed) {
+  unsigned h = 2166136261u ^ seed;	/* FNV-1a */
+  while(len--)
+    h = (h ^ *p++) * 16777619u;
+  return bloom_hash32(h);
+}
+
+/* size and (estimated) false positive rate */
+const char *bloom_stats(const struct bloom *bf) {
+  static THREAD_LOCAL char buf[40];
+  const unsigned *w, *e;
+  double fpr = 0, p;
+  unsigned i, n;
+  if (!bf->bf_bits)
+    return "bloom=none";
+  n = bf->bf_mask + 1;
+  for(w = bf->bf_bits, e = w + n * BLOOM_K; w < e; w += BLOOM_K) {
+    /* a key is a false positive if all its bits are set */
+    for(p = 1, i = 0; i < BLOOM_K; ++i) {
+      unsigned x = w[i], c = 0;
+      for(; x; x &= x - 1)
+        ++c;
+      p *= c / 32.;
+    }
+    fpr += p;
+  }
+  ssprintf(buf, sizeof(buf), "bloom=%uKb fpr=%.3f%%",
+           (n * BLOOM_K * 4 + 1023) >> 10, fpr * 100 / n);
+  return buf;
+}
+
+/* Sorting DN arrays.  Comparing entries directly means following ldn
+ * pointers into the memory pool on every comparison, which is a cache
+ * miss for every one on big arrays.  Instead, a compact array of
+ * (8 bytes of DN, entry index) keys is radix-sorted, and DNs are looked
+ * at again only for runs of keys which are equal so far, taking the next
+ * 8 bytes (MSD order, like multikey quicksort).  Runs of equal DNs are
+ * ordered by lt() and collapsed to one ldn pointer right there, and the
+ * entries are moved into their places in one pass at the end. */
+
+struct dnskey {
+  unsigned long long k;		/* 8 bytes of DN at current offset */
+  unsigned i;			/* index of the entry */
+};
+
+struct dnsort {
+  char *base;
+  unsigned size;
+  int (*lt)(const void *a, const void *b);
+};
+
+#define DNSORT_MIN 16		/* shorter runs use insertion sort */
+
+#define dnsort_ent(s,i) ((s)->base + (size_t)(i) * (s)->size)
+#define dnsort_ldn(s,i) (*(const unsigned char **)dnsort_ent(s,i))
+
+/* 8 bytes of ldn from off, big endian, zero-padded after the end.  DNs
+ * with the same first (length) byte end at the same place. */
+static unsigned long long dnsort_key(const unsigned char *ldn, unsigned off) {
+  unsigned long long k = 0;
+  unsigned i, l = ldn[0] + 1;
+  for(i = off; i < off + 8; ++i)
+    k = (k << 8) | (i < l ? ldn[i] : 0);
+  return k;
+}
+
+static int dnsort_cmp(const unsigned char *a, const unsigned char *b) {
+  if (a[0] != b[0])
+    return a[0] < b[0] ? -1 : 1;
+  return memcmp(a + 1, b + 1, a[0]);
+}
+
+/* separate function so its counters are not on the recursion stack */
+static void dnsort_radix(struct dnskey *k, unsigned n) {
+# define QSORT_TYPE struct dnskey
+# define QSORT_BASE k
+# define QSORT_NELT n
+# define QSORT_LT(a,b) ((a)->k < (b)->k)
+# define RSORT_NBYTES 8
+# define RSORT_BYTE(p,i) ((unsigned)((p)->k >> ((i) << 3)) & 255u)
+# include "rsort.c"
+}
+
+/* run of keys of equal DNs: order by lt, then by index */
+static void dnsort_ties(const struct dnsort *s, struct dnskey *k, unsigned n) {
+  unsigned i, j, h;
+  const unsigned char *ldn;
+  for(h = 1; h < n / 3; h = h * 3 + 1)
+    ;
+  for(; h; h /= 3)
+    for(i = h; i < n; ++i) {
+      struct dnskey t = k[i];
+      const char *e = dnsort_ent(s, t.i), *p;
+      for(j = i; j >= h; j -= h) {
+        p = dnsort_ent(s, k[j - h].i);
+        if (!(s->lt(e, p) || (!s->lt(p, e) && t.i < k[j - h].i)))
+          break;
+        k[j] = k[j - h];
+      }
+      k[j] = t;
+    }
+  ldn = dnsort_ldn(s, k[0].i);
+  for(i = 1; i < n; ++i)
+    dnsort_ldn(s, k[i].i) = ldn;
+}
+
+/* sort run of keys whose DNs are equal before offset off */
+static void dnsort_run(const struct dnsort *s, struct dnskey *k, unsigned n,
+                       unsigned off) {
+  unsigned i, j;
+
+  if (n < DNSORT_MIN) {
+    for(i = 1; i < n; ++i) {
+      struct dnskey t = k[i];
+      const unsigned char *ldn = dnsort_ldn(s, t.i);
+      for(j = i; j && dnsort_cmp(ldn, dnsort_ldn(s, k[j - 1].i)) < 0; --j)
+        k[j] = k[j - 1];
+      k[j] = t;
+    }
+    for(i = 0; i < n; i = j) {
+      const unsigned char *ldn = dnsort_ldn(s, k[i].i);
+      for(j = i + 1; j < n && !dnsort_cmp(ldn, dnsort_ldn(s, k[j].i)); ++j)
+        ;
+      if (j - i > 1)
+        dnsort_ties(s, k + i, j - i);
+    }
+    return;
+  }
+
+  for(i = 0; i < n; ++i)
+    k[i].k = dnsort_key(dnsort_ldn(s, k[i].i), off);
+  dnsort_radix(k, n);
+  for(i = 0; i < n; i = j) {
+    for(j = i + 1; j < n && k[j].k == k[i].k; ++j)
+      ;
+    if (j - i < 2)
+      continue;
+    if (dnsort_ldn(s, k[i].i)[0] + 1u > off + 8)
+      dnsort_run(s, k + i, j - i, off + 8);
+    else
+      dnsort_ties(s, k + i, j - i);
+  }
+}
+
+int dnsort(void *base, unsigned n, unsigned size,
+           int (*lt)(const void *a, const void *b)) {
+  struct dnsort s;
+  struct dnskey *k;
+  char *hold;
+  unsigned i, j, x;
+
+  if (n < 2)
+    return 1;
+  k = (struct dnskey *)malloc(n * sizeof(*k) + size);
+  if (!k)
+    return 0;
+  hold = (char *)(k + n);
+  s.base = (char *)base;
+  s.size = size;
+  s.lt = lt;
+  for(i = 0; i < n; ++i)
+    k[i].i = i;
+  dnsort_run(&s, k, n, 0);
+
+  /* entry k[i].i goes to place i: follow the cycles of this permutation,
+   * marking places which are done with k[i].i = i */
+  for(i = 0; i < n; ++i) {
+    if (k[i].i == i)
+      continue;
+    memcpy(hold, dnsort_ent(&s, i), size);
+    for(j = i; (x = k[j].i) != i; j = x) {
+      memcpy(dnsort_ent(&s, j), dnsort_ent(&s, x), size);
+      k[j].i = j;
+    }
+    memcpy(dnsort_ent(&s, j), hold, size);
+    k[j].i = j;
+  }
+  free(k);
+  return 1;
+}
+
+/* Eytzinger layout */
+
+unsigned eytz_first(unsigned n) {
+  unsigned k = n ? 1 : 0;
+  while(k && 2 * k <= n)
+    k <<= 1;
+  return k;
+}
+
+unsigned eytz_next(unsigned k, unsigned n) {
+  if (2 * k + 1 <= n) {		/* leftmost of the right subtree */
+    for(k = 2 * k + 1; 2 * k <= n; k <<= 1)
+      ;
+    return k;
+  }
+  while(k & 1)			/* up while we're the right child */
+    k >>= 1;
+  return k >> 1;
+}
+
+void *eytzinger(const void *a, unsigned n, unsigned size) {
+  void *p;
+  unsigned i, k;
+  if (posix_memalign(&p, EYTZ_LINE, (n + 1) * (size_t)size) != 0)
+    return NULL;
+  for(i = 0, k = eytz_first(n); k; ++i, k = eytz_next(k, n))
+    memcpy((char *)p + k * (size_t)size, (const char *)a + i * (size_t)size,
+           size);
+  return p;
+}
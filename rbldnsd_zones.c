@@ -13,6 +13,12 @@
 #include <time.h>
 #include "rbldnsd.h"
 #include "istream.h"
+#ifndef NO_THREADS
+# include <pthread.h>
+#endif
+#ifndef NO_INOTIFY
+# include <sys/inotify.h>
+#endif
 
 static struct dataset *ds_list;
 struct dataset *g_dsacl;
@@ -52,9 +58,10 @@ static struct dataset *newdataset(char *spec) {
 
   dsfp = &ds->ds_dsf;
   for (f = strtok(f, delims); f; f = strtok(NULL, delims)) {
-    dsf = tmalloc(struct dsfile);
-    dsf->dsf_stamp = 0;
+    dsf = tzalloc(struct dsfile);
     dsf->dsf_name = estrdup(f);
+    dsf->dsf_dname = emalloc(strlen(f) + sizeof(".delta"));
+    strcat(strcpy((char*)dsf->dsf_dname, f), ".delta");
     *dsfp = dsf;
     dsfp = &dsf->dsf_next;
   }
@@ -103,6 +110,101 @@ struct zone *newzone(struct zone **zonelist,
   return zone;
 }
 
+/* Zone index: a hash table of all zones in a list, keyed by zone DN.
+ * newzone() keeps more specific zones before less specific ones in the
+ * list, and findqzone() uses the first zone which is a suffix of the
+ * query.  With the index, we look up every suffix of the query, from
+ * the longest to the shortest, which gives the same zone.  Zone lists
+ * don't change after they're built, so the index is built once for the
+ * main list and once per load for combined datasets. */
+
+struct zientry {
+  unsigned h;			/* hash of the zone DN */
+  const struct zone *zone;	/* NULL if empty */
+};
+
+struct zindex {
+  unsigned zi_mask;		/* size of zi_tab - 1 */
+  unsigned zi_maxlab;		/* max number of labels in a zone DN */
+  const struct zone *zi_root;	/* zone with empty DN (combined) */
+  unsigned char zi_lab[DNS_MAXLABELS+1];	/* zones with so many labels */
+  struct zientry zi_tab[1];
+};
+
+static unsigned zi_hash(const unsigned char *dn, unsigned len0) {
+  unsigned h = 2166136261u;	/* FNV-1a */
+  while(len0--)
+    h = (h ^ *dn++) * 16777619u;
+  h ^= h >> 16; h *= 0x85ebca6bu;
+  h ^= h >> 13; h *= 0xc2b2ae35u;
+  return h ^ (h >> 16);
+}
+
+void zindex_build(struct zone *zonelist) {
+  struct zindex *zi;
+  struct zientry *e;
+  const struct zone *zone;
+  unsigned n, size, h;
+
+  if (!zonelist)
+    return;
+  zindex_free(zonelist);
+  for(n = 0, zone = zonelist; zone; zone = zone->z_next)
+    ++n;
+  for(size = 4; size < n * 2; size <<= 1)
+    ;
+  zi = (struct zindex *)calloc(1, sizeof(*zi) + (size - 1) * sizeof(*e));
+  if (!zi)
+    return;			/* findqzone() will scan the list */
+  zi->zi_mask = size - 1;
+  for(zone = zonelist; zone; zone = zone->z_next) {
+    if (!zone->z_dnlab) {
+      zi->zi_root = zone;
+      continue;
+    }
+    h = zi_hash(zone->z_dn, zone->z_dnlen - 1);
+    for(e = zi->zi_tab + (h & zi->zi_mask); e->zone;
+        e = zi->zi_tab + ((e - zi->zi_tab + 1) & zi->zi_mask))
+      ;
+    e->h = h;
+    e->zone = zone;
+    zi->zi_lab[zone->z_dnlab] = 1;
+    if (zi->zi_maxlab < zone->z_dnlab)
+      zi->zi_maxlab = zone->z_dnlab;
+  }
+  zonelist->z_zidx = zi;
+}
+
+void zindex_free(struct zone *zonelist) {
+  if (zonelist && zonelist->z_zidx) {
+    free(zonelist->z_zidx);
+    zonelist->z_zidx = NULL;
+  }
+}
+
+/* find the most specific zone for a DN of dnlab labels, dnlen bytes */
+const struct zone *
+zindex_find(const struct zindex *zi, unsigned dnlen, unsigned dnlab,
+            unsigned char *const *const dnlptr) {
+  const struct zientry *e;
+  const unsigned char *q;
+  unsigned lab, len0, h;
+
+  for(lab = dnlab < zi->zi_maxlab ? dnlab : zi->zi_maxlab; lab; --lab) {
+    if (!zi->zi_lab[lab])
+      continue;
+    q = dnlptr[dnlab - lab];
+    len0 = dnlen - 1 - (q - dnlptr[0]);
+    h = zi_hash(q, len0);
+    for(e = zi->zi_tab + (h & zi->zi_mask); e->zone;
+        e = zi->zi_tab + ((e - zi->zi_tab + 1) & zi->zi_mask))
+      if (e->h == h && e->zone->z_dnlen - 1 == len0 &&
+          memcmp(e->zone->z_dn, q, len0) == 0)
+        return e->zone;
+  }
+  return zi->zi_root;
+}
+
 void connectdataset(struct zone *zone,
                     struct dataset *ds,
                     struct dslist *dsl) {
@@ -312,16 +414,230 @@ static int ds_special(struct dataset *ds, char *line, struct dsctx *dsc) {
   return 0;
 }
 
+/* Delta files.  Every data file may have a companion file with the same
+ * name plus ".delta", listing changes to the data:
+ *   $SEQ n	sequence number, must be the first line
+ *   +line	add a data line
+ *   -line	remove a data line, as it was written in the data file
+ *		or in an earlier +line (for ip4set: the entries it lists)
+ * A delta file is supposed to be appended to, and to be replaced with a
+ * new one (with a new $SEQ, or empty) when the data file is rewritten.
+ * When only new lines were appended to delta files since the last load,
+ * and the dataset type supports it, the new changes are applied to a
+ * copy of the current data, without reading the data files again.  The
+ * full load is repeated ("compaction") once the deltas applied this way
+ * grow beyond a quarter of the size of the data file.
+ */
+
+static void delta_init(struct dsdelta *dd) {
+  memset(dd, 0, sizeof(*dd));
+  mp_init(&dd->dd_mp);
+}
+
+static void delta_free(struct dsdelta *dd) {
+  free(dd->dd_c);
+  free(dd->dd_htab);
+  mp_free(&dd->dd_mp);
+}
+
+static unsigned delta_hash(const char *line) {
+  return bloom_hash((const unsigned char *)line, strlen(line), 0);
+}
+
+static struct dschange *
+delta_find(const struct dsdelta *dd, const char *line, unsigned h) {
+  unsigned i = dd->dd_htab ? dd->dd_htab[h & dd->dd_hmask] : 0;
+  for(; i; i = dd->dd_c[i-1].dc_hnext)
+    if (dd->dd_c[i-1].dc_hash == h && strcmp(dd->dd_c[i-1].dc_line, line) == 0)
+      return &dd->dd_c[i-1];
+  return NULL;
+}
+
+/* true if the delta removes this data line */
+static int delta_removed(const struct dsdelta *dd, const char *line) {
+  const struct dschange *dc;
+  if (!dd || dd->dd_nadd == dd->dd_n)
+    return 0;
+  dc = delta_find(dd, line, delta_hash(line));
+  return dc && !dc->dc_add;
+}
+
+static int delta_change(struct dsdelta *dd, const char *line, int add,
+                        int lineno) {
+  unsigned h = delta_hash(line), i;
+  struct dschange *dc = delta_find(dd, line, h);
+
+  if (!dc) {
+    if (dd->dd_n >= dd->dd_a) {
+      unsigned a = dd->dd_a ? dd->dd_a << 1 : 64, *htab;
+      dc = trealloc(struct dschange, dd->dd_c, a);
+      htab = (unsigned *)calloc(a * 2, sizeof(*htab));
+      if (!dc || !htab) {
+        if (dc) dd->dd_c = dc;
+        free(htab);
+        return 0;
+      }
+      free(dd->dd_htab);
+      dd->dd_c = dc;
+      dd->dd_a = a;
+      dd->dd_htab = htab;
+      dd->dd_hmask = a * 2 - 1;
+      for(i = 0; i < dd->dd_n; ++i) {
+        dc = dd->dd_c + i;
+        dc->dc_hnext = htab[dc->dc_hash & dd->dd_hmask];
+        htab[dc->dc_hash & dd->dd_hmask] = i + 1;
+      }
+    }
+    dc = dd->dd_c + dd->dd_n;
+    if (!(dc->dc_line = mp_strdup(&dd->dd_mp, line)))
+      return 0;
+    dc->dc_hash = h;
+    dc->dc_add = 0;
+    dc->dc_hnext = dd->dd_htab[h & dd->dd_hmask];
+    dd->dd_htab[h & dd->dd_hmask] = ++dd->dd_n;
+  }
+  dd->dd_nadd += add - dc->dc_add;
+  dc->dc_add = add;
+  dc->dc_lineno = lineno;
+  return 1;
+}
+
+/* read changes from the delta file of dsf, starting at offset from.
+ * If from is not 0, the delta must have the same $SEQ as before.
+ * Returns 1 if ok, 0 on error, or -1 if it is not the same delta. */
 static int
-readdslines(struct istream *sp, struct dataset *ds, struct dsctx *dsc) {
+readdelta(struct dsdelta *dd, struct dsfile *dsf, off_t from,
+          struct dsctx *dsc) {
+  struct istream is;
+  struct stat st0, st1;
+  unsigned long seq = 0;
+  char hdr[64], *line, *eol;
+  off_t pos;
+  int fd, r, add;
+
+  dsc->dsc_fname = dsf->dsf_dname;
+  dsc->dsc_lineno = 0;
+  fd = open(dsf->dsf_dname, O_RDONLY);
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      dslog(LOG_ERR, dsc, "unable to open file: %s", strerror(errno));
+      return 0;
+    }
+    if (from)
+      return -1;
+    dsf->dsf_dstamp = dsf->dsf_dsize = dsf->dsf_doff = 0;
+    dsf->dsf_dseq = 0;
+    return 1;
+  }
+  if (fstat(fd, &st0) < 0 || (r = pread(fd, hdr, sizeof(hdr) - 1, 0)) < 0) {
+    dslog(LOG_ERR, dsc, "error reading file: %s", strerror(errno));
+    close(fd);
+    return 0;
+  }
+  hdr[r] = '\0';
+  if (strncmp(hdr, "$SEQ", 4) == 0 && ISSPACE(hdr[4]))
+    seq = strtoul(hdr + 5, NULL, 10);
+  if (from && (!seq || seq != dsf->dsf_dseq || st0.st_size < from)) {
+    close(fd);
+    return -1;
+  }
+  if (lseek(fd, from, SEEK_SET) < 0) {
+    dslog(LOG_ERR, dsc, "error reading file: %s", strerror(errno));
+    close(fd);
+    return 0;
+  }
+
+  istream_init_fd(&is, fd);
+  pos = from;
+  while((r = istream_getline(&is, &line, '\n')) > 0) {
+    eol = line + r - 1;
+    if (*eol-- != '\n')
+      break;			/* incomplete last line, not written yet */
+    pos += r;
+    ++dsc->dsc_lineno;
+    SKIPSPACE(line);
+    while(eol >= line && ISSPACE(*eol))
+      --eol;
+    eol[1] = '\0';
+    if (!line[0] || ISCOMMENT(line[0]) ||
+        (line[0] == '$' && dsc->dsc_lineno == 1 && !from))
+      continue;
+    add = line[0] == '+';
+    if (!add && line[0] != '-') {
+      dswarn(dsc, "invalid line, should start with + or -");
+      continue;
+    }
+    ++line;
+    SKIPSPACE(line);
+    if (!line[0])
+      continue;
+    if (!delta_change(dd, line, add, dsc->dsc_lineno)) {
+      r = -2;			/* out of memory */
+      break;
+    }
+  }
+  if (r >= 0 && fstat(fd, &st1) < 0)
+    r = -1;
+  istream_destroy(&is);
+  close(fd);
+  if (r == -2)
+    return 0;
+  if (r < 0) {
+    dslog(LOG_ERR, dsc, "error reading file: %s", strerror(errno));
+    return 0;
+  }
+  /* deltas are appended to while we read them: what we've read stays
+   * valid unless the file was truncated, and lines added after st0
+   * change its stamp, so the next check picks them up */
+  if (st1.st_size < pos) {
+    dslog(LOG_ERR, dsc,
+          "file changed while we where reading it, data load aborted");
+    return 0;
+  }
+  dsf->dsf_dstamp = st0.st_mtime;
+  dsf->dsf_dsize = st0.st_size;
+  dsf->dsf_doff = pos;
+  dsf->dsf_dseq = seq;
+  dsc->dsc_lineno = 0;
+  return 1;
+}
+
+/* feed lines added by a delta to the dataset */
+static int applydelta(struct dataset *ds, const struct dsdelta *dd,
+                      struct dsctx *dsc) {
+  struct dataset *dscur = dsc->dsc_subset ? dsc->dsc_subset : ds;
+  unsigned i;
+  for(i = 0; i < dd->dd_n; ++i)
+    if (dd->dd_c[i].dc_add) {
+      dsc->dsc_lineno = dd->dd_c[i].dc_lineno;
+      if (!dscur->ds_type->dst_linefn(dscur, dd->dd_c[i].dc_line, dsc))
+        return 0;
+    }
+  dsc->dsc_lineno = 0;
+  return 1;
+}
+
+/* readdslines() modes: all lines, the header only (stopping before the
+ * first data line, whose offset is returned in *headp), or a part of a
+ * file which may not have special lines or default entries (-2 if it
+ * does) */
+#define RDL_ALL		0
+#define RDL_HEAD	1
+#define RDL_PART	2
+
+static int
+readdslines(struct istream *sp, struct dataset *ds, struct dsctx *dsc,
+            const struct dsdelta *dd, int mode, off_t *headp) {
   char *line, *eol;
   int r;
   int noeol = 0;
+  off_t pos = 0;
   struct dataset *dscur = ds;
   ds_linefn_t *linefn = dscur->ds_type->dst_linefn;
 
   while((r = istream_getline(sp, &line, '\n')) > 0) {
     eol = line + r - 1;
+    pos += r;
     if (noeol) {
       if (*eol == '\n')
         noeol = 0;
@@ -330,6 +646,8 @@ readdslines(struct istream *sp, struct dataset *ds, struct dsctx *dsc) {
     ++dsc->dsc_lineno;
     if (*eol == '\n')
       --eol;
+    else if (mode == RDL_HEAD)
+      goto head;
     else {
       dswarn(dsc, "long line (truncated)");
       noeol = 1; /* mark it to be read above */
@@ -337,10 +655,15 @@ readdslines(struct istream *sp, struct dataset *ds, struct dsctx *dsc) {
     SKIPSPACE(line);
     while(eol >= line && ISSPACE(*eol))
       --eol;
-    eol[1] = '\0';
+    if (eol < line || (ISCOMMENT(line[0]) && (eol == line || line[1] != '$')))
+      continue;	/* skip empty lines and comments without copying */
+    line = istream_copyline(sp, line, eol - line + 1);
     if (line[0] == '$' ||
         ((ISCOMMENT(line[0]) || line[0] == ':') && line[1] == '$')) {
-      int r = ds_special(ds, line[0] == '$' ? line + 1 : line + 2, dsc);
+      int r;
+      if (mode == RDL_PART)
+        return -2;
+      r = ds_special(ds, line[0] == '$' ? line + 1 : line + 2, dsc);
       if (!r)
         dswarn(dsc, "invalid or unrecognized special entry");
       else if (r < 0)
@@ -349,7 +672,15 @@ readdslines(struct istream *sp, struct dataset *ds, struct dsctx *dsc) {
       linefn = dscur->ds_type->dst_linefn;
       continue;
     }
-    if (line[0] && !ISCOMMENT(line[0]))
+    if (!line[0] || ISCOMMENT(line[0]))
+      continue;
+    if (line[0] != ':') {
+      if (mode == RDL_HEAD)
+        goto head;
+    }
+    else if (mode == RDL_PART)
+      return -2;
+    if (!delta_removed(dd, line))
       if (!linefn(dscur, line, dsc))
         return 0;
   }
@@ -357,11 +688,19 @@ readdslines(struct istream *sp, struct dataset *ds, struct dsctx *dsc) {
     return -1;
   if (noeol)
     dslog(LOG_WARNING, dsc, "incomplete last line (ignored)");
+  if (mode == RDL_HEAD)
+    *headp = pos;
+  return 1;
+
+head:
+  *headp = pos - r;
+  --dsc->dsc_lineno;
   return 1;
 }
 
 static void freedataset(struct dataset *ds) {
   ds->ds_type->dst_resetfn(ds->ds_dsd, 0);
+  rrtxt_free(ds);
   mp_free(ds->ds_mp);
   ds->ds_dssoa = NULL;
   ds->ds_ttl = def_ttl;
@@ -371,81 +710,564 @@ static void freedataset(struct dataset *ds) {
   memset(ds->ds_subst, 0, sizeof(ds->ds_subst));
 }
 
-int loaddataset(struct dataset *ds) {
-  struct dsfile *dsf;
-  time_t stamp = 0;
+/* Datasets are never modified while queries may be using them.  A reload
+ * builds a new version of struct dataset, with its own memory pool and
+ * type-specific data, and switches all references to it with rcu_assign().
+ * The old version stays on the ds_prev list of the new one until no query
+ * can see it anymore, and freeolddatasets() releases it. */
+
+static struct dataset *newversion(const struct dataset *ds) {
+  struct dataset *nds = (struct dataset*)ezalloc(sizeof(struct dataset) +
+                                                 sizeof(struct mempool) +
+                                                 ds->ds_type->dst_size);
+  if (!nds)
+    return NULL;
+  nds->ds_type = ds->ds_type;
+  nds->ds_mp = (struct mempool*)(nds + 1);
+  nds->ds_dsd = (struct dsdata*)(nds->ds_mp + 1);
+  nds->ds_spec = ds->ds_spec;
+  nds->ds_dsf = ds->ds_dsf;
+  nds->ds_next = ds->ds_next;
+  nds->ds_prev = (struct dataset *)ds;
+  return nds;
+}
+
+static void
+replacedataset(struct zone *zonelist, struct dataset *ds, struct dataset *nds)
+{
+  struct dataset **dsp;
+  struct dslist *dsl;
+  struct zone *zone;
+
+  for(dsp = &ds_list; *dsp != ds; dsp = &(*dsp)->ds_next)
+    ;
+  *dsp = nds;
+  if (g_dsacl == ds)
+    rcu_assign(g_dsacl, nds);
+  for(zone = zonelist; zone; zone = zone->z_next) {
+    if (zone->z_dsacl == ds)
+      rcu_assign(zone->z_dsacl, nds);
+    for(dsl = zone->z_dsl; dsl; dsl = dsl->dsl_next)
+      if (dsl->dsl_ds == ds)
+        break;
+    if (!dsl)
+      continue;
+    /* stop answering from a zone before giving it an empty dataset */
+    if (!nds->ds_stamp)
+      rcu_assign(zone->z_stamp, 0);
+    for(; dsl; dsl = dsl->dsl_next)
+      if (dsl->dsl_ds == ds)
+        rcu_assign(dsl->dsl_ds, nds);
+  }
+}
+
+void freeolddatasets(void) {
+  struct dataset *ds, *old;
+  for(ds = ds_list; ds; ds = ds->ds_next)
+    while((old = ds->ds_prev) != NULL) {
+      ds->ds_prev = old->ds_prev;
+      old->ds_type->dst_resetfn(old->ds_dsd, 1);
+      rrtxt_free(old);
+      mp_free(old->ds_mp);
+      free(old);
+    }
+}
+
+/* Run fn(arg, i) for i = 0..n-1, in up to nthreads threads at once,
+ * every thread taking the next i when done with the previous one. */
+
+struct jobs {
+  void (*j_fn)(void *arg, unsigned i);
+  void *j_arg;
+  unsigned j_n, j_next;
+#ifndef NO_THREADS
+  pthread_mutex_t j_lock;
+#endif
+};
+
+#ifndef NO_THREADS
+static void *jobthread(void *arg) {
+  struct jobs *j = (struct jobs *)arg;
+  unsigned i;
+  for(;;) {
+    pthread_mutex_lock(&j->j_lock);
+    i = j->j_next++;
+    pthread_mutex_unlock(&j->j_lock);
+    if (i >= j->j_n)
+      return NULL;
+    j->j_fn(j->j_arg, i);
+  }
+}
+#endif
+
+static void
+runjobs(unsigned UNUSED nthreads, unsigned n,
+        void (*fn)(void *arg, unsigned i), void *arg) {
+  unsigned i;
+#ifndef NO_THREADS
+  if (nthreads > n)
+    nthreads = n;
+  if (nthreads > 1) {
+    struct jobs j;
+    pthread_t *t = (pthread_t *)malloc((nthreads - 1) * sizeof(pthread_t));
+    unsigned nt = 0;
+    j.j_fn = fn;
+    j.j_arg = arg;
+    j.j_n = n;
+    j.j_next = 0;
+    pthread_mutex_init(&j.j_lock, NULL);
+    if (t)
+      while(nt < nthreads - 1 &&
+            pthread_create(&t[nt], NULL, jobthread, &j) == 0)
+        ++nt;
+    jobthread(&j);
+    while(nt)
+      pthread_join(t[--nt], NULL);
+    free(t);
+    pthread_mutex_destroy(&j.j_lock);
+    return;
+  }
+#endif
+  for(i = 0; i < n; ++i)
+    fn(arg, i);
+}
+
+/* Big uncompressed files of types which support it (struct dsparts) are
+ * loaded in parts by several threads.  First, the header of every file,
+ * that is, the lines up to the first data line, is read as usual, in
+ * order.  The rest of the file is split at line boundaries into parts of
+ * at least PARTMIN bytes, which are parsed and sorted at once, every one
+ * into a dataset of its own, and the parts are merged into the dataset.
+ * Data lines in a part use the default value from the header of their
+ * file; if a part has special ($) lines or default entries (:) after
+ * all, the whole dataset is loaded the usual way instead.  Log lines are
+ * saved per part and written out in file order when the load succeeds;
+ * line numbers are found by counting lines in all parts beforehand. */
+
+#define PARTMIN (1024*1024)
+
+static const struct dsparts *dsparts(const struct dataset *ds) {
+  if (isdstype(ds->ds_type, ip4set))
+    return &ds_ip4set_parts;
+  if (isdstype(ds->ds_type, dnset))
+    return &ds_dnset_parts;
+  return NULL;
+}
+
+struct dspart {
+  struct dataset *p_ds;		/* dataset of the part, or NULL for log
+				   lines of the headers and deltas */
+  struct dsctx p_dsc;		/* with own log, warnings and lineno */
+  struct dslogbuf p_log;
+  const struct dsdelta *p_dd;	/* changes from the delta of the file */
+  int p_fd;			/* the file */
+  off_t p_pos, p_end;		/* the range to parse */
+  int p_lines;			/* number of lines in the range */
+  int p_r;			/* readdslines() result */
+};
+
+struct dspfile {		/* file loaded in parts */
+  int f_fd;
+  struct stat f_st;
+  struct dsdelta f_dd;		/* delta for types without merging */
+};
+
+static int
+partread(struct istream *sp, unsigned char *buf, int UNUSED size,
+         int szhint) {
+  struct dspart *p = (struct dspart *)sp->cookie;
+  int r;
+  if (p->p_end - p->p_pos < szhint)
+    szhint = (int)(p->p_end - p->p_pos);
+  if (!szhint)
+    return 0;
+  r = pread(p->p_fd, buf, szhint, p->p_pos);
+  if (r > 0)
+    p->p_pos += r;
+  return r;
+}
+
+/* count lines of a part, unless it is the last part of its file */
+static void countpart(void *arg, unsigned i) {
+  struct dspart *p = (struct dspart *)arg + i;
+  unsigned char buf[65536], *s, *e;
+  off_t pos = p->p_pos;
+  int r;
+  if (!p->p_ds || !p[1].p_ds || p[1].p_fd != p->p_fd)
+    return;
+  while(pos < p->p_end) {
+    r = pread(p->p_fd, buf, p->p_end - pos < (off_t)sizeof(buf) ?
+              (int)(p->p_end - pos) : (int)sizeof(buf), pos);
+    if (r <= 0) {
+      p->p_r = -1;
+      return;
+    }
+    pos += r;
+    for(s = buf, e = buf + r; (s = memchr(s, '\n', e - s)) != NULL; ++s)
+      ++p->p_lines;
+  }
+}
+
+static void readpart(void *arg, unsigned i) {
+  struct dspart *p = (struct dspart *)arg + i;
   struct istream is;
-  int fd;
+  if (!p->p_ds || p->p_r < 0)
+    return;
+  istream_init(&is, partread, NULL, p);
+  p->p_r = readdslines(&is, p->p_ds, &p->p_dsc, p->p_dd, RDL_PART, NULL);
+  istream_destroy(&is);
+  if (p->p_r > 0)
+    dsparts(p->p_ds)->dp_sortfn(p->p_ds);
+}
+
+static struct dspart *addpart(struct dspart **pv, unsigned *np, unsigned *ap)
+{
+  if (*np >= *ap) {
+    struct dspart *v = trealloc(struct dspart, *pv, *ap ? *ap * 2 : 16);
+    if (!v)
+      return NULL;
+    *pv = v;
+    *ap = *ap ? *ap * 2 : 16;
+  }
+  memset(*pv + *np, 0, sizeof(struct dspart));
+  return *pv + (*np)++;
+}
+
+/* save log lines of the headers and deltas logged so far */
+static int cutlog(struct dspart **pv, unsigned *np, unsigned *ap,
+                  struct dsctx *dsc) {
+  struct dspart *p = addpart(pv, np, ap);
+  if (!p)
+    return 0;
+  p->p_log = *dsc->dsc_logbuf;
+  p->p_dsc.dsc_warns = dsc->dsc_warns;
+  memset(dsc->dsc_logbuf, 0, sizeof(struct dslogbuf));
+  dsc->dsc_warns = 0;
+  return 1;
+}
+
+/* find the start of the line after the one at pos-1 */
+static off_t nextline(int fd, off_t pos, off_t end) {
+  char buf[4096], *s;
   int r;
-  struct stat st0, st1;
-  struct dsctx dsc;
+  for(--pos; pos < end; pos += r) {
+    r = pread(fd, buf, end - pos < (off_t)sizeof(buf) ?
+              (int)(end - pos) : (int)sizeof(buf), pos);
+    if (r <= 0)
+      return -1;
+    if ((s = memchr(buf, '\n', r)) != NULL)
+      return pos + (s - buf) + 1;
+  }
+  return end;
+}
 
-  freedataset(ds);
+/* load ds in parts.  Returns 1 if ok, or -1 if it should be loaded
+ * the usual way (including on any error, to have it reported there). */
+static int
+loadparts(struct dataset *ds, struct dsctx *dsc, struct dsdelta *dd,
+          unsigned nthreads) {
+  const struct dsparts *dp = dsparts(ds);
+  int merge = isdstype(ds->ds_type, ip4set);
+  struct dsfile *dsf;
+  struct dspfile *fv, *f;
+  struct dspart *pv = NULL, *p;
+  struct dataset **parts = NULL;
+  struct dsctx hdsc;
+  struct dslogbuf hlog;
+  struct istream is;
+  struct stat st;
+  unsigned nf = 0, np = 0, ap = 0, nparts = 0, i, k, j;
+  off_t size = 0, head, pos, end;
+  unsigned char magic[4];
+  int r, ok = 0;
 
-  memset(&dsc, 0, sizeof(dsc));
-  dsc.dsc_ds = ds;
+  if (!dp)
+    return -1;
+  for(dsf = ds->ds_dsf; dsf; dsf = dsf->dsf_next, ++nf)
+    if (stat(dsf->dsf_name, &st) == 0)
+      size += st.st_size;
+  if (size < 2 * PARTMIN)
+    return -1;
+  if (!(fv = (struct dspfile *)calloc(nf, sizeof(*fv))))
+    return -1;
+  for(i = 0; i < nf; ++i) {
+    fv[i].f_fd = -1;
+    delta_init(&fv[i].f_dd);
+  }
 
-  for(dsf = ds->ds_dsf; dsf; dsf = dsf->dsf_next) {
-    dsc.dsc_fname = dsf->dsf_name;
-    fd = open(dsf->dsf_name, O_RDONLY);
-    if (fd < 0 || fstat(fd, &st0) < 0) {
-      dslog(LOG_ERR, &dsc, "unable to open file: %s", strerror(errno));
-      if (fd >= 0) close(fd);
-      goto fail;
-    }
+  hdsc = *dsc;
+  memset(&hlog, 0, sizeof(hlog));
+  hdsc.dsc_logbuf = &hlog;
+
+  for(dsf = ds->ds_dsf, f = fv; dsf; dsf = dsf->dsf_next, ++f) {
+    if (readdelta(merge ? dd : &f->f_dd, dsf, 0, &hdsc) <= 0)
+      goto done;
+    hdsc.dsc_fname = dsf->dsf_name;
+    if ((f->f_fd = open(dsf->dsf_name, O_RDONLY)) < 0 ||
+        fstat(f->f_fd, &f->f_st) < 0 ||
+        (r = pread(f->f_fd, magic, sizeof(magic), 0)) < 0 ||
+        istream_magic(magic, r))
+      goto done;
     ds->ds_type->dst_startfn(ds);
+    istream_init_fd(&is, f->f_fd);
+    r = readdslines(&is, ds, &hdsc, merge ? NULL : &f->f_dd,
+                    RDL_HEAD, &head);
+    istream_destroy(&is);
+    if (r <= 0 || !cutlog(&pv, &np, &ap, &hdsc))
+      goto done;
+
+    end = f->f_st.st_size;
+    k = (end - head) / PARTMIN;
+    if (k > nthreads) k = nthreads;
+    else if (!k) k = 1;
+    for(j = 0, pos = head; j < k && pos < end; ++j, pos = p->p_end) {
+      if (!(p = addpart(&pv, &np, &ap)))
+        goto done;
+      p->p_fd = f->f_fd;
+      p->p_pos = pos;
+      p->p_end = j + 1 == k ? end :
+        nextline(f->f_fd, head + (end - head) / k * (j + 1), end);
+      if (p->p_end < 0 || !(p->p_ds = newversion(ds)))
+        goto done;
+      p->p_ds->ds_prev = NULL;
+      dp->dp_startfn(p->p_ds, ds);
+      p->p_dsc = hdsc;
+      p->p_dsc.dsc_lineno = j ? -1 : hdsc.dsc_lineno;
+      p->p_dd = merge ? NULL : &f->f_dd;
+      ++nparts;
+    }
+    hdsc.dsc_lineno = 0;
+
+    if (!merge) {
+      hdsc.dsc_fname = dsf->dsf_dname;
+      if (!applydelta(ds, &f->f_dd, &hdsc))
+        goto done;
+    }
+  }
+  if (!cutlog(&pv, &np, &ap, &hdsc))
+    goto done;
+
+  /* count lines, to know where every part starts, and read the parts */
+  for(i = 0, p = pv; i < np; ++i, ++p)
+    p->p_dsc.dsc_logbuf = &p->p_log;
+  runjobs(nthreads, np, countpart, pv);
+  for(i = 0, p = pv; i < np; ++i, ++p)
+    if (p->p_ds && p->p_dsc.dsc_lineno < 0)
+      p->p_dsc.dsc_lineno = p[-1].p_dsc.dsc_lineno + p[-1].p_lines;
+  runjobs(nthreads, np, readpart, pv);
+
+  for(i = 0, p = pv; i < np; ++i, ++p)
+    if (p->p_ds && p->p_r <= 0)
+      goto done;
+  for(dsf = ds->ds_dsf, f = fv; dsf; dsf = dsf->dsf_next, ++f)
+    if (fstat(f->f_fd, &st) < 0 ||
+        st.st_mtime != f->f_st.st_mtime || st.st_size != f->f_st.st_size)
+      goto done;
+
+  if (!(parts = (struct dataset **)malloc(nparts * sizeof(*parts))))
+    goto done;
+  for(i = 0, j = 0; i < np; ++i)
+    if (pv[i].p_ds)
+      parts[j++] = pv[i].p_ds;
+  if (!dp->dp_mergefn(ds, parts, nparts))
+    goto done;
+  for(i = 0; i < nparts; ++i)
+    mp_join(ds->ds_mp, parts[i]->ds_mp);
+
+  for(dsf = ds->ds_dsf, f = fv; dsf; dsf = dsf->dsf_next, ++f) {
+    dsf->dsf_stamp = f->f_st.st_mtime;
+    dsf->dsf_size  = f->f_st.st_size;
+    dsf->dsf_dfull = dsf->dsf_doff;
+  }
+  for(i = 0; i < np; ++i)
+    dslogjoin(dsc, &pv[i].p_log, pv[i].p_dsc.dsc_warns);
+  dsc->dsc_ip4maxrange = hdsc.dsc_ip4maxrange;
+  ok = 1;
+
+done:
+  for(i = 0; i < np; ++i) {
+    free(pv[i].p_log.lb_buf);
+    if (pv[i].p_ds) {
+      freedataset(pv[i].p_ds);
+      free(pv[i].p_ds);
+    }
+  }
+  free(pv);
+  free(parts);
+  free(hlog.lb_buf);
+  for(i = 0; i < nf; ++i) {
+    if (fv[i].f_fd >= 0)
+      close(fv[i].f_fd);
+    delta_free(&fv[i].f_dd);
+  }
+  free(fv);
+  if (!ok) {
+    freedataset(ds);
+    delta_free(dd);
+    delta_init(dd);
+  }
+  return ok ? 1 : -1;
+}
+
+/* read one data file (and its delta) into ds, the usual way.
+ * nthreads threads may decompress a blocked gzip file. */
+static int
+loadfile(struct dataset *ds, struct dsfile *dsf, struct dsctx *dsc,
+         struct dsdelta *dd, int merge, unsigned nthreads) {
+  struct istream is;
+  int fd;
+  int r;
+  struct stat st0, st1;
+
+  if (!readdelta(dd, dsf, 0, dsc))
+    return 0;
+  dsc->dsc_fname = dsf->dsf_name;
+  fd = open(dsf->dsf_name, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st0) < 0) {
+    dslog(LOG_ERR, dsc, "unable to open file: %s", strerror(errno));
+    if (fd >= 0) close(fd);
+    return 0;
+  }
+  ds->ds_type->dst_startfn(ds);
+  if (!istream_init_mmap(&is, fd))
     istream_init_fd(&is, fd);
-    if (istream_compressed(&is)) {
-      if (nouncompress) {
-        dslog(LOG_ERR, &dsc, "file is compressed, decompression disabled");
-        r = 0;
-      }
-      else {
-#ifdef NO_ZLIB
-        dslog(LOG_ERR, &dsc,
+  if (istream_compressed(&is)) {
+    if (nouncompress) {
+      dslog(LOG_ERR, dsc, "file is compressed, decompression disabled");
+      r = 0;
+    }
+    else {
+      r = istream_uncompress_setup(&is, nthreads);
+        /* either 1 or -1 but not 0 */
+      if (r < 0 && errno == ENOSYS) {
+        dslog(LOG_ERR, dsc,
               "file is compressed, decompression is not compiled in");
         r = 0;
-#else
-        r = istream_uncompress_setup(&is);
-          /* either 1 or -1 but not 0 */
-#endif
       }
     }
+  }
+  else
+    r = 1;
+  if (r > 0)
+    r = readdslines(&is, ds, dsc, merge ? NULL : dd, RDL_ALL, NULL);
+  if (r > 0) r = fstat(fd, &st1) < 0 ? -1 : 1;
+  dsc->dsc_lineno = 0;
+  istream_destroy(&is);
+  close(fd);
+  if (!r)
+    return 0;
+  if (r < 0) {
+    dslog(LOG_ERR, dsc, "error reading file: %s", strerror(errno));
+    return 0;
+  }
+  if (st0.st_mtime != st1.st_mtime ||
+      st0.st_size  != st1.st_size) {
+    dslog(LOG_ERR, dsc,
+          "file changed while we where reading it, data load aborted");
+    dslog(LOG_ERR, dsc,
+          "do not write data files directly, "
+          "use temp file and rename(2) instead");
+    return 0;
+  }
+  if (!merge) {
+    dsc->dsc_fname = dsf->dsf_dname;
+    if (!applydelta(ds, dd, dsc))
+      return 0;
+    delta_free(dd);
+    delta_init(dd);
+  }
+  dsf->dsf_stamp = st0.st_mtime;
+  dsf->dsf_size  = st0.st_size;
+  dsf->dsf_dfull = dsf->dsf_doff;
+  return 1;
+}
+
+/* load ds from its snapshot, if there's one up to date with its data
+ * files, and pick up changes made to their delta files since: appended
+ * delta lines are read into dd when merging them (ip4set), otherwise
+ * the deltas should be the same as when the snapshot was made. */
+static int
+loadsnap(struct dataset *ds, struct dsctx *dsc, struct dsdelta *dd,
+         int merge) {
+  struct dsfile *dsf;
+  struct stat st;
+  int r = snap_load(ds, dsc);
+
+  if (!r)
+    return 0;
+  for(dsf = ds->ds_dsf; r > 0 && dsf; dsf = dsf->dsf_next) {
+    if (merge)
+      r = readdelta(dd, dsf, dsf->dsf_doff, dsc);
+    else if (stat(dsf->dsf_dname, &st) < 0)
+      r = dsf->dsf_dstamp ? -1 : 1;
     else
-      r = 1;
-    if (r > 0) r = readdslines(&is, ds, &dsc);
-    if (r > 0) r = fstat(fd, &st1) < 0 ? -1 : 1;
-    dsc.dsc_lineno = 0;
-    istream_destroy(&is);
-    close(fd);
-    if (!r)
-      goto fail;
+      r = st.st_mtime == dsf->dsf_dstamp && st.st_size == dsf->dsf_dsize ?
+          1 : -1;
     if (r < 0) {
-      dslog(LOG_ERR, &dsc, "error reading file: %s", strerror(errno));
-      goto fail;
-    }
-    if (st0.st_mtime != st1.st_mtime ||
-        st0.st_size  != st1.st_size) {
-      dslog(LOG_ERR, &dsc,
-            "file changed while we where reading it, data load aborted");
-      dslog(LOG_ERR, &dsc,
-            "do not write data files directly, "
-            "use temp file and rename(2) instead");
-      goto fail;
-    }
-    dsf->dsf_stamp = st0.st_mtime;
-    dsf->dsf_size  = st0.st_size;
+      dsc->dsc_fname = NULL;
+      dslog(LOG_INFO, dsc, "snapshot is out of date with delta files");
+    }
+  }
+  dsc->dsc_fname = NULL;
+  dsc->dsc_lineno = 0;
+  if (r > 0)
+    return 1;
+  delta_free(dd);
+  delta_init(dd);
+  freedataset(ds);
+  return 0;
+}
+
+static int
+loadversion(struct dataset *ds, struct dslogbuf *lb, unsigned nthreads) {
+  struct dsfile *dsf;
+  time_t stamp = 0;
+  struct dsctx dsc;
+  struct dsdelta dd;
+  /* deltas merged as entries rather than lines, the same way as
+   * loaddelta() does, so both give the same result */
+  int merge = isdstype(ds->ds_type, ip4set);
+  int snap;
+
+  freedataset(ds);
+
+  memset(&dsc, 0, sizeof(dsc));
+  dsc.dsc_ds = ds;
+  dsc.dsc_logbuf = lb;
+  delta_init(&dd);
+
+  if (!(snap = loadsnap(ds, &dsc, &dd, merge))) {
+    if (nthreads < 2 || loadparts(ds, &dsc, &dd, nthreads) < 0)
+      for(dsf = ds->ds_dsf; dsf; dsf = dsf->dsf_next)
+        if (!loadfile(ds, dsf, &dsc, &dd, merge, nthreads))
+          goto fail;
+  }
+
+  for(dsf = ds->ds_dsf; dsf; dsf = dsf->dsf_next) {
     if (dsf->dsf_stamp > stamp)
       stamp = dsf->dsf_stamp;
+    if (dsf->dsf_dstamp > stamp)
+      stamp = dsf->dsf_dstamp;
   }
   ds->ds_stamp = stamp;
   dsc.dsc_fname = NULL;
 
-  ds->ds_type->dst_finishfn(ds, &dsc);
+  if (!dd.dd_n)
+    ds->ds_type->dst_finishfn(ds, &dsc);
+  else if (!ds_ip4set_delta(ds, ds, &dd, &dsc))
+    dsc.dsc_nomem = 1;
+  if (dsc.dsc_nomem) {
+    dslog(LOG_ERR, &dsc, "out of memory loading dataset");
+    goto fail;
+  }
+  delta_free(&dd);
+  if (!snap)
+    snap_save(ds, &dsc);
 
   return 1;
 
 fail:
+  delta_free(&dd);
   freedataset(ds);
   for (dsf = ds->ds_dsf; dsf; dsf = dsf->dsf_next)
     dsf->dsf_stamp = 0;
@@ -453,6 +1275,147 @@ fail:
   return 0;
 }
 
+/* build a new version of ods from its data and the new lines of its
+ * delta files.  Returns -1 if the data files should be loaded instead. */
+static int loaddelta(struct dataset *ds, struct dataset *ods,
+                     struct dslogbuf *lb) {
+  struct dsfile *dsf;
+  struct dsdelta dd;
+  struct dsctx dsc;
+  struct stat st;
+  time_t stamp = ods->ds_stamp;
+  int r;
+
+  if (!isdstype(ds->ds_type, ip4set) || !stamp)
+    return -1;
+  for(dsf = ds->ds_dsf; dsf; dsf = dsf->dsf_next) {
+    if (stat(dsf->dsf_name, &st) < 0 ||
+        st.st_mtime != dsf->dsf_stamp || st.st_size != dsf->dsf_size)
+      return -1;		/* the data file itself has changed */
+    if (stat(dsf->dsf_dname, &st) < 0) {
+      if (dsf->dsf_dstamp)
+        return -1;		/* delta removed */
+    }
+    else if (st.st_size - dsf->dsf_dfull > dsf->dsf_size / 4)
+      return -1;		/* time to compact */
+  }
+
+  memset(&dsc, 0, sizeof(dsc));
+  dsc.dsc_ds = ds;
+  dsc.dsc_logbuf = lb;
+  delta_init(&dd);
+  for(dsf = ds->ds_dsf; dsf; dsf = dsf->dsf_next) {
+    if ((r = readdelta(&dd, dsf, dsf->dsf_doff, &dsc)) <= 0) {
+      delta_free(&dd);
+      return r ? r : -1;
+    }
+    if (dsf->dsf_dstamp > stamp)
+      stamp = dsf->dsf_dstamp;
+  }
+
+  /* the new version takes over all memory of the old one */
+  *ds->ds_mp = *ods->ds_mp;
+  mp_init(ods->ds_mp);
+  ds->ds_stamp = stamp;
+  ds->ds_expires = ods->ds_expires;
+  ds->ds_dssoa = ods->ds_dssoa;
+  ds->ds_dsns = ods->ds_dsns;
+  ds->ds_nsttl = ods->ds_nsttl;
+  ds->ds_ttl = ods->ds_ttl;
+  memcpy(ds->ds_subst, ods->ds_subst, sizeof(ds->ds_subst));
+
+  r = rrtxt_copy(ds, ods) && ds_ip4set_delta(ds, ods, &dd, &dsc);
+  delta_free(&dd);
+  if (!r) {		/* out of memory: give it back, try full load */
+    rrtxt_free(ds);
+    *ods->ds_mp = *ds->ds_mp;
+    mp_init(ds->ds_mp);
+    return -1;
+  }
+  return 1;
+}
+
+/* Datasets to reload are loaded by up to nthreads threads at once,
+ * each taking the next dataset from the list when done with the
+ * previous one (a combined dataset is loaded together with all its
+ * subsets).  Threads left over when there are fewer datasets than
+ * threads are used to load big files in parts.  Loading a new version
+ * touches nothing shared, and log lines are saved per dataset.  When
+ * all loads are done, the logs are written out and the new versions
+ * made current, in list order. */
+
+struct dsload {
+  struct dataset *dl_ds, *dl_nds;	/* current and new version */
+  int dl_r;
+  struct dslogbuf dl_log;
+};
+
+struct dsloads {
+  struct dsload *l_v;
+  unsigned l_n;
+  unsigned l_nthreads;		/* threads loading datasets */
+  unsigned l_pthreads;		/* threads loading parts of each */
+};
+
+static void loadone(void *arg, unsigned i) {
+  struct dsloads *ls = (struct dsloads *)arg;
+  struct dsload *dl = &ls->l_v[i];
+  struct dslogbuf *lb = ls->l_nthreads > 1 ? &dl->dl_log : NULL;
+  if (!dl->dl_nds)
+    return;
+  dl->dl_r = loaddelta(dl->dl_nds, dl->dl_ds, lb);
+  if (dl->dl_r < 0)
+    dl->dl_r = loadversion(dl->dl_nds, lb, ls->l_pthreads);
+}
+
+/* load new versions of all changed datasets and make them current.
+ * If there's no memory for a new version, the dataset is left in place,
+ * to be reloaded again next time.  Returns 0 if any load failed. */
+int loaddatasets(struct zone *zonelist, unsigned nthreads) {
+  struct dsloads ls;
+  struct dataset *ds;
+  unsigned i, a = 0;
+  int r = 1;
+
+  ls.l_v = NULL;
+  ls.l_n = 0;
+  for(ds = nextdataset2reload(NULL); ds; ds = nextdataset2reload(ds)) {
+    if (ls.l_n >= a) {
+      struct dsload *v = trealloc(struct dsload, ls.l_v, a ? a * 2 : 16);
+      if (!v)
+        break;
+      ls.l_v = v;
+      a = a ? a * 2 : 16;
+    }
+    memset(&ls.l_v[ls.l_n], 0, sizeof(struct dsload));
+    ls.l_v[ls.l_n].dl_ds = ds;
+    ls.l_v[ls.l_n++].dl_nds = newversion(ds);
+  }
+  if (ds)
+    r = 0;		/* out of memory, reload the rest next time */
+
+#ifdef NO_THREADS
+  nthreads = 1;
+#endif
+  ls.l_nthreads = nthreads < ls.l_n ? nthreads : ls.l_n;
+  ls.l_pthreads = ls.l_nthreads ? nthreads / ls.l_nthreads : 1;
+  runjobs(ls.l_nthreads, ls.l_n, loadone, &ls);
+
+  for(i = 0; i < ls.l_n; ++i) {
+    struct dsload *dl = &ls.l_v[i];
+    dslogflush(&dl->dl_log);
+    if (!dl->dl_nds)
+      r = 0;
+    else {
+      replacedataset(zonelist, dl->dl_ds, dl->dl_nds);
+      if (!dl->dl_r)
+        r = 0;
+    }
+  }
+  free(ls.l_v);
+  return r;
+}
+
 /* find next dataset which needs reloading */
 struct dataset *nextdataset2reload(struct dataset *ds) {
   struct dsfile *dsf;
@@ -464,10 +1427,115 @@ struct dataset *nextdataset2reload(struct dataset *ds) {
       if (dsf->dsf_stamp != st.st_mtime ||
           dsf->dsf_size  != st.st_size)
         return ds;
+      if (stat(dsf->dsf_dname, &st) < 0) {
+        if (dsf->dsf_dstamp)
+          return ds;
+      }
+      else if (dsf->dsf_dstamp != st.st_mtime ||
+               dsf->dsf_dsize  != st.st_size)
+        return ds;
     }
   return NULL;
 }
 
+#ifndef NO_INOTIFY
+
+/* Directories of data files are watched rather than the files, so a
+ * file replaced by rename(2) is noticed as well as one written in
+ * place.  Events are matched against (directory, file name) pairs. */
+
+struct dswatch {
+  int w_wd;		/* watch descriptor of the directory */
+  const char *w_name;	/* file name within the directory */
+};
+
+static struct dswatch *dswatch;
+static unsigned ndswatch, adswatch;
+
+static int dswatch_add(int fd, const char *file) {
+  const char *name = strrchr(file, '/');
+  char *dir;
+  int wd;
+
+  if (ndswatch >= adswatch) {
+    struct dswatch *w =
+      trealloc(struct dswatch, dswatch, adswatch ? adswatch * 2 : 16);
+    if (!w)
+      return 0;
+    dswatch = w;
+    adswatch = adswatch ? adswatch * 2 : 16;
+  }
+  if (!name)
+    dir = estrdup(".");
+  else if (name == file)
+    dir = estrdup("/");
+  else if ((dir = emalloc(name - file + 1)) != NULL) {
+    memcpy(dir, file, name - file);
+    dir[name - file] = '\0';
+  }
+  if (!dir)
+    return 0;
+  wd = inotify_add_watch(fd, dir,
+                         IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB |
+                         IN_CREATE | IN_DELETE |
+                         IN_MOVED_FROM | IN_MOVED_TO);
+  if (wd < 0)
+    dslog(LOG_WARNING, 0, "unable to watch directory %s: %s",
+          dir, strerror(errno));
+  free(dir);
+  if (wd < 0)
+    return 0;
+  dswatch[ndswatch].w_wd = wd;
+  dswatch[ndswatch++].w_name = name ? name + 1 : file;
+  return 1;
+}
+
+int watchdatasets(void) {
+  struct dataset *ds;
+  struct dsfile *dsf;
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0) {
+    dslog(LOG_WARNING, 0, "unable to initialize inotify: %s",
+          strerror(errno));
+    return -1;
+  }
+  for(ds = ds_list; ds; ds = ds->ds_next)
+    for(dsf = ds->ds_dsf; dsf; dsf = dsf->dsf_next)
+      if (!dswatch_add(fd, dsf->dsf_name) ||
+          !dswatch_add(fd, dsf->dsf_dname)) {
+        close(fd);
+        free(dswatch);
+        dswatch = NULL;
+        ndswatch = adswatch = 0;
+        return -1;
+      }
+  return fd;
+}
+
+int watchedchange(int fd) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  int n, r = 0;
+  unsigned i;
+
+  while((n = read(fd, buf, sizeof(buf))) > 0)
+    for(ev = (struct inotify_event *)buf; (char*)ev < buf + n;
+        ev = (struct inotify_event *)((char*)(ev + 1) + ev->len)) {
+      if (ev->mask & (IN_Q_OVERFLOW | IN_IGNORED))
+        r = 1;		/* events lost, or directory gone */
+      else if (ev->len)
+        for(i = 0; i < ndswatch; ++i)
+          if (dswatch[i].w_wd == ev->wd &&
+              strcmp(dswatch[i].w_name, ev->name) == 0) {
+            r = 1;
+            break;
+          }
+    }
+  return r;
+}
+
+#endif /* NO_INOTIFY */
+
 #ifndef NO_MASTER_DUMP
 void dumpzone(const struct zone *z, FILE *f) {
   const struct dslist *dsl;
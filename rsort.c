@@ -0,0 +1,90 @@
+/* LSD radix sort of an array by a key of a few bytes, for big arrays
+ * of addresses, where it is several times faster than qsort.c.
+ *
+ * Usage (similar to qsort.c):
+ * first, define the following:
+ *  QSORT_TYPE, QSORT_BASE, QSORT_NELT, QSORT_LT - as for qsort.c, which
+ *    is used instead for small arrays, and when there's no memory for
+ *    a temporary copy of the array
+ *  RSORT_NBYTES - number of bytes in the key
+ *  RSORT_BYTE(p,i) - i-th byte of the key of *p, 0 is the least
+ *    significant one.  Keys should be ordered the same way as QSORT_LT
+ *    orders elements, but QSORT_LT may look at more than the key:
+ *  RSORT_KEYEQ(a,b) - (optional) should return true if *a and *b have
+ *    the same key.  If defined, runs of elements with equal keys are
+ *    sorted by QSORT_LT afterwards, so the result is the same as with
+ *    qsort.c.  Otherwise, such elements are left in their original order.
+ * and second, just #include this file into the place you want it.
+ *
+ * Counts of all key bytes are collected in one pass over the array, and
+ * bytes which are the same in all keys (like the low byte of /24 ranges)
+ * need no pass at all.  Every other byte moves all elements to the other
+ * array and back, so the result may need to be copied back at the end.
+ */
+
+#define _RSORT_MIN	256	/* smaller arrays are sorted by qsort.c */
+
+{
+  QSORT_TYPE *_rs_tmp = NULL;
+
+  if ((QSORT_NELT) >= _RSORT_MIN)
+    _rs_tmp = (QSORT_TYPE *)malloc((QSORT_NELT) * sizeof(QSORT_TYPE));
+
+  if (!_rs_tmp) {
+#   include "qsort.c"
+  }
+  else {
+    unsigned _rs_cnt[RSORT_NBYTES][256];
+    QSORT_TYPE *_rs_src = (QSORT_BASE), *_rs_dst = _rs_tmp, *_rs_p, *_rs_t;
+    unsigned _rs_n = (QSORT_NELT), _rs_i, _rs_b, _rs_s, _rs_x;
+
+    memset(_rs_cnt, 0, sizeof(_rs_cnt));
+    for(_rs_p = _rs_src, _rs_t = _rs_src + _rs_n; _rs_p < _rs_t; ++_rs_p)
+      for(_rs_i = 0; _rs_i < (RSORT_NBYTES); ++_rs_i)
+        ++_rs_cnt[_rs_i][RSORT_BYTE(_rs_p, _rs_i)];
+
+    for(_rs_i = 0; _rs_i < (RSORT_NBYTES); ++_rs_i) {
+      unsigned *_rs_c = _rs_cnt[_rs_i];
+      if (_rs_c[RSORT_BYTE(_rs_src, _rs_i)] == _rs_n)
+        continue;		/* this byte is the same in all keys */
+      for(_rs_b = _rs_s = 0; _rs_b < 256; ++_rs_b) {
+        _rs_x = _rs_c[_rs_b];
+        _rs_c[_rs_b] = _rs_s;
+        _rs_s += _rs_x;
+      }
+      for(_rs_p = _rs_src, _rs_t = _rs_src + _rs_n; _rs_p < _rs_t; ++_rs_p)
+        _rs_dst[_rs_c[RSORT_BYTE(_rs_p, _rs_i)]++] = *_rs_p;
+      _rs_p = _rs_src; _rs_src = _rs_dst; _rs_dst = _rs_p;
+    }
+    if (_rs_src != (QSORT_BASE))
+      memcpy((QSORT_BASE), _rs_src, _rs_n * sizeof(QSORT_TYPE));
+    free(_rs_tmp);
+
+#ifdef RSORT_KEYEQ
+    /* sort runs of equal keys by QSORT_LT, using shell sort: runs are
+     * usually short, but may be long, and it needs no more memory */
+    _rs_src = (QSORT_BASE);
+    for(_rs_i = 0; _rs_i < _rs_n; _rs_i = _rs_b) {
+      for(_rs_b = _rs_i + 1;
+          _rs_b < _rs_n && RSORT_KEYEQ(&_rs_src[_rs_i], &_rs_src[_rs_b]);
+          ++_rs_b)
+        ;
+      if (_rs_b - _rs_i < 2)
+        continue;
+      for(_rs_s = 1; _rs_s < (_rs_b - _rs_i) / 3; _rs_s = _rs_s * 3 + 1)
+        ;
+      for(; _rs_s; _rs_s /= 3)
+        for(_rs_x = _rs_i + _rs_s; _rs_x < _rs_b; ++_rs_x) {
+          QSORT_TYPE _rs_hold = _rs_src[_rs_x];
+          unsigned _rs_j = _rs_x;
+          while(_rs_j >= _rs_i + _rs_s &&
+                QSORT_LT(&_rs_hold, &_rs_src[_rs_j - _rs_s])) {
+            _rs_src[_rs_j] = _rs_src[_rs_j - _rs_s];
+            _rs_j -= _rs_s;
+          }
+          _rs_src[_rs_j] = _rs_hold;
+        }
+    }
+#endif
+  }
+}
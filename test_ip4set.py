@@ -0,0 +1,191 @@
+""" Tests for the ip4set dataset
+"""
+import os
+import time
+import unittest
+
+import DNS
+
+from rbldnsd import Rbldnsd, ZoneFile
+
+__all__ = [
+    'TestIp4SetRanges',
+    'TestIp4SetDelta',
+    ]
+
+def ip4set(zone):
+    """ Run rbldnsd with an ip4set dataset
+    """
+    dnsd = Rbldnsd()
+    dnsd.add_dataset('ip4set', zone)
+    return dnsd
+
+def reversed_ip(ip4addr, domain='example.com'):
+    revip = '.'.join(reversed(ip4addr.split('.')))
+    return "%s.%s" % (revip, domain)
+
+def write_delta(zone, lines, mode='a'):
+    """ Write (or append) lines to the delta file of zone
+    """
+    with open(zone.name + '.delta', mode) as f:
+        f.writelines("%s\n" % line for line in lines)
+
+def wait_for(dnsd, addr, answer, timeout=5):
+    """ Query addr until the answer is as expected, after a reload
+    """
+    deadline = time.time() + timeout
+    while dnsd.query(reversed_ip(addr)) != answer:
+        if time.time() > deadline:
+            raise AssertionError("%s: no %r after reload" % (addr, answer))
+        time.sleep(0.05)
+
+def txts(dnsd, addr):
+    """ All TXT answers for addr, sorted
+    """
+    req = DNS.Request(name=reversed_ip(addr), qtype='TXT', rd=0)
+    resp = req.req(server=dnsd.daemon_addr, port=dnsd.daemon_port)
+    return sorted(a['data'][0] for a in resp.answers)
+
+def rss(dnsd):
+    """ Resident set size of the daemon, in Kb
+    """
+    with open('/proc/%d/status' % dnsd._daemon.pid) as f:
+        for line in f:
+            if line.startswith('VmRSS:'):
+                return int(line.split()[1])
+
+class TestIp4SetRanges(unittest.TestCase):
+    def assertListed(self, dnsd, listed):
+        for addr, values in listed:
+            self.assertEqual(txts(dnsd, addr), sorted(values), addr)
+
+    def test_overlapping(self):
+        with ip4set(ZoneFile(["1.2.3.1-1.2.3.10 :2:a",
+                              "1.2.3.5-1.2.3.20 :2:a",
+                              "1.2.3.15-1.2.3.30 :2:b",
+                              "1.2.4.0/24 :2:c",
+                              "1.2.4.0-1.2.5.9 :2:d"])) as dnsd:
+            self.assertListed(dnsd, [("1.2.3.0", []),
+                                     ("1.2.3.1", [b"a"]),
+                                     ("1.2.3.10", [b"a"]),
+                                     ("1.2.3.14", [b"a"]),
+                                     ("1.2.3.15", [b"a", b"b"]),
+                                     ("1.2.3.20", [b"a", b"b"]),
+                                     ("1.2.3.21", [b"b"]),
+                                     ("1.2.3.30", [b"b"]),
+                                     ("1.2.3.31", []),
+                                     ("1.2.4.0", [b"c", b"d"]),
+                                     ("1.2.4.255", [b"c", b"d"]),
+                                     ("1.2.5.9", [b"d"]),
+                                     ("1.2.5.10", [])])
+
+    def test_adjacent(self):
+        with ip4set(ZoneFile(["1.2.3.0-1.2.3.127 :2:a",
+                              "1.2.3.128-1.2.3.255 :2:a",
+                              "1.2.4.0-1.2.4.99 :2:b",
+                              "1.2.3.250-1.2.4.5 :2:c",
+                              "1.3.0.0-1.3.1.10 :2:d"])) as dnsd:
+            self.assertListed(dnsd, [("1.2.3.127", [b"a"]),
+                                     ("1.2.3.128", [b"a"]),
+                                     ("1.2.3.249", [b"a"]),
+                                     ("1.2.3.250", [b"a", b"c"]),
+                                     ("1.2.4.0", [b"b", b"c"]),
+                                     ("1.2.4.5", [b"b", b"c"]),
+                                     ("1.2.4.6", [b"b"]),
+                                     ("1.2.4.100", []),
+                                     ("1.3.0.77", [b"d"]),
+                                     ("1.3.1.10", [b"d"]),
+                                     ("1.3.1.11", [])])
+
+    def test_exclusions(self):
+        with ip4set(ZoneFile(["1.2.0.0/16 :2:a",
+                              "!1.2.6.0/24",
+                              "!1.2.7.7",
+                              "1.2.8.1-1.2.8.20 :2:b",
+                              "1.2.8.5-1.2.8.15 :2:c",
+                              "!1.2.8.10",
+                              "!1.2.8.12-1.2.8.30"])) as dnsd:
+            self.assertListed(dnsd, [("1.2.5.255", [b"a"]),
+                                     ("1.2.6.0", []),
+                                     ("1.2.6.255", []),
+                                     ("1.2.7.6", [b"a"]),
+                                     ("1.2.7.7", []),
+                                     ("1.2.7.8", [b"a"]),
+                                     ("1.2.8.0", [b"a"]),
+                                     ("1.2.8.4", [b"b"]),
+                                     ("1.2.8.9", [b"b", b"c"]),
+                                     ("1.2.8.10", []),
+                                     ("1.2.8.11", [b"b", b"c"]),
+                                     ("1.2.8.12", []),
+                                     ("1.2.8.30", []),
+                                     ("1.2.8.31", [b"a"])])
+
+DATA = ["10.0.0.0/24 :2:block",
+        "10.0.1.1-10.0.1.20 :2:range",
+        "10.0.2.1 :2:single"]
+
+class TestIp4SetDelta(unittest.TestCase):
+    def assertAnswers(self, dnsd, answers):
+        for addr, answer in answers:
+            self.assertEqual(dnsd.query(reversed_ip(addr)), answer, addr)
+
+    # after both deltas below: what incremental and full loads give
+    ANSWERS = [("10.0.0.9", b"block"),	# a /24 is not split by -addr
+               ("10.0.0.10", None),	# but an exclusion works
+               ("10.0.0.11", b"block"),
+               ("10.0.1.8", b"range"),
+               ("10.0.1.9", None),	# removed from a range of /32s
+               ("10.0.1.10", b"range"),
+               ("10.0.2.1", None),	# removed as a whole line
+               ("10.0.3.1", b"added"),
+               ("10.0.3.2", None)]	# added and removed again
+
+    def test_add_remove(self):
+        zone = ZoneFile(DATA)
+        write_delta(zone, ["$SEQ 1", "+10.0.3.1 :2:added"], 'w')
+        with ip4set(zone) as dnsd:
+            self.assertAnswers(dnsd, [("10.0.3.1", b"added"),
+                                      ("10.0.2.1", b"single")])
+            write_delta(zone, ["+10.0.3.2 :2:added",
+                               "-10.0.2.1 :2:single",
+                               "-10.0.0.9 :2:block",
+                               "+!10.0.0.10",
+                               "-10.0.1.9 :2:range",
+                               "-10.0.3.2 :2:added"])
+            dnsd.reload()
+            wait_for(dnsd, "10.0.2.1", None)
+            self.assertAnswers(dnsd, self.ANSWERS)
+
+        # a full load of the same files gives the same data
+        with ip4set(zone) as dnsd:
+            self.assertAnswers(dnsd, self.ANSWERS)
+
+    def test_remove_unknown_value(self):
+        # removing with another value leaves the entry alone
+        zone = ZoneFile(DATA)
+        write_delta(zone, ["$SEQ 1"], 'w')
+        with ip4set(zone) as dnsd:
+            write_delta(zone, ["-10.0.2.1 :2:other",
+                               "+10.0.3.1 :2:added"])
+            dnsd.reload()
+            wait_for(dnsd, "10.0.3.1", b"added")
+            self.assertAnswers(dnsd, [("10.0.2.1", b"single")])
+
+    @unittest.skipUnless(os.path.exists('/proc/self/status'), "no /proc")
+    def test_reloads_memory(self):
+        # every entry has its own TXT template; reloads which add a
+        # line each must not compile them all again
+        zone = ZoneFile(["10.%d.%d.1 :2:%d%s" % (i >> 8, i & 255, i, "x" * 100)
+                         for i in range(20000)])
+        write_delta(zone, ["$SEQ 1"], 'w')
+        with ip4set(zone) as dnsd:
+            sizes = []
+            for i in range(10):
+                write_delta(zone, ["+10.200.0.%d :2:added" % i])
+                dnsd.reload()
+                wait_for(dnsd, "10.200.0.%d" % i, b"added")
+                sizes.append(rss(dnsd))
+            self.assertLess(sizes[-1] - sizes[1], 2048, sizes)
+
+if __name__ == '__main__':
+    unittest.main()
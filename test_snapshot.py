@@ -0,0 +1,82 @@
+""" Tests for dataset snapshots (-Z option)
+"""
+import os
+import shutil
+from tempfile import mkdtemp
+import unittest
+
+from rbldnsd import Rbldnsd, ZoneFile
+
+__all__ = [
+    'TestSnapshot',
+    ]
+
+IP4SET = ["1.2.3.0/24 :2:net $",
+          "1.2.3.4 :3:host",
+          "!1.2.3.5",
+          "1.2.4.1-1.2.4.9 :2:range",
+          "1.2.4.0/24 :4:block",
+          "10.0.0.0/8 :2:big"]
+
+IP4SET_QUERIES = ["1.2.3.4", "1.2.3.5", "1.2.3.6", "1.2.4.1", "1.2.4.9",
+                  "1.2.4.10", "10.2.3.4", "1.1.1.1"]
+
+DNSET = [":2:listed",
+         "example.net",
+         "*.wild.example.net :3:wild",
+         "!not.wild.example.net",
+         ".both.example.net :4:both"]
+
+DNSET_QUERIES = ["example.net", "www.example.net", "a.wild.example.net",
+                 "wild.example.net", "not.wild.example.net",
+                 "both.example.net", "x.both.example.net", "other.org"]
+
+def daemon(ip4set, dnset, snapdir=None):
+    """ Run rbldnsd with an ip4set and a dnset dataset
+    """
+    dnsd = Rbldnsd(options=['-Z', snapdir] if snapdir else [])
+    dnsd.add_dataset('ip4set', ip4set, soa='ip4.example.com')
+    dnsd.add_dataset('dnset', dnset, soa='dn.example.com')
+    return dnsd
+
+def answers(dnsd):
+    """ Answers to all test queries, TXT and A
+    """
+    names = ['%s.ip4.example.com' % '.'.join(reversed(q.split('.')))
+             for q in IP4SET_QUERIES]
+    names += ['%s.dn.example.com' % q for q in DNSET_QUERIES]
+    return [(name, qtype, dnsd.query(name, qtype))
+            for name in names for qtype in ('TXT', 'A')]
+
+class TestSnapshot(unittest.TestCase):
+    def setUp(self):
+        self.snapdir = mkdtemp()
+        self.ip4set = ZoneFile(IP4SET)
+        self.dnset = ZoneFile(DNSET)
+
+    def tearDown(self):
+        shutil.rmtree(self.snapdir)
+
+    def test_roundtrip(self):
+        with daemon(self.ip4set, self.dnset) as dnsd:
+            expected = answers(dnsd)
+
+        with daemon(self.ip4set, self.dnset, self.snapdir) as dnsd:
+            self.assertEqual(answers(dnsd), expected)
+        self.assertNotIn(b'loaded from snapshot', dnsd.output())
+        self.assertEqual(len(os.listdir(self.snapdir)), 2)
+
+        with daemon(self.ip4set, self.dnset, self.snapdir) as dnsd:
+            self.assertEqual(answers(dnsd), expected)
+        self.assertEqual(dnsd.output().count(b'loaded from snapshot'), 2)
+
+    def test_changed_file(self):
+        with daemon(self.ip4set, self.dnset, self.snapdir) as dnsd:
+            pass
+        self.ip4set.writelines(["5.6.7.8 :2:new"])
+        with daemon(self.ip4set, self.dnset, self.snapdir) as dnsd:
+            self.assertEqual(dnsd.query('8.7.6.5.ip4.example.com'), b'new')
+        self.assertEqual(dnsd.output().count(b'loaded from snapshot'), 1)
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,157 @@
+""" Tests for DNS over TCP (-S option)
+"""
+import socket
+import struct
+import threading
+import time
+import unittest
+
+from rbldnsd import Rbldnsd, ZoneFile
+
+__all__ = [
+    'TestTcp',
+    'TestUdpOnly',
+    ]
+
+no_tcp = not Rbldnsd().has_option('-S')
+
+def tcp_daemon(zone_data, tcp=True):
+    """ Run rbldnsd answering over TCP (or not) with an ip4set dataset
+    """
+    dnsd = Rbldnsd(daemon_addr='127.0.0.1',
+                   options=['-S', '10'] if tcp else [])
+    dnsd.add_dataset('ip4set', ZoneFile(zone_data))
+    return dnsd
+
+# 8 TXT RRs of 200 bytes do not fit in a 512-byte UDP reply
+LONG_TXTS = ["1.2.3.4 :2:%d%s" % (i, "x" * 200) for i in range(8)]
+
+def query_packet(qid, name, qtype=16):
+    """ A query packet (TXT by default)
+    """
+    q = struct.pack('>HHHHHH', qid, 0, 1, 0, 0, 0)
+    for label in name.split('.'):
+        q += struct.pack('B', len(label)) + label.encode('ascii')
+    return q + struct.pack('>BHH', 0, qtype, 1)
+
+def tcp_query(qid, name, qtype=16):
+    """ A length-prefixed query packet
+    """
+    q = query_packet(qid, name, qtype)
+    return struct.pack('>H', len(q)) + q
+
+def udp_query(dnsd, qid, name, qtype=16):
+    """ Query over UDP, return (id, flags, ancount) of the reply
+    """
+    udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    udp.settimeout(5)
+    try:
+        udp.sendto(query_packet(qid, name, qtype),
+                   (dnsd.daemon_addr, dnsd.daemon_port))
+        reply = udp.recv(65536)
+    finally:
+        udp.close()
+    qid, flags, qdcount, ancount = struct.unpack('>HHHH', reply[:8])
+    return qid, flags, ancount
+
+def recv_exactly(sock, n):
+    data = b''
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            break
+        data += chunk
+    return data
+
+def recv_reply(sock):
+    """ Read one reply and return (id, rcode, ancount), or None on EOF
+    """
+    hdr = recv_exactly(sock, 2)
+    if len(hdr) < 2:
+        return None
+    (rlen,) = struct.unpack('>H', hdr)
+    reply = recv_exactly(sock, rlen)
+    qid, flags, qdcount, ancount = struct.unpack('>HHHH', reply[:8])
+    return qid, flags & 15, ancount
+
+@unittest.skipIf(no_tcp, "rbldnsd compiled without TCP support")
+class TestTcp(unittest.TestCase):
+    def setUp(self):
+        self.sock = None
+
+    def tearDown(self):
+        if self.sock:
+            self.sock.close()
+
+    def connect(self, dnsd):
+        self.sock = socket.create_connection((dnsd.daemon_addr,
+                                              dnsd.daemon_port))
+        self.sock.settimeout(5)
+        return self.sock
+
+    def test_query(self):
+        with tcp_daemon(["1.2.3.4 :2:listed"]) as dnsd:
+            sock = self.connect(dnsd)
+            sock.sendall(tcp_query(1, '4.3.2.1.example.com'))
+            self.assertEqual(recv_reply(sock), (1, 0, 1))
+            sock.sendall(tcp_query(2, '5.3.2.1.example.com'))
+            self.assertEqual(recv_reply(sock), (2, 3, 0))
+
+    def test_pipelined(self):
+        with tcp_daemon(["1.2.3.4 :2:listed"]) as dnsd:
+            sock = self.connect(dnsd)
+            sock.sendall(tcp_query(1, '4.3.2.1.example.com') +
+                         tcp_query(2, '5.3.2.1.example.com') +
+                         tcp_query(3, '4.3.2.1.example.com'))
+            self.assertEqual(recv_reply(sock), (1, 0, 1))
+            self.assertEqual(recv_reply(sock), (2, 3, 0))
+            self.assertEqual(recv_reply(sock), (3, 0, 1))
+
+    def test_split_query(self):
+        with tcp_daemon(["1.2.3.4 :2:listed"]) as dnsd:
+            sock = self.connect(dnsd)
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            q = tcp_query(1, '4.3.2.1.example.com')
+            for part in (q[:1], q[1:10], q[10:]):
+                sock.sendall(part)
+                time.sleep(0.1)
+            self.assertEqual(recv_reply(sock), (1, 0, 1))
+
+    def test_truncated_udp(self):
+        with tcp_daemon(LONG_TXTS) as dnsd:
+            qid, flags, ancount = udp_query(dnsd, 1, '4.3.2.1.example.com')
+            self.assertTrue(flags & 0x0200, "TC flag is not set")
+            sock = self.connect(dnsd)
+            sock.sendall(tcp_query(2, '4.3.2.1.example.com'))
+            self.assertEqual(recv_reply(sock), (2, 0, 8))
+
+    def test_pipelined_while_replies_queued(self):
+        # the client writes many queries before reading any reply, so
+        # the daemon has to queue replies and stop reading for a while
+        nqueries = 20000
+        with tcp_daemon(["1.2.3.4 :2:" + "x" * 250]) as dnsd:
+            sock = self.connect(dnsd)
+            queries = b''.join(tcp_query(i, '4.3.2.1.example.com')
+                               for i in range(nqueries))
+            sender = threading.Thread(target=sock.sendall, args=(queries,))
+            sender.start()
+            time.sleep(0.5)
+            ids = []
+            for i in range(nqueries):
+                reply = recv_reply(sock)
+                if reply is None:
+                    break
+                ids.append(reply[0])
+            sender.join()
+            self.assertEqual(ids, list(range(nqueries)))
+
+class TestUdpOnly(unittest.TestCase):
+    def test_not_truncated(self):
+        # without -S, a client can't retry over TCP, so it gets what fits
+        with tcp_daemon(LONG_TXTS, tcp=False) as dnsd:
+            qid, flags, ancount = udp_query(dnsd, 1, '4.3.2.1.example.com')
+            self.assertFalse(flags & 0x0200, "TC flag is set")
+            self.assertTrue(0 < ancount < 8)
+
+if __name__ == '__main__':
+    unittest.main()
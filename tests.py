@@ -13,6 +13,9 @@ from test_btrie import *
 from test_ip6trie import *
 from test_ip4trie import *
 from test_acl import *
+from test_tcp import *
+from test_ip4set import *
+from test_snapshot import *
 
 if __name__ == '__main__':
     unittest.main()